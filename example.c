@@ -1,13 +1,23 @@
 #include "linenoise.h"
+#include "example_commands.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 LinenoiseState *ls = NULL;
 
 void completion(const char *buf, LinenoiseCompletions *lc)
 {
+	/* The commands come from a table generated at build time. */
+	if (buf[0] == '/')
+	{
+		LinenoiseCommandTableComplete(&example_commands, buf, lc, 0);
+		return;
+	}
+
 	if (!strcasecmp(buf, "hello"))
 	{
 		LinenoiseAddCompletion(lc, "hello World");
@@ -22,6 +32,19 @@ void completion(const char *buf, LinenoiseCompletions *lc)
 
 char *hints(const char *buf, int *color, int *bold)
 {
+	/* Flag a command as soon as no command can start like it. */
+	if (buf[0] == '/')
+	{
+		size_t len = strcspn(buf, " ");
+
+		if (LinenoiseCommandTableContains(&example_commands, buf, len) ||
+			(buf[len] == '\0' && LinenoiseCommandTableComplete(&example_commands, buf, NULL, 1)))
+			return NULL;
+		*color = 31;
+		*bold  = 0;
+		return " <unknown command>";
+	}
+
 	if (!strcasecmp(buf, "hello"))
 	{
 		*color = 35;
@@ -31,6 +54,85 @@ char *hints(const char *buf, int *color, int *bold)
 	return NULL;
 }
 
+static double Elapsed(const struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start->tv_sec) + (end.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Find every entry containing 'needle', newest first. */
+static int SearchAll(LinenoiseState *state, const char *needle)
+{
+	int j, found = 0;
+
+	for (j = LinenoiseHistorySearch(state, needle, state->history_len - 1); j != -1;
+		 j = LinenoiseHistorySearch(state, needle, j - 1))
+		found++;
+	return found;
+}
+
+/* Time history substring searches with a linear strstr() scan and with the
+ * trigram index, on made up histories of growing size. */
+static void BenchSearch(void)
+{
+	static const char *words[]	 = {"git",	"commit", "make",  "grep", "ls",   "cd",	  "docker", "ssh",
+									"vim",	"cargo",  "build", "test", "push", "origin", "main",	  "-rf",
+									"src/", "install", "run",  "logs", "tail", "curl"};
+	static const char *needles[] = {"docker logs", "origin main", "#123456", "curl ssh", "no such entry"};
+	static const int   sizes[]	 = {10000, 100000, 1000000};
+	const int		   nwords	 = sizeof(words) / sizeof(*words);
+	unsigned int	   seed		 = 1;
+	size_t			   j, k;
+
+	printf("%9s  %-15s %8s %12s %12s %8s\n", "entries", "needle", "matches", "linear scan", "trigrams", "speedup");
+	for (j = 0; j < sizeof(sizes) / sizeof(*sizes); j++)
+	{
+		/* No terminal: the state is never edited, and this keeps it from
+		 * querying the cursor position when the output is a pipe. */
+		LinenoiseState *state = LinenoiseCreate(-1, -1, -1, "> ");
+		struct timespec start;
+		double			build, scan[sizeof(needles) / sizeof(*needles)], indexed;
+		char			line[128];
+		int				n, found[sizeof(needles) / sizeof(*needles)];
+
+		LinenoiseHistorySetMaxLen(state, sizes[j]);
+		for (n = 0; n < sizes[j]; n++)
+		{
+			seed = seed * 1103515245 + 12345;
+			snprintf(line, sizeof(line), "%s %s %s %s #%d", words[(seed >> 8) % nwords], words[(seed >> 13) % nwords],
+					 words[(seed >> 18) % nwords], words[(seed >> 23) % nwords], n);
+			LinenoiseHistoryAdd(state, line);
+		}
+
+		for (k = 0; k < sizeof(needles) / sizeof(*needles); k++)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			found[k] = SearchAll(state, needles[k]);
+			scan[k]	 = Elapsed(&start);
+		}
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		LinenoiseHistorySetTrigramIndex(state, 1);
+		build = Elapsed(&start);
+		for (k = 0; k < sizeof(needles) / sizeof(*needles); k++)
+		{
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			n		= SearchAll(state, needles[k]);
+			indexed = Elapsed(&start);
+			if (n != found[k])
+			{
+				fprintf(stderr, "The index and the scan disagree on '%s'.\n", needles[k]);
+				exit(1);
+			}
+			printf("%9d  %-15s %8d %9.3f ms %9.3f ms %7.1fx\n", sizes[j], needles[k], n, scan[k] * 1e3, indexed * 1e3,
+				   scan[k] / indexed);
+		}
+		printf("%9d  index built in %.2f ms\n", sizes[j], build * 1e3);
+		LinenoiseFreeState(state);
+	}
+}
+
 void AtExit(void)
 {
 	LinenoiseRestore(ls);
@@ -40,7 +142,15 @@ void AtExit(void)
 int main(int argc, char **argv)
 {
 	char *line;
-	char *prgname = argv[0];
+	char *prgname	  = argv[0];
+	int	  autosuggest = 0;
+
+	/* The benchmark makes its own states, without a terminal. */
+	if (argc == 2 && !strcmp(argv[1], "--bench-search"))
+	{
+		BenchSearch();
+		return 0;
+	}
 
 	ls = LinenoiseCreate(STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, "> ");
 	atexit(AtExit);
@@ -55,14 +165,41 @@ int main(int argc, char **argv)
 			LinenoiseSetMultiLine(ls, true);
 			printf("Multi-line mode enabled.\n");
 		}
+		else if (!strcmp(*argv, "--autosuggest"))
+		{
+			autosuggest = 1;
+			printf("History autosuggestions enabled.\n");
+		}
 		else if (!strcmp(*argv, "--keycodes"))
 		{
 			LinenoisePrintKeyCodes(ls);
 			exit(0);
 		}
+		else if (!strcmp(*argv, "--import") && argc > 1)
+		{
+			/* Import a (huge) history file and report the throughput. */
+			struct timespec start, end;
+			struct stat		st;
+			double			secs;
+
+			argc--;
+			argv++;
+			LinenoiseHistorySetMaxLen(ls, 100000);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			if (stat(*argv, &st) == -1 || LinenoiseHistoryImport(ls, *argv, 0) == -1)
+			{
+				perror(*argv);
+				exit(1);
+			}
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+			printf("Imported %lld bytes in %.3f s, %.2f GB/s.\n", (long long)st.st_size, secs, st.st_size / secs / 1e9);
+			exit(0);
+		}
 		else
 		{
-			fprintf(stderr, "Usage: %s [--multiline] [--keycodes]\n", prgname);
+			fprintf(stderr, "Usage: %s [--multiline] [--autosuggest] [--keycodes] [--import <file>]\n       %s --bench-search\n",
+					prgname, prgname);
 			exit(1);
 		}
 	}
@@ -70,11 +207,18 @@ int main(int argc, char **argv)
 	/* Set the completion callback. This will be called every time the
 	 * user uses the <tab> key. */
 	LinenoiseSetCompletionCallback(completion);
-	LinenoiseSetHintsCallback(hints);
+
+	/* Hints are shown at the right of the typed text, either by our own
+	 * callback or, with --autosuggest, by completing from the history. */
+	if (autosuggest)
+		LinenoiseHistorySetAutosuggest(ls, true);
+	else
+		LinenoiseSetHintsCallback(hints);
 
 	/* Load history from file. The history file is just a plain text file
-	 * where entries are separated by newlines. */
-	LinenoiseHistoryLoad(ls, "history.txt"); /* Load the history at startup */
+	 * where entries are separated by newlines. It is kept open so that new
+	 * entries can be appended to it. */
+	LinenoiseHistoryOpen(ls, "history.txt"); /* Load the history at startup */
 
 	/* Now this is the main loop of the typical linenoise-based application.
 	 * The call to linenoise() will block as long as the user types something
@@ -88,8 +232,8 @@ int main(int argc, char **argv)
 		if (line[0] != '\0' && line[0] != '/')
 		{
 			printf("echo: '%s'\n", line);
-			LinenoiseHistoryAdd(ls, line);			 /* Add to the history. */
-			LinenoiseHistorySave(ls, "history.txt"); /* Save the history on disk. */
+			LinenoiseHistoryAdd(ls, line); /* Add to the history. */
+			LinenoiseHistoryAppend(ls);	   /* Save the new entry on disk. */
 		}
 		else if (!strncmp(line, "/exit", 5))
 			break;
@@ -99,6 +243,17 @@ int main(int argc, char **argv)
 			int len = atoi(line + 11);
 			LinenoiseHistorySetMaxLen(ls, len);
 		}
+		else if (!strncmp(line, "/history", 8) && (line[8] == '\0' || line[8] == ' '))
+		{
+			/* "/history [prefix]" lists the entries, oldest first. */
+			LinenoiseHistoryIter it;
+			const char *		 entry;
+			size_t				 len;
+
+			LinenoiseHistoryIterBegin(ls, &it, LINENOISE_HISTORY_OLDEST_FIRST, line[8] ? line + 9 : NULL);
+			while (LinenoiseHistoryIterNext(&it, &entry, &len))
+				printf("%5d  %.*s\n", it.index + 1, (int)len, entry);
+		}
 		else if (line[0] == '/')
 			printf("Unreconized command: %s\n", line);
 
@@ -103,24 +103,44 @@
  *
  */
 
+#define _GNU_SOURCE /* memrchr() */
 #include "linenoise.h"
+#include "linenoise_hash.h"
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/file.h>
 #include <sys/ioctl.h>
+#ifdef __linux__
+#	include <sys/eventfd.h>
+#	include <sys/inotify.h>
+#endif
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LINENOISE_DEFAULT_HISTORY_MAX_LEN 100
 #define LINENOISE_MAX_LINE 4096
+#define LINENOISE_BINARY_MAGIC "LNHISTB1"
+#define LINENOISE_BINARY_MAGIC_LEN 8
 static char *						unsupported_term[]	 = {"dumb", "cons25", "emacs", NULL};
 static LinenoiseCompletionCallback *l_CompletionCallback = NULL;
+static LinenoiseAsyncCompletionCallback *l_AsyncCompletionCallback = NULL;
+static LinenoiseTrie *						l_CompletionTrie		  = NULL;
 static LinenoiseHintsCallback *		l_HintsCallback		 = NULL;
 static LinenoiseFreeHintsCallback * l_FreeHintsCallback	 = NULL;
 
@@ -133,6 +153,7 @@ enum KEY_ACTION
 	CTRL_D	  = 4,	/* Ctrl-d */
 	CTRL_E	  = 5,	/* Ctrl-e */
 	CTRL_F	  = 6,	/* Ctrl-f */
+	CTRL_G	  = 7,	/* Ctrl-g */
 	CTRL_H	  = 8,	/* Ctrl-h */
 	TAB		  = 9,	/* Tab */
 	CTRL_K	  = 11, /* Ctrl+k */
@@ -140,6 +161,7 @@ enum KEY_ACTION
 	ENTER	  = 13, /* Enter */
 	CTRL_N	  = 14, /* Ctrl-n */
 	CTRL_P	  = 16, /* Ctrl-p */
+	CTRL_R	  = 18, /* Ctrl-r */
 	CTRL_T	  = 20, /* Ctrl-t */
 	CTRL_U	  = 21, /* Ctrl+u */
 	CTRL_W	  = 23, /* Ctrl+w */
@@ -148,6 +170,32 @@ enum KEY_ACTION
 };
 
 static void RefreshLine(struct LinenoiseState *l);
+static int	HistoryPrefixStep(LinenoiseState *ls, int dir);
+static const char *HistorySuggest(LinenoiseState *ls);
+static int	HistoryAcceptSuggestion(LinenoiseState *ls);
+static double HistoryFrecency(const LinenoiseState *ls, int j, time_t now);
+static double HistoryFrecencyAt(uint32_t uses, uint32_t when, time_t now);
+static uint32_t HistoryPreviousUses(LinenoiseState *ls, const char *line);
+static int	HistoryFuzzyFind(LinenoiseState *ls);
+static void HistoryIndexChanged(LinenoiseState *ls);
+static void HistoryFileAdded(LinenoiseState *ls, const char *line);
+static void HistoryFileClose(LinenoiseState *ls);
+static void HistoryFreeEntry(LinenoiseState *ls, char *line);
+static int	HistoryLoadBinary(LinenoiseState *ls, char *map, size_t size);
+static void HistoryRingPull(LinenoiseState *ls);
+static int	HistoryRingPublish(LinenoiseState *ls, const char *line);
+static void HistoryRingDetach(LinenoiseState *ls);
+static void FreeHistory(LinenoiseState *ls);
+static uint64_t HashBytes(const char *p, size_t len);
+static size_t HistoryEntryBytes(size_t len);
+static int	HistoryMakeRoom(LinenoiseState *ls, int n, size_t bytes);
+static void HistoryPush(LinenoiseState *ls, char *line, uint32_t uses, uint32_t when);
+static int	HistoryLoadTail(LinenoiseState *ls, const char *buf, size_t size, uint32_t when);
+static int	HistoryLoadFd(LinenoiseState *ls, int fd, off_t *size);
+static int	WriteAll(int fd, const char *buf, size_t len);
+static int	HistoryWrite(const LinenoiseState *ls, int fd, int from);
+static int	HistoryAppendBinary(const LinenoiseState *ls, int fd, int from);
+static int	HistoryReplaceFile(const LinenoiseState *ls, const char *filename, bool binary);
 
 /* Debugging macro. */
 #if 0
@@ -343,15 +391,201 @@ static void LinenoiseBeep(const LinenoiseState *ls)
 
 /* ============================== Completion ================================ */
 
-/* Free a list of completion option populated by linenoiseAddCompletion(). */
+/* A block of the arena the completion strings are stored in. */
+struct LinenoiseCompletionChunk
+{
+	struct LinenoiseCompletionChunk *next; /* Older chunk. */
+	size_t							 used; /* Bytes of data taken. */
+	size_t							 size; /* Bytes of data. */
+	char							 data[];
+};
+
+/* Free a list of completion option populated by linenoiseAddCompletion(),
+ * the strings going away with their arena. */
 static void FreeCompletions(LinenoiseCompletions *lc)
 {
-	size_t i;
-	for (i = 0; i < lc->len; i++)
-		free(lc->cvec[i]);
+	while (lc->arena)
+	{
+		struct LinenoiseCompletionChunk *chunk = lc->arena;
+
+		lc->arena = chunk->next;
+		free(chunk);
+	}
+	free(lc->cvec);
+}
+
+/* Completions of a line kept by the completion cache. */
+struct LinenoiseCompletionCacheEntry
+{
+	char *				 line;
+	LinenoiseCompletions lc;
+	uint64_t			 used; /* Cache clock at the last use, for the LRU eviction. */
+};
+
+/* The completions of the last lines completed, so that completing the same
+ * line again, or with a monotonic callback a longer one, does not call the
+ * callback. There are few entries, they are scanned linearly. */
+struct LinenoiseCompletionCache
+{
+	struct LinenoiseCompletionCacheEntry *entries;
+	int									  len;		 /* Entries in use. */
+	int									  cap;		 /* Maximum entries. */
+	bool								  monotonic; /* Longer lines complete to a subset. */
+	uint64_t							  clock;	 /* Incremented at every use. */
+	uint64_t							  hits;
+	uint64_t							  misses;
+};
+
+static void CompletionCacheClear(struct LinenoiseCompletionCache *cc)
+{
+	int j;
+
+	for (j = 0; j < cc->len; j++)
+	{
+		free(cc->entries[j].line);
+		FreeCompletions(&cc->entries[j].lc);
+	}
+	cc->len = 0;
+}
+
+/* Move 'lc', the completions of 'line', to the cache, evicting the least
+ * recently used entry if it is full. Returns the cached completions, or
+ * NULL on out of memory leaving 'lc' untouched. */
+static LinenoiseCompletions *CompletionCacheStore(LinenoiseState *ls, const char *line, LinenoiseCompletions *lc)
+{
+	struct LinenoiseCompletionCache *	  cc   = ls->completion_cache;
+	struct LinenoiseCompletionCacheEntry *e	   = NULL;
+	char *								  copy = strdup(line);
+	int									  j;
+
+	if (copy == NULL)
+		return NULL;
+	/* Replace the entry of the same line, else take a free one, else the
+	 * least recently used. */
+	for (j = 0; j < cc->len && e == NULL; j++)
+		if (!strcmp(cc->entries[j].line, line))
+			e = &cc->entries[j];
+	if (e == NULL && cc->len < cc->cap)
+		e = &cc->entries[cc->len++];
+	else
+	{
+		if (e == NULL)
+		{
+			e = &cc->entries[0];
+			for (j = 1; j < cc->len; j++)
+				if (cc->entries[j].used < e->used)
+					e = &cc->entries[j];
+		}
+		free(e->line);
+		FreeCompletions(&e->lc);
+	}
+	e->line = copy;
+	e->lc	= *lc;
+	e->used = ++cc->clock;
+	memset(lc, 0, sizeof(*lc));
+	return &e->lc;
+}
+
+/* Returns the cached completions of the edited line, or NULL on a miss.
+ * With a monotonic callback, the completions of the longest cached line
+ * the edited line starts with are narrowed to the ones starting with it,
+ * and cached in turn. */
+static LinenoiseCompletions *CompletionCacheLookup(LinenoiseState *ls)
+{
+	struct LinenoiseCompletionCache *	  cc   = ls->completion_cache;
+	struct LinenoiseCompletionCacheEntry *best = NULL;
+	LinenoiseCompletions				  lc   = {0}, *narrowed;
+	size_t								  bestlen = 0, j;
+	int									  k;
+
+	for (k = 0; k < cc->len; k++)
+	{
+		struct LinenoiseCompletionCacheEntry *e	  = &cc->entries[k];
+		size_t								  len = strlen(e->line);
+
+		if (len == ls->len && !memcmp(e->line, ls->buf, len))
+		{
+			best = e;
+			break;
+		}
+		if (cc->monotonic && len < ls->len && (best == NULL || len > bestlen) && !memcmp(e->line, ls->buf, len))
+		{
+			best	= e;
+			bestlen = len;
+		}
+	}
+	if (best == NULL)
+	{
+		cc->misses++;
+		return NULL;
+	}
+	cc->hits++;
+	best->used = ++cc->clock;
+	if (!strcmp(best->line, ls->buf))
+		return &best->lc;
+
+	for (j = 0; j < best->lc.len; j++)
+		if (!strncmp(best->lc.cvec[j], ls->buf, ls->len))
+			LinenoiseAddCompletion(&lc, best->lc.cvec[j]);
+	narrowed = CompletionCacheStore(ls, ls->buf, &lc);
+	if (narrowed == NULL)
+		FreeCompletions(&lc);
+	return narrowed;
+}
+
+/* Cache the completions of up to 'entries' lines, or disable the cache with
+ * zero. With 'monotonic' the callback promises that the completions of a
+ * line are the ones of any shorter line it starts with that also start
+ * with it, so they can be narrowed down from the cache. Returns 0 on out
+ * of memory. */
+int LinenoiseSetCompletionCache(LinenoiseState *ls, int entries, int monotonic)
+{
+	struct LinenoiseCompletionCache *cc = ls->completion_cache;
 
-	if (lc->cvec != NULL)
-		free(lc->cvec);
+	if (cc)
+	{
+		CompletionCacheClear(cc);
+		free(cc->entries);
+		free(cc);
+		ls->completion_cache = NULL;
+	}
+	if (entries <= 0)
+		return 1;
+	cc = calloc(1, sizeof(*cc));
+	if (cc == NULL)
+		return 0;
+	cc->entries = calloc(entries, sizeof(*cc->entries));
+	if (cc->entries == NULL)
+	{
+		free(cc);
+		return 0;
+	}
+	cc->cap				 = entries;
+	cc->monotonic		 = monotonic;
+	ls->completion_cache = cc;
+	return 1;
+}
+
+/* Forget the cached completions, when what the callback completes to
+ * changed. */
+void LinenoiseInvalidateCompletionCache(LinenoiseState *ls)
+{
+	if (ls->completion_cache)
+		CompletionCacheClear(ls->completion_cache);
+}
+
+/* Fill 'stats' with the counters of the completion cache. Returns 0 if the
+ * cache is disabled. */
+int LinenoiseGetCompletionCacheStats(const LinenoiseState *ls, LinenoiseCompletionCacheStats *stats)
+{
+	const struct LinenoiseCompletionCache *cc = ls->completion_cache;
+
+	if (cc == NULL)
+		return 0;
+	stats->hits	   = cc->hits;
+	stats->misses  = cc->misses;
+	stats->entries = cc->len;
+	return 1;
 }
 
 /* This is an helper function for linenoiseEdit() and is called when the
@@ -360,14 +594,84 @@ static void FreeCompletions(LinenoiseCompletions *lc)
  *
  * The state of the editing is encapsulated into the pointed linenoiseState
  * structure as described in the structure definition. */
+static int ShowCompletions(struct LinenoiseState *ls, LinenoiseCompletions *lc, LinenoiseCompletionRequest *req);
+static int CompletionStart(LinenoiseState *ls);
+static void CompletionDrain(LinenoiseState *ls);
+static bool CompletionRequestPull(LinenoiseCompletionRequest *req);
+
+/* Drop the completions from 'sorted' on that are among the 'sorted' first
+ * ones, which are in lexicographic order. The strings stay in the arena. */
+static void CompletionsDedup(LinenoiseCompletions *lc, size_t sorted)
+{
+	size_t j, kept = sorted;
+
+	for (j = sorted; j < lc->len; j++)
+	{
+		size_t lo = 0, hi = sorted;
+
+		while (lo < hi)
+		{
+			size_t mid = lo + (hi - lo) / 2;
+			int	   cmp = strcmp(lc->cvec[mid], lc->cvec[j]);
+
+			if (cmp == 0)
+				break;
+			if (cmp < 0)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo == hi)
+			lc->cvec[kept++] = lc->cvec[j];
+	}
+	lc->len = kept;
+}
+
 static int CompleteLine(struct LinenoiseState *ls)
 {
-	LinenoiseCompletions lc = {0, NULL};
-	int					 nread, nwritten;
-	char				 c = 0;
+	LinenoiseCompletions lc = {0}, *cached;
+	size_t				 words = 0;
+	int					 c;
+
+	if (ls->completion_cache && (cached = CompletionCacheLookup(ls)) != NULL)
+		return ShowCompletions(ls, cached, NULL);
+
+	/* Asynchronous completions are shown by EditReadKey() once they
+	 * arrive, the user keeps editing meanwhile. */
+	if (l_AsyncCompletionCallback)
+	{
+		if (CompletionStart(ls) == -1)
+			LinenoiseBeep(ls);
+		return 0;
+	}
+
+	/* The words of the trie come first, then the ones of the callback that
+	 * the trie does not know. */
+	if (l_CompletionTrie)
+		words = LinenoiseTrieComplete(l_CompletionTrie, ls->buf, &lc, 0);
+	if (l_CompletionCallback)
+	{
+		l_CompletionCallback(ls->buf, &lc);
+		if (words)
+			CompletionsDedup(&lc, words);
+	}
+	if (ls->completion_cache && (cached = CompletionCacheStore(ls, ls->buf, &lc)) != NULL)
+		return ShowCompletions(ls, cached, NULL);
+	c = ShowCompletions(ls, &lc, NULL);
+	FreeCompletions(&lc);
+	return c;
+}
+
+/* Let the user cycle through the completions in 'lc' with <tab>, and
+ * returns the character that ended it like CompleteLine(). With 'req', the
+ * completions are the view of a request that is still running, and the
+ * results published meanwhile are added to them. */
+static int ShowCompletions(struct LinenoiseState *ls, LinenoiseCompletions *lc, LinenoiseCompletionRequest *req)
+{
+	int	 nread, nwritten;
+	char c = 0;
 
-	l_CompletionCallback(ls->buf, &lc);
-	if (lc.len == 0)
+	if (lc->len == 0)
 		LinenoiseBeep(ls);
 	else
 	{
@@ -376,12 +680,12 @@ static int CompleteLine(struct LinenoiseState *ls)
 		while (!stop)
 		{
 			/* Show completion or original buffer */
-			if (i < lc.len)
+			if (i < lc->len)
 			{
 				struct LinenoiseState saved = *ls;
 
-				ls->len = ls->pos = strlen(lc.cvec[i]);
-				ls->buf			  = lc.cvec[i];
+				ls->len = ls->pos = strlen(lc->cvec[i]);
+				ls->buf			  = lc->cvec[i];
 				RefreshLine(ls);
 				ls->len = saved.len;
 				ls->pos = saved.pos;
@@ -390,31 +694,44 @@ static int CompleteLine(struct LinenoiseState *ls)
 			else
 				RefreshLine(ls);
 
+			/* Wait for the next key, taking the new results meanwhile. */
+			while (req)
+			{
+				struct pollfd fds[2] = {{ls->ifd, POLLIN, 0}, {ls->completion_fd, POLLIN, 0}};
+
+				if (poll(fds, 2, -1) == -1 && errno != EINTR)
+					return -1;
+				if (fds[1].revents)
+				{
+					CompletionDrain(ls);
+					if (CompletionRequestPull(req))
+						req = NULL;
+				}
+				if (fds[0].revents)
+					break;
+			}
 			nread = read(ls->ifd, &c, 1);
 			if (nread <= 0)
-			{
-				FreeCompletions(&lc);
 				return -1;
-			}
 
 			switch (c)
 			{
 				case 9: /* tab */
-					i = (i + 1) % (lc.len + 1);
-					if (i == lc.len)
+					i = (i + 1) % (lc->len + 1);
+					if (i == lc->len)
 						LinenoiseBeep(ls);
 					break;
 				case 27: /* escape */
 					/* Re-show original buffer */
-					if (i < lc.len)
+					if (i < lc->len)
 						RefreshLine(ls);
 					stop = 1;
 					break;
 				default:
 					/* Update buffer and return */
-					if (i < lc.len)
+					if (i < lc->len)
 					{
-						nwritten = snprintf(ls->buf, ls->buflen, "%s", lc.cvec[i]);
+						nwritten = snprintf(ls->buf, ls->buflen, "%s", lc->cvec[i]);
 						ls->len = ls->pos = nwritten;
 					}
 					stop = 1;
@@ -423,13 +740,17 @@ static int CompleteLine(struct LinenoiseState *ls)
 		}
 	}
 
-	FreeCompletions(&lc);
 	return c; /* Return last read character */
 }
 
 /* Register a callback function to be called for tab-completion. */
 void LinenoiseSetCompletionCallback(LinenoiseCompletionCallback *fn) { l_CompletionCallback = fn; }
 
+/* Register a callback function to be called for tab-completion that may
+ * complete later, from any thread. It takes precedence over the callback
+ * set with LinenoiseSetCompletionCallback() and the completion trie. */
+void LinenoiseSetAsyncCompletionCallback(LinenoiseAsyncCompletionCallback *fn) { l_AsyncCompletionCallback = fn; }
+
 /* Register a hits function to be called to show hits to the user at the
  * right of the prompt. */
 void LinenoiseSetHintsCallback(LinenoiseHintsCallback *fn) { l_HintsCallback = fn; }
@@ -438,439 +759,1275 @@ void LinenoiseSetHintsCallback(LinenoiseHintsCallback *fn) { l_HintsCallback = f
  * registered with LinenoiseSetHintsCallback(). */
 void LinenoiseSetFreeHintsCallback(LinenoiseFreeHintsCallback *fn) { l_FreeHintsCallback = fn; }
 
+/* Returns 'size' bytes from the completions arena, growing it by chunks
+ * twice as big as the previous one, or NULL on out of memory. */
+static char *CompletionsAlloc(LinenoiseCompletions *lc, size_t size)
+{
+	struct LinenoiseCompletionChunk *chunk = lc->arena;
+
+	if (chunk == NULL || chunk->size - chunk->used < size)
+	{
+		size_t room = chunk ? chunk->size * 2 : 4096;
+
+		if (room < size)
+			room = size;
+		chunk = malloc(sizeof(*chunk) + room);
+		if (chunk == NULL)
+			return NULL;
+		chunk->next = lc->arena;
+		chunk->used = 0;
+		chunk->size = room;
+		lc->arena	= chunk;
+	}
+	chunk->used += size;
+	return chunk->data + chunk->used - size;
+}
+
+/* Make room in lc->cvec for 'n' more completions, growing it geometrically.
+ * Returns 0 on out of memory. */
+static int CompletionsReserve(LinenoiseCompletions *lc, size_t n)
+{
+	size_t cap = lc->cap ? lc->cap : 16;
+	char **cvec;
+
+	if (lc->len + n <= lc->cap)
+		return 1;
+	while (cap < lc->len + n)
+		cap *= 2;
+	cvec = realloc(lc->cvec, sizeof(char *) * cap);
+	if (cvec == NULL)
+		return 0;
+	lc->cvec = cvec;
+	lc->cap	 = cap;
+	return 1;
+}
+
+/* Add the 'len' bytes 'str', that needs not be null terminated, to the
+ * completions. */
+void LinenoiseAddCompletionN(LinenoiseCompletions *lc, const char *str, size_t len)
+{
+	char *copy;
+
+	if (!CompletionsReserve(lc, 1) || (copy = CompletionsAlloc(lc, len + 1)) == NULL)
+		return;
+	memcpy(copy, str, len);
+	copy[len]			= '\0';
+	lc->cvec[lc->len++] = copy;
+}
+
 /* This function is used by the callback function registered by the user
  * in order to add completion options given the input string when the
  * user typed <tab>. See the example.c source code for a very easy to
  * understand example. */
 void LinenoiseAddCompletion(LinenoiseCompletions *lc, const char *str)
 {
-	size_t len = strlen(str);
-	char * copy, **cvec;
+	LinenoiseAddCompletionN(lc, str, strlen(str));
+}
+
+/* Add the 'n' strings of 'strs' to the completions at once, copying them
+ * all to a single block of the arena. */
+void LinenoiseAddCompletions(LinenoiseCompletions *lc, const char **strs, size_t n)
+{
+	size_t total = 0, j;
+	char * p;
 
-	copy = malloc(len + 1);
-	if (copy == NULL)
+	for (j = 0; j < n; j++)
+		total += strlen(strs[j]) + 1;
+	if (!CompletionsReserve(lc, n) || (p = CompletionsAlloc(lc, total)) == NULL)
 		return;
-
-	memcpy(copy, str, len + 1);
-	cvec = realloc(lc->cvec, sizeof(char *) * (lc->len + 1));
-	if (cvec == NULL)
+	for (j = 0; j < n; j++)
 	{
-		free(copy);
-		return;
-	}
+		size_t size = strlen(strs[j]) + 1;
 
-	lc->cvec			= cvec;
-	lc->cvec[lc->len++] = copy;
+		memcpy(p, strs[j], size);
+		lc->cvec[lc->len++] = p;
+		p += size;
+	}
 }
 
-/* =========================== Line editing ================================= */
-
-/* We define a very simple "append buffer" structure, that is an heap
- * allocated string where we can append to. This is useful in order to
- * write all the escape sequences in a buffer and flush them to the standard
- * output in a single call, to avoid flickering effects. */
-struct abuf
+/* An asynchronous completion of the line 'line'. It is shared by the editor
+ * and the completion source until both are done with it: the editor cancels
+ * it when the line changes, the source calls LinenoiseCompletionRequestDone()
+ * once it added its results.
+ *
+ * The source adds the results to 'lc' without locking, and publishes them
+ * with LinenoiseCompletionRequestFlush() by appending their pointers to
+ * 'published' under the lock. The strings never move, so the editor can
+ * show them while more are added: it copies the published pointers to its
+ * own 'view'. */
+struct LinenoiseCompletionRequest
 {
-	char *b;
-	int	  len;
+	pthread_mutex_t		 lock;
+	int					 refs;			/* The editor and the source. */
+	int					 fd;			/* Signaled when results arrive, -1 once cancelled. */
+	bool				 done;			/* Set by LinenoiseCompletionRequestDone(). */
+	atomic_bool			 cancelled;		/* The line changed, results are not wanted anymore. */
+	LinenoiseCompletions lc;			/* The results, owned by the source until done. */
+	char **				 published;		/* Results the editor may show. */
+	size_t				 published_len; /* Results published. */
+	size_t				 published_cap; /* Room in published. */
+	LinenoiseCompletions view;			/* The published results the editor took, not owning the strings. */
+	char				 line[];		/* The line to complete. */
 };
 
-static void abInit(struct abuf *ab)
-{
-	ab->b	= NULL;
-	ab->len = 0;
-}
-
-static void abAppend(struct abuf *ab, const char *s, int len)
+static void CompletionRequestRelease(LinenoiseCompletionRequest *req)
 {
-	char *new = realloc(ab->b, ab->len + len);
+	int refs;
 
-	if (new == NULL)
+	pthread_mutex_lock(&req->lock);
+	refs = --req->refs;
+	pthread_mutex_unlock(&req->lock);
+	if (refs)
 		return;
-	memcpy(new + ab->len, s, len);
-	ab->b = new;
-	ab->len += len;
+	pthread_mutex_destroy(&req->lock);
+	FreeCompletions(&req->lc);
+	free(req->published);
+	free(req->view.cvec);
+	free(req);
 }
 
-static void abFree(struct abuf *ab) { free(ab->b); }
-
-/* Helper of refreshSingleLine() and refreshMultiLine() to show hints
- * to the right of the prompt. */
-void RefreshShowHints(struct abuf *ab, struct LinenoiseState *l, int plen)
+/* Publish the results added since the last time and wake the editor up.
+ * The request must be locked. */
+static void CompletionRequestPublish(LinenoiseCompletionRequest *req)
 {
-	char seq[64];
-	if (l_HintsCallback && plen + l->len < l->cols)
-	{
-		int	  color = -1, bold = 0;
-		char *hint = l_HintsCallback(l->buf, &color, &bold);
-		if (hint)
-		{
-			int hintlen	   = strlen(hint);
-			int hintmaxlen = l->cols - (plen + l->len);
+	size_t n = req->lc.len - req->published_len;
 
-			if (hintlen > hintmaxlen)
-				hintlen = hintmaxlen;
-			if (bold == 1 && color == -1)
-				color = 37;
-			if (color != -1 || bold != 0)
-				snprintf(seq, 64, "\033[%d;%d;49m", bold, color);
-			else
-				seq[0] = '\0';
+	if (n == 0)
+		return;
+	if (req->published_len + n > req->published_cap)
+	{
+		size_t cap		 = req->published_cap ? req->published_cap : 64;
+		char **published;
 
-			abAppend(ab, seq, strlen(seq));
-			abAppend(ab, hint, hintlen);
+		while (cap < req->published_len + n)
+			cap *= 2;
+		published = realloc(req->published, sizeof(char *) * cap);
+		if (published == NULL)
+			return;
+		req->published	   = published;
+		req->published_cap = cap;
+	}
+	memcpy(req->published + req->published_len, req->lc.cvec + req->published_len, sizeof(char *) * n);
+	req->published_len += n;
+	if (req->fd != -1)
+	{
+		uint64_t one = 1;
 
-			if (color != -1 || bold != 0)
-				abAppend(ab, "\033[0m", 4);
-			/* Call the function to free the hint returned. */
-			if (l_FreeHintsCallback)
-				l_FreeHintsCallback(hint);
-		}
+		while (write(req->fd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
 	}
 }
 
-/* Single line low level line refresh.
- *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
-static void RefreshSingleLine(struct LinenoiseState *l)
+/* Take the results published since the last time into the view of the
+ * editor. Returns true if the source is done. */
+static bool CompletionRequestPull(LinenoiseCompletionRequest *req)
 {
-	char		seq[64];
-	size_t		plen = strlen(l->prompt);
-	int			fd	 = l->ofd;
-	char *		buf	 = l->buf;
-	size_t		len	 = l->len;
-	size_t		pos	 = l->pos;
-	struct abuf ab;
+	bool done;
 
-	while ((plen + pos) >= l->cols)
+	pthread_mutex_lock(&req->lock);
+	if (req->published_len > req->view.len && CompletionsReserve(&req->view, req->published_len - req->view.len))
 	{
-		buf++;
-		len--;
-		pos--;
+		memcpy(req->view.cvec + req->view.len, req->published + req->view.len, sizeof(char *) * (req->published_len - req->view.len));
+		req->view.len = req->published_len;
 	}
+	done = req->done && req->view.len == req->published_len;
+	pthread_mutex_unlock(&req->lock);
+	return done;
+}
 
-	while (plen + len > l->cols)
-	{
-		len--;
-	}
+/* Returns the line the request is about. */
+const char *LinenoiseCompletionRequestLine(const LinenoiseCompletionRequest *req) { return req->line; }
 
-	abInit(&ab);
-	/* Cursor to left edge */
-	snprintf(seq, 64, "\r");
-	abAppend(&ab, seq, strlen(seq));
-	/* Write the prompt and the current buffer content */
-	abAppend(&ab, l->prompt, strlen(l->prompt));
-	abAppend(&ab, buf, len);
-	/* Show hits if any. */
-	RefreshShowHints(&ab, l, plen);
-	/* Erase to right */
-	snprintf(seq, 64, "\x1b[0K");
-	abAppend(&ab, seq, strlen(seq));
-	/* Move cursor to original position. */
-	snprintf(seq, 64, "\r\x1b[%dC", (int)(pos + plen));
-	abAppend(&ab, seq, strlen(seq));
+/* Returns the completions to add the results to. */
+LinenoiseCompletions *LinenoiseCompletionRequestResults(LinenoiseCompletionRequest *req) { return &req->lc; }
 
-	write(fd, ab.b, ab.len);
+/* Returns true once the line changed, so that the source can give up early:
+ * its results would be discarded anyway. */
+int LinenoiseCompletionRequestCancelled(const LinenoiseCompletionRequest *req)
+{
+	return atomic_load_explicit(&req->cancelled, memory_order_relaxed);
+}
 
-	abFree(&ab);
+/* Let the editor show the results added so far, while more are coming.
+ * The first results can so be shown long before the last ones are found. */
+void LinenoiseCompletionRequestFlush(LinenoiseCompletionRequest *req)
+{
+	pthread_mutex_lock(&req->lock);
+	CompletionRequestPublish(req);
+	pthread_mutex_unlock(&req->lock);
 }
 
-/* Multi line low level line refresh.
- *
- * Rewrite the currently edited line accordingly to the buffer content,
- * cursor position, and number of columns of the terminal. */
-static void RefreshMultiLine(struct LinenoiseState *l)
+/* Hand the results back to the editor, waking it up. The request must not
+ * be used anymore after this call, that must be done exactly once. */
+void LinenoiseCompletionRequestDone(LinenoiseCompletionRequest *req)
 {
-	char		seq[64];
-	int			plen = strlen(l->prompt);
-	int			rows = (plen + l->len + l->cols - 1) / l->cols; /* rows used by current buf. */
-	int			rpos = (plen + l->oldpos + l->cols) / l->cols;	/* cursor relative row. */
-	int			rpos2;											/* rpos after refresh. */
-	int			col;											/* colum position, zero-based. */
-	int			old_rows = l->maxrows;
-	int			fd		 = l->ofd, j;
-	struct abuf ab;
+	uint64_t one = 1;
+
+	pthread_mutex_lock(&req->lock);
+	CompletionRequestPublish(req);
+	req->done = true;
+	if (req->fd != -1)
+		while (write(req->fd, &one, sizeof(one)) == -1 && errno == EINTR)
+			;
+	pthread_mutex_unlock(&req->lock);
+	CompletionRequestRelease(req);
+}
 
-	/* Update maxrows if needed. */
-	if (rows > (int)l->maxrows)
-		l->maxrows = rows;
+/* Drain the wake ups of the completion requests. */
+static void CompletionDrain(LinenoiseState *ls)
+{
+	uint64_t n;
 
-	/* First step: clear all the lines used before. To do so start by
-	 * going to the last row. */
-	abInit(&ab);
-	if (old_rows - rpos > 0)
-	{
-		lndebug("go down %d", old_rows - rpos);
-		snprintf(seq, 64, "\x1b[%dB", old_rows - rpos);
-		abAppend(&ab, seq, strlen(seq));
-	}
+	while (read(ls->completion_fd, &n, sizeof(n)) > 0)
+		;
+}
 
-	/* Now for every row clear it, go up. */
-	for (j = 0; j < old_rows - 1; j++)
-	{
-		lndebug("clear+up");
-		snprintf(seq, 64, "\r\x1b[0K\x1b[1A");
-		abAppend(&ab, seq, strlen(seq));
-	}
-
-	/* Clean the top line. */
-	lndebug("clear");
-	snprintf(seq, 64, "\r\x1b[0K");
-	abAppend(&ab, seq, strlen(seq));
+/* Cancel the pending completion request, if any. */
+static void CompletionCancel(LinenoiseState *ls)
+{
+	LinenoiseCompletionRequest *req = ls->completion_request;
 
-	/* Write the prompt and the current buffer content */
-	abAppend(&ab, l->prompt, strlen(l->prompt));
-	abAppend(&ab, l->buf, l->len);
+	if (req == NULL)
+		return;
+	atomic_store_explicit(&req->cancelled, true, memory_order_relaxed);
+	pthread_mutex_lock(&req->lock);
+	req->fd = -1;
+	pthread_mutex_unlock(&req->lock);
+	CompletionRequestRelease(req);
+	ls->completion_request = NULL;
+	CompletionDrain(ls);
+}
 
-	/* Show hits if any. */
-	RefreshShowHints(&ab, l, plen);
+/* Ask the asynchronous completion callback to complete the edited line.
+ * Returns -1 on error. */
+static int CompletionStart(LinenoiseState *ls)
+{
+	LinenoiseCompletionRequest *req;
 
-	/* If we are at the very end of the screen with our prompt, we need to
-	 * emit a newline and move the prompt to the first column. */
-	if (l->pos && l->pos == l->len && (l->pos + plen) % l->cols == 0)
+	if (ls->completion_request)
+		return 0;
+	if (ls->completion_fd == -1)
 	{
-		lndebug("<newline>");
-		abAppend(&ab, "\n", 1);
-		snprintf(seq, 64, "\r");
-		abAppend(&ab, seq, strlen(seq));
-		rows++;
-
-		if (rows > (int)l->maxrows)
-			l->maxrows = rows;
+#ifdef __linux__
+		ls->completion_fd = ls->completion_wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if (ls->completion_fd == -1)
+			return -1;
+#else
+		int fds[2];
+
+		if (pipe(fds) == -1)
+			return -1;
+		fcntl(fds[0], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		ls->completion_fd  = fds[0];
+		ls->completion_wfd = fds[1];
+#endif
 	}
 
-	/* Move cursor to right position. */
-	rpos2 = (plen + l->pos + l->cols) / l->cols; /* current cursor relative row. */
-	lndebug("rpos2 %d", rpos2);
+	req = calloc(1, sizeof(*req) + ls->len + 1);
+	if (req == NULL)
+		return -1;
+	pthread_mutex_init(&req->lock, NULL);
+	req->refs = 2;
+	req->fd	  = ls->completion_wfd;
+	atomic_init(&req->cancelled, false);
+	memcpy(req->line, ls->buf, ls->len + 1);
+	ls->completion_request = req;
+	l_AsyncCompletionCallback(req, req->line);
+	return 0;
+}
 
-	/* Go up till we reach the expected positon. */
-	if (rows - rpos2 > 0)
+/* Wait for a key, showing the results of the pending completion request if
+ * they arrive first. The request is cancelled first if the line changed
+ * since it was made. Returns like read(), with the key in 'c', or 2 when
+ * the key is the one that ended the completion like CompleteLine() returns
+ * it, zero meaning there is nothing left to handle. */
+static int EditReadKey(LinenoiseState *ls, char *c)
+{
+	LinenoiseCompletionRequest *req = ls->completion_request;
+
+	if (req && strcmp(req->line, ls->buf))
+		CompletionCancel(ls);
+	while ((req = ls->completion_request) != NULL)
 	{
-		lndebug("go-up %d", rows - rpos2);
-		snprintf(seq, 64, "\x1b[%dA", rows - rpos2);
-		abAppend(&ab, seq, strlen(seq));
+		struct pollfd fds[2] = {{ls->ifd, POLLIN, 0}, {ls->completion_fd, POLLIN, 0}};
+		bool		  done;
+		int			  ret;
+
+		if (poll(fds, 2, -1) == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (fds[0].revents)
+			break;
+		CompletionDrain(ls);
+		done = CompletionRequestPull(req);
+		if (!done && req->view.len == 0)
+			continue;
+
+		/* Show the first results, more may arrive while the user cycles
+		 * through them. */
+		ret = ShowCompletions(ls, &req->view, done ? NULL : req);
+
+		/* Only a complete set can be cached. Once the user picked one
+		 * the rest is not needed anymore. */
+		pthread_mutex_lock(&req->lock);
+		done = req->done;
+		pthread_mutex_unlock(&req->lock);
+		if (done && ls->completion_cache)
+			CompletionCacheStore(ls, req->line, &req->lc);
+		CompletionCancel(ls);
+		if (ret < 0)
+			return ret;
+		*c = ret;
+		return 2;
 	}
+	return read(ls->ifd, c, 1);
+}
 
-	/* Set column. */
-	col = (plen + (int)l->pos) % (int)l->cols;
-	lndebug("set col %d", 1 + col);
+/* ============================ Completion trie ============================= */
 
-	if (col)
-		snprintf(seq, 64, "\r\x1b[%dC", col);
-	else
-		snprintf(seq, 64, "\r");
-	abAppend(&ab, seq, strlen(seq));
+/* A path compressed radix trie of words, to complete against a vocabulary
+ * without any callback code. Every node holds the label of the edge leading
+ * to it inline, and the first bytes of the labels of its children in a
+ * sorted byte array next to the child pointers, so that finding a child is
+ * a memchr() over a few contiguous bytes. Looking a prefix up only visits
+ * the nodes along it. */
+struct LinenoiseTrieNode
+{
+	struct LinenoiseTrieNode **children;  /* Sorted by the first byte of their label. */
+	unsigned char *			   firsts;	  /* First byte of the label of every child. */
+	uint32_t				   nchildren; /* Children of the node. */
+	uint32_t				   cap;		  /* Room in children and firsts. */
+	uint32_t				   len;		  /* Length of the label. */
+	bool					   terminal;  /* A word ends here. */
+	char					   label[];
+};
 
-	lndebug("\n");
-	l->oldpos = l->pos;
+struct LinenoiseTrie
+{
+	struct LinenoiseTrieNode *root;
+	size_t					  words;
+};
 
-	if (write(fd, ab.b, ab.len) == -1)
-		; /* Can't recover from write error. */
+static struct LinenoiseTrieNode *TrieNodeNew(const char *label, size_t len)
+{
+	struct LinenoiseTrieNode *n = calloc(1, sizeof(*n) + len);
 
-	abFree(&ab);
+	if (n == NULL)
+		return NULL;
+	memcpy(n->label, label, len);
+	n->len = len;
+	return n;
 }
 
-/* Calls the two low level functions refreshSingleLine() or
- * refreshMultiLine() according to the selected mode. */
-static void RefreshLine(struct LinenoiseState *l)
+static void TrieNodeFree(struct LinenoiseTrieNode *n)
 {
-	if (l->mlmode)
-		RefreshMultiLine(l);
-	else
-		RefreshSingleLine(l);
+	uint32_t j;
+
+	for (j = 0; j < n->nchildren; j++)
+		TrieNodeFree(n->children[j]);
+	free(n->children);
+	free(n->firsts);
+	free(n);
 }
 
-/* Insert the character 'c' at cursor current position.
- *
- * On error writing to the terminal -1 is returned, otherwise 0. */
-int LinenoiseEditInsert(struct LinenoiseState *l, char c)
+/* Returns the index of the child of 'n' whose label starts with 'c', or -1. */
+static int TrieChild(const struct LinenoiseTrieNode *n, unsigned char c)
 {
-	if (l->len < l->buflen)
-	{
-		if (l->len == l->pos)
-		{
-			l->buf[l->pos] = c;
-			l->pos++;
-			l->len++;
-			l->buf[l->len] = '\0';
-			if ((!l->mlmode && l->plen + l->len < l->cols && !l_HintsCallback))
-			{
-				/* Avoid a full update of the line in the
-				 * trivial case. */
-				if (write(l->ofd, &c, 1) == -1)
-					return -1;
-			}
-			else
-				RefreshLine(l);
-		}
-		else
-		{
-			memmove(l->buf + l->pos + 1, l->buf + l->pos, l->len - l->pos);
-			l->buf[l->pos] = c;
-			l->len++;
-			l->pos++;
-			l->buf[l->len] = '\0';
-			RefreshLine(l);
-		}
-	}
-	return 0;
+	const unsigned char *p = n->nchildren ? memchr(n->firsts, c, n->nchildren) : NULL;
+
+	return p ? (int)(p - n->firsts) : -1;
 }
 
-/* Move cursor on the left. */
-void LinenoiseEditMoveLeft(struct LinenoiseState *l)
+/* Add 'child' to the children of 'n', keeping them sorted. Returns 0 on out
+ * of memory. */
+static int TrieAddChild(struct LinenoiseTrieNode *n, struct LinenoiseTrieNode *child)
 {
-	if (l->pos > 0)
+	unsigned char c = child->label[0];
+	uint32_t	  j;
+
+	if (n->nchildren == n->cap)
 	{
-		l->pos--;
-		RefreshLine(l);
+		uint32_t				   cap		= n->cap ? n->cap * 2 : 2;
+		struct LinenoiseTrieNode **children = realloc(n->children, sizeof(*children) * cap);
+		unsigned char *			   firsts;
+
+		if (children == NULL)
+			return 0;
+		n->children = children;
+		firsts		= realloc(n->firsts, cap);
+		if (firsts == NULL)
+			return 0;
+		n->firsts = firsts;
+		n->cap	  = cap;
 	}
+	for (j = 0; j < n->nchildren && n->firsts[j] < c; j++)
+		;
+	memmove(n->children + j + 1, n->children + j, sizeof(*n->children) * (n->nchildren - j));
+	memmove(n->firsts + j + 1, n->firsts + j, n->nchildren - j);
+	n->children[j] = child;
+	n->firsts[j]   = c;
+	n->nchildren++;
+	return 1;
 }
 
-/* Move cursor on the right. */
-void LinenoiseEditMoveRight(struct LinenoiseState *l)
+/* Replace 'n', the child 'k' of 'parent', that must have a single child
+ * and no word ending on it, with a node merging the two labels. */
+static void TrieMerge(struct LinenoiseTrieNode *parent, int k, struct LinenoiseTrieNode *n)
 {
-	if (l->pos != l->len)
-	{
-		l->pos++;
-		RefreshLine(l);
-	}
+	struct LinenoiseTrieNode *child = n->children[0];
+	struct LinenoiseTrieNode *m		= malloc(sizeof(*m) + n->len + child->len);
+
+	/* Without memory for the merged node, the trie just stays bigger. */
+	if (m == NULL)
+		return;
+	*m		= *child;
+	m->len	= n->len + child->len;
+	memcpy(m->label, n->label, n->len);
+	memcpy(m->label + n->len, child->label, child->len);
+	parent->children[k] = m;
+	free(child);
+	free(n->children);
+	free(n->firsts);
+	free(n);
 }
 
-/* Move cursor to the start of the line. */
-void LinenoiseEditMoveHome(struct LinenoiseState *l)
+LinenoiseTrie *LinenoiseTrieCreate(void)
 {
-	if (l->pos != 0)
+	LinenoiseTrie *t = calloc(1, sizeof(*t));
+
+	if (t == NULL)
+		return NULL;
+	t->root = TrieNodeNew("", 0);
+	if (t->root == NULL)
 	{
-		l->pos = 0;
-		RefreshLine(l);
+		free(t);
+		return NULL;
 	}
+	return t;
 }
 
-/* Move cursor to the end of the line. */
-void LinenoiseEditMoveEnd(struct LinenoiseState *l)
+void LinenoiseTrieFree(LinenoiseTrie *t)
 {
-	if (l->pos != l->len)
-	{
-		l->pos = l->len;
-		RefreshLine(l);
-	}
+	if (t == NULL)
+		return;
+	if (l_CompletionTrie == t)
+		LinenoiseSetCompletionTrie(NULL);
+	TrieNodeFree(t->root);
+	free(t);
 }
 
-/* Substitute the currently edited line with the next or previous history
- * entry as specified by 'dir'. */
-#define LINENOISE_HISTORY_NEXT 0
-#define LINENOISE_HISTORY_PREV 1
-void LinenoiseEditHistoryNext(struct LinenoiseState *l, int dir)
+/* Returns the number of words in the trie. */
+size_t LinenoiseTrieSize(const LinenoiseTrie *t) { return t->words; }
+
+/* Add 'word' to the trie. Returns 1 if it was added, 0 if it was already
+ * there and -1 on out of memory. */
+int LinenoiseTrieInsert(LinenoiseTrie *t, const char *word)
 {
-	if (l->history_len > 1)
+	struct LinenoiseTrieNode *n = t->root;
+	size_t					  len = strlen(word), p = 0;
+
+	while (true)
 	{
-		/* Update the current history entry before to
-		 * overwrite it with the next one. */
-		free(l->history[l->history_len - 1 - l->history_index]);
-		l->history[l->history_len - 1 - l->history_index] = strdup(l->buf);
-		/* Show the new entry */
-		l->history_index += (dir == LINENOISE_HISTORY_PREV) ? 1 : -1;
-		if (l->history_index < 0)
+		struct LinenoiseTrieNode *child, *mid;
+		size_t					  common = 0;
+		int						  k;
+
+		if (p == len)
 		{
-			l->history_index = 0;
-			return;
+			if (n->terminal)
+				return 0;
+			n->terminal = true;
+			t->words++;
+			return 1;
 		}
-		else if (l->history_index >= l->history_len)
+
+		k = TrieChild(n, word[p]);
+		if (k == -1)
 		{
-			l->history_index = l->history_len - 1;
-			return;
+			child = TrieNodeNew(word + p, len - p);
+			if (child == NULL || !TrieAddChild(n, child))
+			{
+				free(child);
+				return -1;
+			}
+			child->terminal = true;
+			t->words++;
+			return 1;
 		}
 
-		strncpy(l->buf, l->history[l->history_len - 1 - l->history_index], l->buflen);
-		l->buf[l->buflen - 1] = '\0';
-		l->len = l->pos = strlen(l->buf);
-		RefreshLine(l);
+		child = n->children[k];
+		while (common < child->len && p + common < len && child->label[common] == word[p + common])
+			common++;
+		if (common < child->len)
+		{
+			/* The word leaves the label midway: split the edge there. */
+			mid = TrieNodeNew(child->label, common);
+			if (mid == NULL)
+				return -1;
+			memmove(child->label, child->label + common, child->len - common);
+			child->len -= common;
+			if (!TrieAddChild(mid, child))
+			{
+				memmove(child->label + common, child->label, child->len);
+				memcpy(child->label, mid->label, common);
+				child->len += common;
+				free(mid);
+				return -1;
+			}
+			n->children[k] = mid;
+			child		   = mid;
+		}
+		n = child;
+		p += common;
 	}
 }
 
-/* Delete the character at the right of the cursor without altering the cursor
- * position. Basically this is what happens with the "Delete" keyboard key. */
-void LinenoiseEditDelete(struct LinenoiseState *l)
+static int TrieCompareWords(const void *a, const void *b) { return strcmp(*(const char **)a, *(const char **)b); }
+
+/* Add the 'n' words of 'words' to the trie. They are inserted in sorted
+ * order, so that the nodes of the same subtree are allocated together.
+ * Returns the number of words added, or -1 on out of memory. */
+int LinenoiseTrieBuild(LinenoiseTrie *t, const char **words, size_t n)
 {
-	if (l->len > 0 && l->pos < l->len)
+	const char **sorted = malloc(sizeof(*sorted) * (n ? n : 1));
+	size_t		 j;
+	int			 added = 0, ret;
+
+	if (sorted == NULL)
+		return -1;
+	memcpy(sorted, words, sizeof(*sorted) * n);
+	qsort(sorted, n, sizeof(*sorted), TrieCompareWords);
+	for (j = 0; j < n; j++)
 	{
-		memmove(l->buf + l->pos, l->buf + l->pos + 1, l->len - l->pos - 1);
-		l->len--;
-		l->buf[l->len] = '\0';
-		RefreshLine(l);
+		if ((ret = LinenoiseTrieInsert(t, sorted[j])) == -1)
+		{
+			added = -1;
+			break;
+		}
+		added += ret;
 	}
+	free(sorted);
+	return added;
 }
 
-/* Backspace implementation. */
-void LinenoiseEditBackspace(struct LinenoiseState *l)
+/* Remove 'word' from the trie, merging the nodes it leaves with a single
+ * child. Returns 1 if it was removed, 0 if it was not there. */
+int LinenoiseTrieRemove(LinenoiseTrie *t, const char *word)
 {
-	if (l->pos > 0 && l->len > 0)
+	struct LinenoiseTrieNode *n = t->root, *parent = NULL, *grand = NULL;
+	size_t					  len = strlen(word), p = 0;
+	int						  k = -1, pk = -1;
+
+	while (p < len)
 	{
-		memmove(l->buf + l->pos - 1, l->buf + l->pos, l->len - l->pos);
-		l->pos--;
-		l->len--;
-		l->buf[l->len] = '\0';
-		RefreshLine(l);
+		int j = TrieChild(n, word[p]);
+
+		if (j == -1)
+			return 0;
+		if (n->children[j]->len > len - p || memcmp(n->children[j]->label, word + p, n->children[j]->len))
+			return 0;
+		grand  = parent;
+		pk	   = k;
+		parent = n;
+		k	   = j;
+		p += n->children[j]->len;
+		n = n->children[j];
+	}
+	if (!n->terminal)
+		return 0;
+	n->terminal = false;
+	t->words--;
+	if (parent == NULL)
+		return 1;
+
+	if (n->nchildren == 0)
+	{
+		/* Drop the leaf, the parent may be left with a single child. */
+		parent->nchildren--;
+		memmove(parent->children + k, parent->children + k + 1, sizeof(*parent->children) * (parent->nchildren - k));
+		memmove(parent->firsts + k, parent->firsts + k + 1, parent->nchildren - k);
+		free(n->children);
+		free(n->firsts);
+		free(n);
+		if (grand && parent->nchildren == 1 && !parent->terminal)
+			TrieMerge(grand, pk, parent);
 	}
+	else if (n->nchildren == 1)
+		TrieMerge(parent, k, n);
+	return 1;
 }
 
-/* Delete the previosu word, maintaining the cursor at the start of the
- * current word. */
-void LinenoiseEditDeletePrevWord(struct LinenoiseState *l)
+/* Words found while enumerating the trie, spelled in 'buf'. */
+struct TrieWalk
 {
-	size_t old_pos = l->pos;
-	size_t diff;
+	LinenoiseCompletions *lc;
+	char *				  buf;
+	size_t				  len;
+	size_t				  cap;
+	size_t				  left; /* Words still wanted. */
+};
 
-	while (l->pos > 0 && l->buf[l->pos - 1] == ' ')
-		l->pos--;
-	while (l->pos > 0 && l->buf[l->pos - 1] != ' ')
-		l->pos--;
+/* Add to the completions the words under 'n', whose label is already in
+ * the buffer, in lexicographic order. Returns 0 when done or on out of
+ * memory. */
+static int TrieWalk(struct TrieWalk *w, const struct LinenoiseTrieNode *n)
+{
+	uint32_t j;
 
-	diff = old_pos - l->pos;
-	memmove(l->buf + l->pos, l->buf + old_pos, l->len - old_pos + 1);
-	l->len -= diff;
-	RefreshLine(l);
-}
+	if (n->terminal)
+	{
+		LinenoiseAddCompletionN(w->lc, w->buf, w->len);
+		if (--w->left == 0)
+			return 0;
+	}
+	for (j = 0; j < n->nchildren; j++)
+	{
+		const struct LinenoiseTrieNode *child = n->children[j];
 
-/* Delete the buffer state after running a command */
-void LinenoiseClearBuffer(LinenoiseState *ls)
-{
-	memset(ls->buf, 0, ls->buflen);
-	ls->pos = 0;
-	RefreshLine(ls);
+		if (w->len + child->len > w->cap)
+		{
+			size_t cap = w->cap * 2 > w->len + child->len ? w->cap * 2 : w->len + child->len;
+			char * buf = realloc(w->buf, cap);
+
+			if (buf == NULL)
+				return 0;
+			w->buf = buf;
+			w->cap = cap;
+		}
+		memcpy(w->buf + w->len, child->label, child->len);
+		w->len += child->len;
+		if (!TrieWalk(w, child))
+			return 0;
+		w->len -= child->len;
+	}
+	return 1;
 }
 
-/* This function is the core of the line editing capability of linenoise.
- * It expects 'fd' to be already in "raw mode" so that every key pressed
- * will be returned ASAP to read().
- *
- * The resulting string is put into 'buf' when the user type enter, or
- * when ctrl+d is typed.
- *
- * The function returns the length of the current buffer. */
-static int LinenoiseEdit(LinenoiseState *ls)
+/* Add to 'lc' the words of the trie starting with 'prefix', in lexicographic
+ * order, at most 'max' of them unless it is zero. Returns the number of
+ * words added. */
+size_t LinenoiseTrieComplete(const LinenoiseTrie *t, const char *prefix, LinenoiseCompletions *lc, size_t max)
 {
-	// Write the prompt
-	if (write(ls->ofd, ls->prompt, ls->plen) == -1)
-		return -1;
+	const struct LinenoiseTrieNode *n	 = t->root;
+	size_t							plen = strlen(prefix), p = 0, base = 0, before = lc->len;
+	struct TrieWalk					w;
 
-	while (true)
+	/* Find the node the prefix ends in, maybe midway through its label. */
+	while (p < plen)
 	{
-		char c;
-		int	 nread;
-		char seq[3];
+		int	   k = TrieChild(n, prefix[p]);
+		size_t m;
 
-		nread = read(ls->ifd, &c, 1);
-		if (nread <= 0)
-			return ls->len;
+		if (k == -1)
+			return 0;
+		n = n->children[k];
+		m = n->len < plen - p ? n->len : plen - p;
+		if (memcmp(n->label, prefix + p, m))
+			return 0;
+		base = p;
+		p += m;
+	}
 
-		/* Only autocomplete when the callback is set. It returns < 0 when
-		 * there was an error reading from fd. Otherwise it will return the
-		 * character that should be handled next. */
-		if (c == 9 && l_CompletionCallback != NULL)
-		{
-			c = CompleteLine(ls);
+	/* The words below start with the prefix up to the node, then its label. */
+	w.lc   = lc;
+	w.len  = base + n->len;
+	w.cap  = w.len > 16 ? w.len : 16;
+	w.left = max ? max : SIZE_MAX;
+	w.buf  = malloc(w.cap);
+	if (w.buf == NULL)
+		return 0;
+	memcpy(w.buf, prefix, base);
+	memcpy(w.buf + base, n->label, n->len);
+	TrieWalk(&w, n);
+	free(w.buf);
+	return lc->len - before;
+}
+
+/* Complete the edited line against the words of 't', or stop doing it when
+ * NULL. The words are offered before the ones of the completion callback,
+ * if there is one too, which are not offered twice. The trie must not change while a line is being
+ * completed. */
+void LinenoiseSetCompletionTrie(LinenoiseTrie *t) { l_CompletionTrie = t; }
+
+/* ============================ Command tables ============================== */
+
+/* Fixed command sets are turned into static tables at build time by the
+ * mkcmdtable tool: the words sorted, to complete a prefix with a binary
+ * search, and a minimal perfect hash of them to check a word in constant
+ * time. The hash is the hash and displace scheme: a word goes to the bucket
+ * given by its hash with seed 0, and the seed of the bucket then picks its
+ * slot among the words. Nothing is built nor allocated at run time. */
+
+/* The hash of linenoise_hash.h, that mkcmdtable hashes the words with. */
+uint32_t LinenoiseCommandHash(const char *s, size_t len, uint32_t seed) { return LinenoiseHashCommand(s, len, seed); }
+
+/* Returns 1 if the 'len' bytes at 'word' are a word of the table. */
+int LinenoiseCommandTableContains(const LinenoiseCommandTable *t, const char *word, size_t len)
+{
+	uint32_t	bucket, slot;
+	const char *w;
+
+	if (t->nwords == 0)
+		return 0;
+	bucket = LinenoiseHashCommand(word, len, 0) % t->nbuckets;
+	slot   = LinenoiseHashCommand(word, len, t->seeds[bucket]) % t->nwords;
+	w	   = t->words[t->slots[slot]];
+	return strncmp(w, word, len) == 0 && w[len] == '\0';
+}
+
+/* Add to 'lc' the words of the table starting with 'prefix', in
+ * lexicographic order, at most 'max' of them unless it is zero. With a NULL
+ * 'lc' they are only counted. Returns the number of words. */
+size_t LinenoiseCommandTableComplete(const LinenoiseCommandTable *t, const char *prefix, LinenoiseCompletions *lc, size_t max)
+{
+	size_t plen = strlen(prefix), lo = 0, hi = t->nwords, n = 0;
+
+	/* The first word not before the prefix. */
+	while (lo < hi)
+	{
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (strcmp(t->words[mid], prefix) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (; lo < t->nwords && (max == 0 || n < max) && !strncmp(t->words[lo], prefix, plen); lo++, n++)
+		if (lc)
+			LinenoiseAddCompletion(lc, t->words[lo]);
+	return n;
+}
+
+/* =========================== Line editing ================================= */
+
+/* We define a very simple "append buffer" structure, that is an heap
+ * allocated string where we can append to. This is useful in order to
+ * write all the escape sequences in a buffer and flush them to the standard
+ * output in a single call, to avoid flickering effects. */
+struct abuf
+{
+	char *b;
+	int	  len;
+};
+
+static void abInit(struct abuf *ab)
+{
+	ab->b	= NULL;
+	ab->len = 0;
+}
+
+static void abAppend(struct abuf *ab, const char *s, int len)
+{
+	char *new = realloc(ab->b, ab->len + len);
+
+	if (new == NULL)
+		return;
+	memcpy(new + ab->len, s, len);
+	ab->b = new;
+	ab->len += len;
+}
+
+static void abFree(struct abuf *ab) { free(ab->b); }
+
+/* Helper of refreshSingleLine() and refreshMultiLine() to show hints
+ * to the right of the prompt. When no hints callback is registered and
+ * autosuggestions are enabled, the rest of the newest history entry starting
+ * with the current line is shown instead. */
+void RefreshShowHints(struct abuf *ab, struct LinenoiseState *l, int plen)
+{
+	char seq[64];
+	if ((l_HintsCallback || l->history_autosuggest) && plen + l->len < l->cols)
+	{
+		int	  color = -1, bold = 0;
+		char *hint	= NULL;
+
+		if (l_HintsCallback)
+			hint = l_HintsCallback(l->buf, &color, &bold);
+		else
+		{
+			const char *suggestion = HistorySuggest(l);
+			if (suggestion)
+			{
+				hint  = (char *)suggestion + l->len;
+				color = 90; /* Bright black, that is grey. */
+			}
+		}
+		if (hint)
+		{
+			int hintlen	   = strlen(hint);
+			int hintmaxlen = l->cols - (plen + l->len);
+
+			if (hintlen > hintmaxlen)
+				hintlen = hintmaxlen;
+			if (bold == 1 && color == -1)
+				color = 37;
+			if (color != -1 || bold != 0)
+				snprintf(seq, 64, "\033[%d;%d;49m", bold, color);
+			else
+				seq[0] = '\0';
+
+			abAppend(ab, seq, strlen(seq));
+			abAppend(ab, hint, hintlen);
+
+			if (color != -1 || bold != 0)
+				abAppend(ab, "\033[0m", 4);
+			/* Call the function to free the hint returned. */
+			if (l_HintsCallback && l_FreeHintsCallback)
+				l_FreeHintsCallback(hint);
+		}
+	}
+}
+
+/* Single line low level line refresh.
+ *
+ * Rewrite the currently edited line accordingly to the buffer content,
+ * cursor position, and number of columns of the terminal. */
+static void RefreshSingleLine(struct LinenoiseState *l)
+{
+	char		seq[64];
+	size_t		plen = strlen(l->prompt);
+	int			fd	 = l->ofd;
+	char *		buf	 = l->buf;
+	size_t		len	 = l->len;
+	size_t		pos	 = l->pos;
+	struct abuf ab;
+
+	while ((plen + pos) >= l->cols)
+	{
+		buf++;
+		len--;
+		pos--;
+	}
+
+	while (plen + len > l->cols)
+	{
+		len--;
+	}
+
+	abInit(&ab);
+	/* Cursor to left edge */
+	snprintf(seq, 64, "\r");
+	abAppend(&ab, seq, strlen(seq));
+	/* Write the prompt and the current buffer content */
+	abAppend(&ab, l->prompt, strlen(l->prompt));
+	abAppend(&ab, buf, len);
+	/* Show hits if any. */
+	RefreshShowHints(&ab, l, plen);
+	/* Erase to right */
+	snprintf(seq, 64, "\x1b[0K");
+	abAppend(&ab, seq, strlen(seq));
+	/* Move cursor to original position. */
+	snprintf(seq, 64, "\r\x1b[%dC", (int)(pos + plen));
+	abAppend(&ab, seq, strlen(seq));
+
+	write(fd, ab.b, ab.len);
+
+	abFree(&ab);
+}
+
+/* Multi line low level line refresh.
+ *
+ * Rewrite the currently edited line accordingly to the buffer content,
+ * cursor position, and number of columns of the terminal. */
+static void RefreshMultiLine(struct LinenoiseState *l)
+{
+	char		seq[64];
+	int			plen = strlen(l->prompt);
+	int			rows = (plen + l->len + l->cols - 1) / l->cols; /* rows used by current buf. */
+	int			rpos = (plen + l->oldpos + l->cols) / l->cols;	/* cursor relative row. */
+	int			rpos2;											/* rpos after refresh. */
+	int			col;											/* colum position, zero-based. */
+	int			old_rows = l->maxrows;
+	int			fd		 = l->ofd, j;
+	struct abuf ab;
+
+	/* Update maxrows if needed. */
+	if (rows > (int)l->maxrows)
+		l->maxrows = rows;
+
+	/* First step: clear all the lines used before. To do so start by
+	 * going to the last row. */
+	abInit(&ab);
+	if (old_rows - rpos > 0)
+	{
+		lndebug("go down %d", old_rows - rpos);
+		snprintf(seq, 64, "\x1b[%dB", old_rows - rpos);
+		abAppend(&ab, seq, strlen(seq));
+	}
+
+	/* Now for every row clear it, go up. */
+	for (j = 0; j < old_rows - 1; j++)
+	{
+		lndebug("clear+up");
+		snprintf(seq, 64, "\r\x1b[0K\x1b[1A");
+		abAppend(&ab, seq, strlen(seq));
+	}
+
+	/* Clean the top line. */
+	lndebug("clear");
+	snprintf(seq, 64, "\r\x1b[0K");
+	abAppend(&ab, seq, strlen(seq));
+
+	/* Write the prompt and the current buffer content */
+	abAppend(&ab, l->prompt, strlen(l->prompt));
+	abAppend(&ab, l->buf, l->len);
+
+	/* Show hits if any. */
+	RefreshShowHints(&ab, l, plen);
+
+	/* If we are at the very end of the screen with our prompt, we need to
+	 * emit a newline and move the prompt to the first column. */
+	if (l->pos && l->pos == l->len && (l->pos + plen) % l->cols == 0)
+	{
+		lndebug("<newline>");
+		abAppend(&ab, "\n", 1);
+		snprintf(seq, 64, "\r");
+		abAppend(&ab, seq, strlen(seq));
+		rows++;
+
+		if (rows > (int)l->maxrows)
+			l->maxrows = rows;
+	}
+
+	/* Move cursor to right position. */
+	rpos2 = (plen + l->pos + l->cols) / l->cols; /* current cursor relative row. */
+	lndebug("rpos2 %d", rpos2);
+
+	/* Go up till we reach the expected positon. */
+	if (rows - rpos2 > 0)
+	{
+		lndebug("go-up %d", rows - rpos2);
+		snprintf(seq, 64, "\x1b[%dA", rows - rpos2);
+		abAppend(&ab, seq, strlen(seq));
+	}
+
+	/* Set column. */
+	col = (plen + (int)l->pos) % (int)l->cols;
+	lndebug("set col %d", 1 + col);
+
+	if (col)
+		snprintf(seq, 64, "\r\x1b[%dC", col);
+	else
+		snprintf(seq, 64, "\r");
+	abAppend(&ab, seq, strlen(seq));
+
+	lndebug("\n");
+	l->oldpos = l->pos;
+
+	if (write(fd, ab.b, ab.len) == -1)
+		; /* Can't recover from write error. */
+
+	abFree(&ab);
+}
+
+/* Calls the two low level functions refreshSingleLine() or
+ * refreshMultiLine() according to the selected mode. */
+static void RefreshLine(struct LinenoiseState *l)
+{
+	if (l->mlmode)
+		RefreshMultiLine(l);
+	else
+		RefreshSingleLine(l);
+}
+
+/* Insert the character 'c' at cursor current position.
+ *
+ * On error writing to the terminal -1 is returned, otherwise 0. */
+int LinenoiseEditInsert(struct LinenoiseState *l, char c)
+{
+	if (l->len < l->buflen)
+	{
+		if (l->len == l->pos)
+		{
+			l->buf[l->pos] = c;
+			l->pos++;
+			l->len++;
+			l->buf[l->len] = '\0';
+			if ((!l->mlmode && l->plen + l->len < l->cols && !l_HintsCallback && !l->history_autosuggest))
+			{
+				/* Avoid a full update of the line in the
+				 * trivial case. */
+				if (write(l->ofd, &c, 1) == -1)
+					return -1;
+			}
+			else
+				RefreshLine(l);
+		}
+		else
+		{
+			memmove(l->buf + l->pos + 1, l->buf + l->pos, l->len - l->pos);
+			l->buf[l->pos] = c;
+			l->len++;
+			l->pos++;
+			l->buf[l->len] = '\0';
+			RefreshLine(l);
+		}
+	}
+	return 0;
+}
+
+/* Move cursor on the left. */
+void LinenoiseEditMoveLeft(struct LinenoiseState *l)
+{
+	if (l->pos > 0)
+	{
+		l->pos--;
+		RefreshLine(l);
+	}
+}
+
+/* Move cursor on the right. */
+void LinenoiseEditMoveRight(struct LinenoiseState *l)
+{
+	if (l->pos != l->len)
+	{
+		l->pos++;
+		RefreshLine(l);
+	}
+}
+
+/* Move cursor to the start of the line. */
+void LinenoiseEditMoveHome(struct LinenoiseState *l)
+{
+	if (l->pos != 0)
+	{
+		l->pos = 0;
+		RefreshLine(l);
+	}
+}
+
+/* Move cursor to the end of the line. */
+void LinenoiseEditMoveEnd(struct LinenoiseState *l)
+{
+	if (l->pos != l->len)
+	{
+		l->pos = l->len;
+		RefreshLine(l);
+	}
+}
+
+/* The right arrow and Ctrl+f accept the autosuggestion at the end of the
+ * line, End and Ctrl+e too. Enter never does. */
+static void EditMoveRightOrAccept(LinenoiseState *ls)
+{
+	if (ls->pos == ls->len)
+		HistoryAcceptSuggestion(ls);
+	else
+		LinenoiseEditMoveRight(ls);
+}
+
+static void EditMoveEndOrAccept(LinenoiseState *ls)
+{
+	if (ls->pos == ls->len)
+		HistoryAcceptSuggestion(ls);
+	else
+		LinenoiseEditMoveEnd(ls);
+}
+
+/* A history entry changed while browsing the history. The changes are kept
+ * aside until the line is accepted, the history itself is never modified.
+ * The buffers are reused by the next lines. */
+struct LinenoiseHistoryEdit
+{
+	int	   index; /* History index of the entry, 1 being the newest one. */
+	size_t size;  /* Room in line. */
+	char * line;  /* The entry as edited. */
+};
+
+/* Returns the changes made to the history entry 'index', or NULL. */
+static struct LinenoiseHistoryEdit *HistoryEditFind(LinenoiseState *l, int index)
+{
+	int j;
+
+	for (j = 0; j < l->history_edits_len; j++)
+		if (l->history_edits[j].index == index)
+			return &l->history_edits[j];
+	return NULL;
+}
+
+/* Remember the edited line as the content of the history entry 'index',
+ * if it differs from it. Returns 0 on out of memory. */
+static int HistoryEditSave(LinenoiseState *l, int index)
+{
+	struct LinenoiseHistoryEdit *e = HistoryEditFind(l, index);
+
+	if (e == NULL)
+	{
+		if (!strcmp(l->buf, l->history[l->history_len - index]))
+			return 1;
+		if (l->history_edits_len == l->history_edits_cap)
+		{
+			int							 cap   = l->history_edits_cap ? l->history_edits_cap * 2 : 4;
+			struct LinenoiseHistoryEdit *edits = realloc(l->history_edits, sizeof(*edits) * cap);
+
+			if (edits == NULL)
+				return 0;
+			memset(edits + l->history_edits_cap, 0, sizeof(*edits) * (cap - l->history_edits_cap));
+			l->history_edits	 = edits;
+			l->history_edits_cap = cap;
+		}
+		e = &l->history_edits[l->history_edits_len];
+	}
+	if (e->size < l->len + 1)
+	{
+		char *line = realloc(e->line, l->len + 1);
+
+		if (line == NULL)
+			return 0;
+		e->line = line;
+		e->size = l->len + 1;
+	}
+	memcpy(e->line, l->buf, l->len + 1);
+	if (e == &l->history_edits[l->history_edits_len])
+		l->history_edits_len++;
+	e->index = index;
+	return 1;
+}
+
+/* Substitute the currently edited line with the next or previous history
+ * entry as specified by 'dir'.
+ *
+ * Index zero is the line being edited, that is kept in a scratch buffer while
+ * browsing, index N is the N-th newest history entry. Changes made to the
+ * entries are kept in l->history_edits, so browsing copies the lines but
+ * allocates nothing unless an entry is changed. */
+#define LINENOISE_HISTORY_NEXT 0
+#define LINENOISE_HISTORY_PREV 1
+void LinenoiseEditHistoryNext(struct LinenoiseState *l, int dir)
+{
+	struct LinenoiseHistoryEdit *e;
+	const char *				 line;
+	int							 index;
+
+	if (l->history_len == 0)
+		return;
+
+	/* Save the line we are leaving before to overwrite it with the next one:
+	 * the edited line goes to the scratch buffer, changes to an history entry
+	 * go to its edit. */
+	if (l->history_index == 0)
+	{
+		if (l->history_scratch == NULL && (l->history_scratch = malloc(l->buflen + 1)) == NULL)
+			return;
+		memcpy(l->history_scratch, l->buf, l->len + 1);
+	}
+	else if (!HistoryEditSave(l, l->history_index))
+		return;
+
+	/* Find the new entry */
+	if (l->history_prefix_search)
+		index = HistoryPrefixStep(l, dir);
+	else
+	{
+		index = l->history_index + ((dir == LINENOISE_HISTORY_PREV) ? 1 : -1);
+		if (index > l->history_len)
+			index = -1;
+	}
+	if (index < 0)
+		return;
+
+	/* Show the new entry */
+	l->history_index = index;
+	if (index == 0)
+		line = l->history_scratch;
+	else if ((e = HistoryEditFind(l, index)) != NULL)
+		line = e->line;
+	else
+		line = l->history[l->history_len - index];
+	strncpy(l->buf, line, l->buflen);
+	l->buf[l->buflen - 1] = '\0';
+	l->len = l->pos = strlen(l->buf);
+	RefreshLine(l);
+}
+
+/* Delete the character at the right of the cursor without altering the cursor
+ * position. Basically this is what happens with the "Delete" keyboard key. */
+void LinenoiseEditDelete(struct LinenoiseState *l)
+{
+	if (l->len > 0 && l->pos < l->len)
+	{
+		memmove(l->buf + l->pos, l->buf + l->pos + 1, l->len - l->pos - 1);
+		l->len--;
+		l->buf[l->len] = '\0';
+		RefreshLine(l);
+	}
+}
+
+/* Backspace implementation. */
+void LinenoiseEditBackspace(struct LinenoiseState *l)
+{
+	if (l->pos > 0 && l->len > 0)
+	{
+		memmove(l->buf + l->pos - 1, l->buf + l->pos, l->len - l->pos);
+		l->pos--;
+		l->len--;
+		l->buf[l->len] = '\0';
+		RefreshLine(l);
+	}
+}
+
+/* Delete the previosu word, maintaining the cursor at the start of the
+ * current word. */
+void LinenoiseEditDeletePrevWord(struct LinenoiseState *l)
+{
+	size_t old_pos = l->pos;
+	size_t diff;
+
+	while (l->pos > 0 && l->buf[l->pos - 1] == ' ')
+		l->pos--;
+	while (l->pos > 0 && l->buf[l->pos - 1] != ' ')
+		l->pos--;
+
+	diff = old_pos - l->pos;
+	memmove(l->buf + l->pos, l->buf + old_pos, l->len - old_pos + 1);
+	l->len -= diff;
+	RefreshLine(l);
+}
+
+/* Delete the buffer state after running a command */
+void LinenoiseClearBuffer(LinenoiseState *ls)
+{
+	memset(ls->buf, 0, ls->buflen);
+	ls->pos = ls->len = 0;
+	RefreshLine(ls);
+}
+
+/* This function is the core of the line editing capability of linenoise.
+ * It expects 'fd' to be already in "raw mode" so that every key pressed
+ * will be returned ASAP to read().
+ *
+ * The resulting string is put into 'buf' when the user type enter, or
+ * when ctrl+d is typed.
+ *
+ * The function returns the length of the current buffer. */
+static int LinenoiseEdit(LinenoiseState *ls)
+{
+	// Write the prompt
+	if (write(ls->ofd, ls->prompt, ls->plen) == -1)
+		return -1;
+
+	while (true)
+	{
+		char c;
+		int	 nread;
+		char seq[3];
+
+		nread = EditReadKey(ls, &c);
+		if (nread <= 0)
+			return ls->len;
+		if (nread == 2 && c == 0)
+			continue;
+
+		/* Only autocomplete when a callback or a trie is set. It returns < 0
+		 * when there was an error reading from fd. Otherwise it will return
+		 * the character that should be handled next. */
+		if (c == 9 && (l_CompletionCallback != NULL || l_AsyncCompletionCallback != NULL || l_CompletionTrie != NULL))
+		{
+			c = CompleteLine(ls);
 			/* Return on errors */
 			if (c < 0)
 				return ls->len;
@@ -879,533 +2036,5688 @@ static int LinenoiseEdit(LinenoiseState *ls)
 				continue;
 		}
 
-		switch (c)
+		switch (c)
+		{
+			case ENTER: /* enter */
+				if (ls->mlmode)
+					LinenoiseEditMoveEnd(ls);
+				if (l_HintsCallback || ls->history_autosuggest)
+				{
+					/* Force a refresh without hints to leave the previous
+					 * line as the user typed it after a newline. */
+					LinenoiseHintsCallback *hc = l_HintsCallback;
+					bool					as = ls->history_autosuggest;
+					l_HintsCallback			   = NULL;
+					ls->history_autosuggest	   = false;
+					RefreshLine(ls);
+					l_HintsCallback			= hc;
+					ls->history_autosuggest = as;
+				}
+				return (int)ls->len;
+			case CTRL_C: /* ctrl-c */
+				errno = EAGAIN;
+				return -1;
+			case BACKSPACE: /* backspace */
+			case 8:			/* ctrl-h */
+				LinenoiseEditBackspace(ls);
+				break;
+			case CTRL_D: /* ctrl-d, remove char at right of cursor, or if the
+							line is empty, act as end-of-file. */
+				if (ls->len > 0)
+					LinenoiseEditDelete(ls);
+				else
+					return -1;
+				break;
+			case CTRL_T: /* ctrl-t, swaps current character with previous. */
+				if (ls->pos > 0 && ls->pos < ls->len)
+				{
+					int aux			 = ls->buf[ls->pos - 1];
+					ls->buf[ls->pos - 1] = ls->buf[ls->pos];
+					ls->buf[ls->pos]	 = aux;
+					if (ls->pos != ls->len - 1)
+						ls->pos++;
+					RefreshLine(ls);
+				}
+				break;
+			case CTRL_B: /* ctrl-b */
+				LinenoiseEditMoveLeft(ls);
+				break;
+			case CTRL_F: /* ctrl-f */
+				EditMoveRightOrAccept(ls);
+				break;
+			case CTRL_P: /* ctrl-p */
+				LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_PREV);
+				break;
+			case CTRL_N: /* ctrl-n */
+				LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_NEXT);
+				break;
+			case CTRL_R: /* ctrl-r, fuzzy history search */
+				if (HistoryFuzzyFind(ls) == -1)
+					return ls->len;
+				break;
+			case ESC: /* escape sequence */
+				/* Read the next two bytes representing the escape sequence.
+				 * Use two calls to handle slow terminals returning the two
+				 * chars at different times. */
+				if (read(ls->ifd, seq, 1) == -1)
+					break;
+				if (read(ls->ifd, seq + 1, 1) == -1)
+					break;
+
+				/* ESC [ sequences. */
+				if (seq[0] == '[')
+				{
+					if (seq[1] >= '0' && seq[1] <= '9')
+					{
+						/* Extended escape, read additional byte. */
+						if (read(ls->ifd, seq + 2, 1) == -1)
+							break;
+						if (seq[2] == '~')
+						{
+							switch (seq[1])
+							{
+								case '3': /* Delete key. */
+									LinenoiseEditDelete(ls);
+									break;
+							}
+						}
+					}
+					else
+					{
+						switch (seq[1])
+						{
+							case 'A': /* Up */
+								LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_PREV);
+								break;
+							case 'B': /* Down */
+								LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_NEXT);
+								break;
+							case 'C': /* Right */
+								EditMoveRightOrAccept(ls);
+								break;
+							case 'D': /* Left */
+								LinenoiseEditMoveLeft(ls);
+								break;
+							case 'H': /* Home */
+								LinenoiseEditMoveHome(ls);
+								break;
+							case 'F': /* End*/
+								EditMoveEndOrAccept(ls);
+								break;
+						}
+					}
+				}
+
+				/* ESC O sequences. */
+				else if (seq[0] == 'O')
+				{
+					switch (seq[1])
+					{
+						case 'H': /* Home */
+							LinenoiseEditMoveHome(ls);
+							break;
+						case 'F': /* End*/
+							EditMoveEndOrAccept(ls);
+							break;
+					}
+				}
+				break;
+			default:
+				if (LinenoiseEditInsert(ls, c))
+					return -1;
+				break;
+			case CTRL_U: /* Ctrl+u, delete the whole line. */
+				ls->buf[0] = '\0';
+				ls->pos = ls->len = 0;
+				RefreshLine(ls);
+				break;
+			case CTRL_K: /* Ctrl+k, delete from current to end of line. */
+				ls->buf[ls->pos] = '\0';
+				ls->len	   = ls->pos;
+				RefreshLine(ls);
+				break;
+			case CTRL_A: /* Ctrl+a, go to the start of the line */
+				LinenoiseEditMoveHome(ls);
+				break;
+			case CTRL_E: /* ctrl+e, go to the end of the line */
+				EditMoveEndOrAccept(ls);
+				break;
+			case CTRL_L: /* ctrl+l, clear screen */
+				LinenoiseClearScreen(ls);
+				RefreshLine(ls);
+				break;
+			case CTRL_W: /* ctrl+w, delete previous word */
+				LinenoiseEditDeletePrevWord(ls);
+				break;
+		}
+	}
+	return ls->len;
+}
+
+/* This special mode is used by linenoise in order to print scan codes
+ * on screen for debugging / development purposes. It is implemented
+ * by the linenoise_example program using the --keycodes option. */
+void LinenoisePrintKeyCodes(LinenoiseState *ls)
+{
+	char quit[4];
+
+	dprintf(ls->ofd,
+			"Linenoise key codes debugging mode.\n"
+			"Press keys to see scan codes. Type 'quit' at any time to exit.\n");
+	if (EnableRawMode(ls, ls->ifd) == -1)
+		return;
+	memset(quit, ' ', 4);
+	while (true)
+	{
+		char c;
+		int	 nread;
+
+		nread = read(ls->ifd, &c, 1);
+		if (nread <= 0)
+			continue;
+
+		memmove(quit, quit + 1, sizeof(quit) - 1); /* shift string to left. */
+		quit[sizeof(quit) - 1] = c;				   /* Insert current char on the right. */
+
+		if (memcmp(quit, "quit", sizeof(quit)) == 0)
+			break;
+
+		dprintf(ls->ofd, "'%c' %02x (%d) (type quit to exit)\n", isprint(c) ? c : '?', (int)c, (int)c);
+		dprintf(ls->ofd, "\r"); /* Go left edge manually, we are in raw mode. */
+	}
+	DisableRawMode(ls, ls->ifd);
+}
+
+/* This function calls the line editing function linenoiseEdit() using
+ * the STDIN file descriptor set in raw mode. */
+static int LinenoiseRaw(LinenoiseState *ls)
+{
+	int count;
+
+	if (ls->buflen == 0)
+	{
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (EnableRawMode(ls, ls->ifd) == -1)
+		return -1;
+	count = LinenoiseEdit(ls);
+	CompletionCancel(ls);
+	DisableRawMode(ls, ls->ifd);
+	dprintf(ls->ofd, "\n");
+	return count;
+}
+
+/* This function is called when linenoise() is called with the standard
+ * input file descriptor not attached to a TTY. So for example when the
+ * program using linenoise is called in pipe or with a file redirected
+ * to its standard input. In this case, we want to be able to return the
+ * line regardless of its length (by default we are limited to 4k). */
+static char *LinenoiseNoTTY(void)
+{
+	char * line = NULL;
+	size_t len = 0, maxlen = 0;
+
+	while (true)
+	{
+		if (len == maxlen)
+		{
+			if (maxlen == 0)
+				maxlen = 16;
+			maxlen *= 2;
+			char *oldval = line;
+			line		 = realloc(line, maxlen);
+			if (line == NULL)
+			{
+				if (oldval)
+					free(oldval);
+				return NULL;
+			}
+		}
+		int c = fgetc(stdin);
+		if (c == EOF || c == '\n')
+		{
+			if (c == EOF && len == 0)
+			{
+				free(line);
+				return NULL;
+			}
+			else
+			{
+				line[len] = '\0';
+				return line;
+			}
+		}
+		else
+		{
+			line[len] = c;
+			len++;
+		}
+	}
+}
+
+void LinenoiseSetNonblock(const LinenoiseState *ls)
+{
+	int flags = 0;
+	if ((flags = fcntl(ls->ifd, F_GETFL, 0)) < 0)
+	{
+		dprintf(ls->efd, "Error calling fcntl in %s: %s\n", __FUNCTION__, strerror(errno));
+	}
+}
+
+LinenoiseState *LinenoiseCreate(int ls_stdin, int ls_stdout, int ls_stderr, const char *prompt)
+{
+	LinenoiseState *ls = malloc(sizeof(LinenoiseState));
+	if (!ls)
+		return NULL;
+
+	memset(ls, 0, sizeof(LinenoiseState));
+
+	/* Populate the linenoise state that we pass to functions implementing
+	 * specific editing functionalities. */
+	ls->ifd	   = ls_stdin;
+	ls->ofd	   = ls_stdout;
+	ls->efd	   = ls_stderr;
+	ls->buf	   = malloc(LINENOISE_MAX_LINE);
+	ls->buflen = LINENOISE_MAX_LINE;
+	ls->prompt = strdup(prompt);
+	ls->plen   = strlen(prompt);
+	ls->oldpos = ls->pos = 0;
+	ls->len				 = 0;
+	ls->cols			 = GetColumns(ls_stdin, ls_stdout);
+	ls->maxrows			 = 0;
+	ls->history_index	 = 0;
+	ls->mlmode = false;
+	ls->rawmode = false;
+	ls->nonblock = false;
+	ls->history = NULL;
+	ls->history_len = 0;
+	ls->history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
+	ls->completion_fd = ls->completion_wfd = -1;
+
+	/* Buffer starts empty. */
+	memset(ls->buf, 0, ls->buflen);
+	ls->buflen--; /* Make sure there is always space for the nulterm */
+
+	return ls;
+}
+
+/* The high level function that is the main API of the linenoise library.
+ * This function checks if the terminal has basic capabilities, just checking
+ * for a blacklist of stupid terminals, and later either calls the line
+ * editing function or uses dummy fgets() so that you will be able to type
+ * something even in the most desperate of the conditions. */
+char *Linenoise(LinenoiseState *ls)
+{
+	int	 count;
+	ls->buf[0] = '\0';
+	ls->len = ls->pos = 0;
+	ls->history_index = 0;
+	ls->history_edits_len = 0;
+
+	/* Pick up the entries other sessions added meanwhile. */
+	if (ls->history_file)
+		LinenoiseHistorySync(ls);
+	if (ls->history_ring)
+		HistoryRingPull(ls);
+
+	if (!isatty(ls->ifd))
+	{
+		/* Not a tty: read from file / pipe. In this mode we don't want any
+		 * limit to the line size, so we call a function to handle that. */
+		return LinenoiseNoTTY();
+	}
+	else if (IsUnsupportedTerm())
+	{
+		size_t len;
+
+		dprintf(ls->ofd, "%s", ls->prompt);
+		if (fgets(ls->buf, ls->buflen, stdin) == NULL)
+			return NULL;
+
+		len = strlen(ls->buf);
+		while (len && (ls->buf[len - 1] == '\n' || ls->buf[len - 1] == '\r'))
+		{
+			len--;
+			ls->buf[len] = '\0';
+		}
+		dprintf(ls->ofd, "\r");
+		return strdup(ls->buf);
+	}
+	else
+	{
+		count = LinenoiseRaw(ls);
+		if (count == -1)
+			return NULL;
+		dprintf(ls->ofd, "\r");
+		return strdup(ls->buf);
+	}
+}
+
+/* This is just a wrapper the user may want to call in order to make sure
+ * the linenoise returned buffer is freed with the same allocator it was
+ * created with. Useful when the main program is using an alternative
+ * allocator. */
+void LinenoiseFree(void *ptr)
+{
+	free(ptr);
+}
+
+/* ========================= History substring index ======================== */
+
+/* The trigram index is an optional structure that makes substring searches
+ * over very large histories cheap. Every entry gets a sequence number when
+ * it is added, and for every three bytes window of the entry its sequence
+ * number is appended to the posting list of the bucket the trigram hashes
+ * to. Since sequence numbers only grow, posting lists are always sorted and
+ * a query just intersects the lists of the trigrams found in the needle and
+ * verifies the few surviving candidates with strstr().
+ *
+ * Trigrams are hashed into a fixed number of buckets, so two trigrams may
+ * share a list: this only adds false positives that the verification step
+ * removes. Evicted entries are dropped lazily from the head of the lists,
+ * by the searches too. Entries never change once added: the edits made while
+ * browsing the history are kept aside, so the index needs no update then. */
+#define LINENOISE_TRIGRAM_BUCKETS 65536
+#define LINENOISE_TRIGRAM_MAX_LISTS 32 /* Lists intersected per query, the rest is verified. */
+
+struct LinenoisePosting
+{
+	uint32_t *ids;	/* Sorted sequence numbers of the entries. */
+	uint32_t  head; /* First id not yet dropped because of eviction. */
+	uint32_t  len;	/* Number of ids used in 'ids'. */
+	uint32_t  cap;	/* Number of ids allocated in 'ids'. */
+};
+
+struct LinenoiseTrigramIndex
+{
+	uint32_t				first;							 /* Sequence number of history[0]. */
+	uint32_t				next;							 /* Sequence number of the next entry. */
+	struct LinenoisePosting lists[LINENOISE_TRIGRAM_BUCKETS]; /* Posting list of every bucket. */
+};
+
+static unsigned int TrigramBucket(const unsigned char *p)
+{
+	uint32_t t = ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+	return (t * 2654435761u) >> 16;
+}
+
+/* Drop the ids of evicted entries from the head of the posting list, and
+ * give the space back once the dead part dominates the list. */
+static void PostingTrim(struct LinenoisePosting *pl, uint32_t first)
+{
+	while (pl->head < pl->len && pl->ids[pl->head] < first)
+		pl->head++;
+
+	if (pl->head == pl->len)
+		pl->head = pl->len = 0;
+	else if (pl->head >= 64 && pl->head > pl->len / 2)
+	{
+		memmove(pl->ids, pl->ids + pl->head, sizeof(uint32_t) * (pl->len - pl->head));
+		pl->len -= pl->head;
+		pl->head = 0;
+	}
+}
+
+static int PostingAppend(struct LinenoisePosting *pl, uint32_t id, uint32_t first)
+{
+	/* The same trigram may appear more than once in a single entry. */
+	if (pl->len > pl->head && pl->ids[pl->len - 1] == id)
+		return 0;
+
+	PostingTrim(pl, first);
+	if (pl->len == pl->cap)
+	{
+		uint32_t  cap = pl->cap ? pl->cap * 2 : 4;
+		uint32_t *ids = realloc(pl->ids, sizeof(uint32_t) * cap);
+		if (ids == NULL)
+			return -1;
+		pl->ids = ids;
+		pl->cap = cap;
+	}
+	pl->ids[pl->len++] = id;
+	return 0;
+}
+
+static int PostingContains(const struct LinenoisePosting *pl, uint32_t id)
+{
+	uint32_t lo = pl->head, hi = pl->len;
+
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+		if (pl->ids[mid] < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo < pl->len && pl->ids[lo] == id;
+}
+
+static void TrigramIndexReset(struct LinenoiseTrigramIndex *idx)
+{
+	int j;
+
+	for (j = 0; j < LINENOISE_TRIGRAM_BUCKETS; j++)
+		idx->lists[j].head = idx->lists[j].len = 0;
+	idx->first = idx->next = 0;
+}
+
+static void TrigramIndexFree(struct LinenoiseTrigramIndex *idx)
+{
+	int j;
+
+	if (idx == NULL)
+		return;
+	for (j = 0; j < LINENOISE_TRIGRAM_BUCKETS; j++)
+		free(idx->lists[j].ids);
+	free(idx);
+}
+
+/* Index 'line' as the newest history entry. */
+static void TrigramIndexAdd(struct LinenoiseTrigramIndex *idx, const char *line)
+{
+	const unsigned char *p	 = (const unsigned char *)line;
+	size_t				 len = strlen(line), j;
+	uint32_t			 id	 = idx->next++;
+
+	for (j = 0; j + 3 <= len; j++)
+		PostingAppend(&idx->lists[TrigramBucket(p + j)], id, idx->first);
+}
+
+/* Re-index the whole history, used when the index is enabled on an history
+ * that is already populated and when sequence numbers are exhausted. */
+static void TrigramIndexRebuild(LinenoiseState *ls)
+{
+	int j;
+
+	TrigramIndexReset(ls->history_trigrams);
+	for (j = 0; j < ls->history_len; j++)
+		TrigramIndexAdd(ls->history_trigrams, ls->history[j]);
+}
+
+/* Enable or disable the trigram index of the history. Returns 1 on success
+ * and 0 if the index could not be allocated. */
+int LinenoiseHistorySetTrigramIndex(LinenoiseState *ls, int enable)
+{
+	if (!enable)
+	{
+		TrigramIndexFree(ls->history_trigrams);
+		ls->history_trigrams = NULL;
+		return 1;
+	}
+
+	if (ls->history_trigrams == NULL)
+	{
+		ls->history_trigrams = calloc(1, sizeof(struct LinenoiseTrigramIndex));
+		if (ls->history_trigrams == NULL)
+			return 0;
+		TrigramIndexRebuild(ls);
+	}
+	return 1;
+}
+
+/* Linear scan, used when there is no index or the needle is too short to
+ * contain a trigram. */
+static int HistorySearchScan(const LinenoiseState *ls, const char *needle, int from)
+{
+	int j;
+
+	for (j = from; j >= 0; j--)
+	{
+		if (strstr(ls->history[j], needle))
+			return j;
+	}
+	return -1;
+}
+
+/* Search the history for the newest entry containing 'needle', starting at
+ * index 'from' and going towards older entries. Returns the index of the
+ * entry in the history or -1 if nothing matches. */
+int LinenoiseHistorySearch(LinenoiseState *ls, const char *needle, int from)
+{
+	struct LinenoiseTrigramIndex *idx = ls->history_trigrams;
+	struct LinenoisePosting *	  lists[LINENOISE_TRIGRAM_MAX_LISTS];
+	const unsigned char *		  p	   = (const unsigned char *)needle;
+	size_t						  nlen = strlen(needle), j;
+	int							  nlists = 0, i, k;
+	uint32_t					  lo, hi;
+
+	if (from >= ls->history_len)
+		from = ls->history_len - 1;
+	if (from < 0)
+		return -1;
+	if (idx == NULL || nlen < 3)
+		return HistorySearchScan(ls, needle, from);
+
+	/* Collect the distinct posting lists of the needle, keeping the shortest
+	 * one first: it drives the intersection. */
+	for (j = 0; j + 3 <= nlen; j++)
+	{
+		struct LinenoisePosting *pl = &idx->lists[TrigramBucket(p + j)];
+
+		PostingTrim(pl, idx->first);
+		if (pl->len == pl->head)
+			return -1;
+		for (k = 0; k < nlists && lists[k] != pl; k++)
+			;
+		if (k < nlists || nlists == LINENOISE_TRIGRAM_MAX_LISTS)
+			continue;
+		lists[nlists++] = pl;
+		if (pl->len - pl->head < lists[0]->len - lists[0]->head)
+		{
+			lists[nlists - 1] = lists[0];
+			lists[0]		  = pl;
+		}
+	}
+
+	/* Walk the driver list from the newest id not after 'from', found with a
+	 * binary search so that resuming a search doesn't rescan the newer ids,
+	 * skipping ids that are not in every other list and verifying the others. */
+	lo = lists[0]->head;
+	hi = lists[0]->len;
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2;
+
+		if (lists[0]->ids[mid] - idx->first <= (uint32_t)from)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	for (i = (int)lo - 1; i >= (int)lists[0]->head; i--)
+	{
+		uint32_t id = lists[0]->ids[i];
+		int		 pos;
+
+		if (id >= idx->next)
+			continue;
+		pos = (int)(id - idx->first);
+		if (pos > from)
+			continue;
+
+		for (k = 1; k < nlists && PostingContains(lists[k], id); k++)
+			;
+		if (k == nlists && strstr(ls->history[pos], needle))
+			return pos;
+	}
+	return -1;
+}
+
+/* ========================== History prefix index ========================== */
+
+/* The prefix index keeps the sequence numbers of the history entries sorted
+ * by the text of the entry, and by age for identical entries. All the entries
+ * starting with a given prefix are then a contiguous range that two binary
+ * searches find. New entries go to a small sorted tail, merged into the
+ * index once it grows past the square root of the index size, so adding
+ * moves a few ids and merging moves every id once per that many adds. The
+ * ids of evicted entries stay in place, skipped by the searches, until the
+ * next merge drops them. The index is rebuilt lazily after changes that
+ * would require touching most of it, like loading a file. */
+
+#define LINENOISE_PREFIX_MERGE 64 /* Pending ids never worth a merge. */
+#define LINENOISE_PREFIX_BLOCK 16 /* Positions of the index below a leaf of the tree. */
+
+/* What a node of the tree knows of the entries below it, see
+ * PrefixBestBuild(). */
+struct PrefixBest
+{
+	uint32_t top;  /* Newest id + 1, 0 if none. */
+	uint32_t uses; /* Highest use count. */
+	uint32_t time; /* Newest last use. */
+};
+
+/* The entries starting with a prefix: a range of the index and one of its
+ * tail. */
+struct PrefixSpan
+{
+	uint32_t lo, hi;   /* Range of the index. */
+	uint32_t tlo, thi; /* Range of the tail. */
+};
+
+struct LinenoisePrefixIndex
+{
+	uint32_t  first;	/* Sequence number of history[0], older ids are evicted. */
+	uint32_t  next;		/* Sequence number of the next entry. */
+	uint32_t *ids;		/* Sequence numbers sorted by entry. */
+	uint32_t  len;		/* Number of ids in 'ids'. */
+	uint32_t  cap;		/* Number of ids allocated in 'ids'. */
+	uint32_t *tail;		/* Sorted ids added since the last merge, all newer than 'ids'. */
+	uint32_t  taillen;	/* Number of ids in 'tail'. */
+	uint32_t  tailcap;	/* Number of ids allocated in 'tail'. */
+	uint32_t  evicted;	/* Ids of evicted entries still in 'ids' or 'tail'. */
+	struct PrefixBest *best; /* Suggestions: tree over the blocks of 'ids'. */
+	uint32_t		   nblocks; /* Suggestions: leaves of the tree. */
+	uint32_t		   bestcap; /* Suggestions: nodes allocated in 'best'. */
+	uint32_t *		   queue; /* Suggestions: nodes left to visit, as many as nodes. */
+	bool			   bestvalid; /* Suggestions: the tree matches 'ids'. */
+	bool	  dirty;	/* The order is stale and must be rebuilt before use. */
+	uint32_t *matches;	/* Navigation: heap of the unvisited matches, then the visited ones. */
+	uint32_t  heaplen;	/* Navigation: number of matches still in the heap. */
+	uint32_t  nmatches; /* Navigation: total number of matches. */
+	uint32_t  visited;	/* Navigation: number of matches stepped through. */
+	time_t	  now;		/* Navigation: time the matches are ranked at. */
+	char *	  hint;		/* Suggestions: the line of the last lookup. */
+	size_t	  hintlen;	/* Suggestions: length of the line of the last lookup. */
+	size_t	  hintcap;	/* Suggestions: allocated size of 'hint'. */
+	struct PrefixSpan hintspan;	 /* Suggestions: the entries starting with the line. */
+	uint32_t		  hintid;	 /* Suggestions: newest of them, UINT32_MAX for none. */
+	bool			  hintvalid; /* Suggestions: the last lookup can be reused. */
+};
+
+static const char *PrefixEntry(const LinenoiseState *ls, uint32_t id)
+{
+	return ls->history[id - ls->history_prefixes->first];
+}
+
+/* Order of the index: by text, then by sequence number. */
+static int PrefixCompare(const LinenoiseState *ls, const char *line, uint32_t id, uint32_t other)
+{
+	int c = strcmp(line, PrefixEntry(ls, other));
+	if (c == 0)
+		c = (id > other) - (id < other);
+	return c;
+}
+
+/* Return the first position from 'mid' on holding the id of an entry that
+ * was not evicted, or 'hi' if there is none before it. */
+static uint32_t PrefixLive(const LinenoiseState *ls, const uint32_t *ids, uint32_t mid, uint32_t hi)
+{
+	uint32_t first = ls->history_prefixes->first;
+
+	while (mid < hi && ids[mid] < first)
+		mid++;
+	return mid;
+}
+
+/* Return the first position of ids[lo, hi) whose entry is not less than
+ * 'line' with sequence number 'id'. The evicted ids can't be compared: a
+ * probe landing on them uses the next live id, or looks left if there is
+ * none. */
+static uint32_t PrefixLowerBound(const LinenoiseState *ls, const uint32_t *ids, uint32_t lo, uint32_t hi, const char *line,
+								 uint32_t id)
+{
+	while (lo < hi)
+	{
+		uint32_t mid = lo + (hi - lo) / 2, live = PrefixLive(ls, ids, mid, hi);
+
+		if (live < hi && PrefixCompare(ls, line, id, ids[live]) > 0)
+			lo = live + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Narrow the range [*lo, *hi) of 'ids' to the entries starting with the
+ * 'plen' bytes at 'prefix'. */
+static void PrefixRange(const LinenoiseState *ls, const uint32_t *ids, const char *prefix, size_t plen, uint32_t *lo,
+						uint32_t *hi)
+{
+	uint32_t l = *lo, h = *hi;
+
+	while (l < h)
+	{
+		uint32_t mid = l + (h - l) / 2, live = PrefixLive(ls, ids, mid, h);
+
+		if (live < h && strncmp(PrefixEntry(ls, ids[live]), prefix, plen) < 0)
+			l = live + 1;
+		else
+			h = mid;
+	}
+	*lo = l;
+
+	h = *hi;
+	while (l < h)
+	{
+		uint32_t mid = l + (h - l) / 2, live = PrefixLive(ls, ids, mid, h);
+
+		if (live < h && strncmp(PrefixEntry(ls, ids[live]), prefix, plen) <= 0)
+			l = live + 1;
+		else
+			h = mid;
+	}
+	*hi = l;
+}
+
+/* Narrow 'sp', both in the index and in its tail, to the entries starting
+ * with the 'plen' bytes at 'prefix'. */
+static void PrefixSpanNarrow(const LinenoiseState *ls, struct PrefixSpan *sp, const char *prefix, size_t plen)
+{
+	const struct LinenoisePrefixIndex *px = ls->history_prefixes;
+
+	PrefixRange(ls, px->ids, prefix, plen, &sp->lo, &sp->hi);
+	PrefixRange(ls, px->tail, prefix, plen, &sp->tlo, &sp->thi);
+}
+
+static void PrefixSpanAll(const LinenoiseState *ls, struct PrefixSpan *sp)
+{
+	sp->lo = sp->tlo = 0;
+	sp->hi			 = ls->history_prefixes->len;
+	sp->thi			 = ls->history_prefixes->taillen;
+}
+
+/* Consume the next live id of 'sp' in the order of the index, or return
+ * UINT32_MAX at its end. Identical entries of the tail are newer, so they
+ * come after the ones of the index. */
+static uint32_t PrefixSpanNext(const LinenoiseState *ls, struct PrefixSpan *sp)
+{
+	const struct LinenoisePrefixIndex *px = ls->history_prefixes;
+
+	sp->lo	= PrefixLive(ls, px->ids, sp->lo, sp->hi);
+	sp->tlo = PrefixLive(ls, px->tail, sp->tlo, sp->thi);
+	if (sp->lo == sp->hi && sp->tlo == sp->thi)
+		return UINT32_MAX;
+	if (sp->tlo == sp->thi ||
+		(sp->lo < sp->hi && PrefixCompare(ls, PrefixEntry(ls, px->ids[sp->lo]), px->ids[sp->lo], px->tail[sp->tlo]) < 0))
+		return px->ids[sp->lo++];
+	return px->tail[sp->tlo++];
+}
+
+static void PrefixSort(const LinenoiseState *ls, uint32_t *ids, uint32_t *tmp, uint32_t n)
+{
+	uint32_t half = n / 2, i = 0, j = half, k = 0;
+
+	if (n < 2)
+		return;
+	PrefixSort(ls, ids, tmp, half);
+	PrefixSort(ls, ids + half, tmp, n - half);
+
+	while (i < half && j < n)
+	{
+		if (PrefixCompare(ls, PrefixEntry(ls, ids[i]), ids[i], ids[j]) <= 0)
+			tmp[k++] = ids[i++];
+		else
+			tmp[k++] = ids[j++];
+	}
+	while (i < half)
+		tmp[k++] = ids[i++];
+	/* What is left of the second half is already in place. */
+	memcpy(ids, tmp, sizeof(uint32_t) * k);
+}
+
+/* Make room for 'len' ids in '*ids', of '*cap' ids. */
+static int PrefixReserve(uint32_t **ids, uint32_t *cap, uint32_t len)
+{
+	uint32_t *p;
+	uint32_t  n = *cap ? *cap : 16;
+
+	if (len <= *cap)
+		return 0;
+	while (n < len)
+		n *= 2;
+	p = realloc(*ids, sizeof(uint32_t) * n);
+	if (p == NULL)
+		return -1;
+	*ids = p;
+	*cap = n;
+	return 0;
+}
+
+/* Merge the tail into the index and drop the evicted ids, once there are
+ * enough of them. Every id of the tail finds its place with a binary search
+ * in what is left of the index, then the ids are moved in a single pass. */
+static void PrefixIndexMerge(LinenoiseState *ls)
+{
+	struct LinenoisePrefixIndex *px		 = ls->history_prefixes;
+	uint64_t					 pending = px->taillen + px->evicted;
+	uint32_t *					 ids, cap = 0, n = 0, i = 0, t;
+
+	if (pending < LINENOISE_PREFIX_MERGE || pending * pending < px->len)
+		return;
+	ids = NULL;
+	if (PrefixReserve(&ids, &cap, px->len + px->taillen) == -1)
+	{
+		px->dirty = true;
+		return;
+	}
+	for (t = 0; t <= px->taillen; t++)
+	{
+		uint32_t end = px->len;
+
+		if (t < px->taillen)
+		{
+			if (px->tail[t] < px->first)
+				continue;
+			end = PrefixLowerBound(ls, px->ids, i, px->len, PrefixEntry(ls, px->tail[t]), px->tail[t]);
+		}
+		for (; i < end; i++)
+			if (px->ids[i] >= px->first)
+				ids[n++] = px->ids[i];
+		if (t < px->taillen)
+			ids[n++] = px->tail[t];
+	}
+	free(px->ids);
+	px->ids		= ids;
+	px->cap		= cap;
+	px->len		  = n;
+	px->taillen	  = px->evicted = 0;
+	px->hintvalid = false;
+	px->bestvalid = false;
+}
+
+/* Make sure the index is sorted, and merge it if due. Returns -1 if it could
+ * not be rebuilt. */
+static int PrefixIndexUpdate(LinenoiseState *ls)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	uint32_t *					 tmp, j;
+
+	if (!px->dirty)
+		PrefixIndexMerge(ls);
+	if (!px->dirty)
+		return 0;
+	if (PrefixReserve(&px->ids, &px->cap, ls->history_len) == -1)
+		return -1;
+	tmp = malloc(sizeof(uint32_t) * (ls->history_len + 1));
+	if (tmp == NULL)
+		return -1;
+
+	px->first = 0;
+	px->next = px->len = ls->history_len;
+	for (j = 0; j < px->len; j++)
+		px->ids[j] = j;
+	PrefixSort(ls, px->ids, tmp, px->len);
+	free(tmp);
+	px->taillen = px->evicted = 0;
+	px->dirty					= false;
+	px->hintvalid				= false;
+	px->bestvalid				= false;
+	return 0;
+}
+
+static void PrefixIndexAdd(LinenoiseState *ls, const char *line)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	uint32_t					 id = px->next++, pos;
+
+	if (px->dirty)
+		return;
+	if (px->next == UINT32_MAX || PrefixReserve(&px->tail, &px->tailcap, px->taillen + 1) == -1)
+	{
+		px->dirty = true;
+		return;
+	}
+	pos = PrefixLowerBound(ls, px->tail, 0, px->taillen, line, id);
+	memmove(px->tail + pos + 1, px->tail + pos, sizeof(uint32_t) * (px->taillen - pos));
+	px->tail[pos] = id;
+	px->taillen++;
+	PrefixIndexMerge(ls);
+}
+
+/* Called before the oldest 'n' entries are removed from the history: their
+ * ids just become evicted, and are dropped by the next merge. */
+static void PrefixIndexEvict(LinenoiseState *ls, int n)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+
+	px->first += n;
+	if (!px->dirty)
+		px->evicted += n;
+}
+
+static void PrefixIndexFree(struct LinenoisePrefixIndex *px)
+{
+	if (px == NULL)
+		return;
+	free(px->ids);
+	free(px->tail);
+	free(px->best);
+	free(px->queue);
+	free(px->matches);
+	free(px->hint);
+	free(px);
+}
+
+static int PrefixIndexCreate(LinenoiseState *ls)
+{
+	if (ls->history_prefixes)
+		return 0;
+	ls->history_prefixes = calloc(1, sizeof(struct LinenoisePrefixIndex));
+	if (ls->history_prefixes == NULL)
+		return -1;
+	ls->history_prefixes->dirty = true;
+	return 0;
+}
+
+/* Return true if the entry with sequence number 'a' should be suggested
+ * before the one with sequence number 'b': the newest one, or the one with
+ * the highest frecency when ranking by frecency. */
+static bool PrefixBetter(const LinenoiseState *ls, uint32_t a, uint32_t b, time_t now)
+{
+	if (ls->history_frecency)
+	{
+		uint32_t first = ls->history_prefixes->first;
+		double	 fa	   = HistoryFrecency(ls, a - first, now);
+		double	 fb	   = HistoryFrecency(ls, b - first, now);
+
+		if (fa != fb)
+			return fa > fb;
+	}
+	return a > b;
+}
+
+/* Binary heap of matches, the best one is on top. */
+static void MatchSiftDown(const LinenoiseState *ls, uint32_t *heap, uint32_t len, uint32_t j)
+{
+	time_t now = ls->history_prefixes->now;
+
+	while (true)
+	{
+		uint32_t top = j, l = 2 * j + 1, r = 2 * j + 2, aux;
+
+		if (l < len && PrefixBetter(ls, heap[l], heap[top], now))
+			top = l;
+		if (r < len && PrefixBetter(ls, heap[r], heap[top], now))
+			top = r;
+		if (top == j)
+			return;
+		aux		  = heap[j];
+		heap[j]	  = heap[top];
+		heap[top] = aux;
+		j		  = top;
+	}
+}
+
+/* Collect the entries starting with 'prefix' for a new navigation session.
+ * Only the newest of identical entries is kept, and the entries equal to the
+ * prefix itself are skipped since showing them would not change the line. */
+static int PrefixSessionStart(LinenoiseState *ls, const char *prefix, size_t plen)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	struct PrefixSpan			 sp;
+	uint32_t					 id, prev = UINT32_MAX, j, n = 0;
+
+	if (PrefixIndexUpdate(ls) == -1)
+		return -1;
+	PrefixSpanAll(ls, &sp);
+	PrefixSpanNarrow(ls, &sp, prefix, plen);
+	if (sp.hi - sp.lo + sp.thi - sp.tlo > 0)
+	{
+		uint32_t *m = realloc(px->matches, sizeof(uint32_t) * (sp.hi - sp.lo + sp.thi - sp.tlo));
+		if (m == NULL)
+			return -1;
+		px->matches = m;
+	}
+
+	/* The newest of identical entries comes last. */
+	while ((id = PrefixSpanNext(ls, &sp)) != UINT32_MAX)
+	{
+		const char *line = PrefixEntry(ls, id);
+
+		if (line[plen] == '\0')
+			continue;
+		if (prev != UINT32_MAX && strcmp(line, PrefixEntry(ls, prev)))
+			px->matches[n++] = prev;
+		prev = id;
+	}
+	if (prev != UINT32_MAX)
+		px->matches[n++] = prev;
+
+	px->nmatches = px->heaplen = n;
+	px->visited				   = 0;
+	px->now					   = time(NULL);
+	for (j = n / 2; j > 0; j--)
+		MatchSiftDown(ls, px->matches, n, j - 1);
+	return 0;
+}
+
+/* Step through the entries starting with the line typed before the browsing
+ * started. The heap is consumed lazily, heapsort style: the matches popped so
+ * far are stored at the end of the array, the newest last, so that going back
+ * is just a matter of moving in the visited part. Returns the new history
+ * index, or -1 if there is nowhere to go. */
+static int HistoryPrefixStep(LinenoiseState *ls, int dir)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	uint32_t					 id;
+
+	if (ls->history_index == 0)
+	{
+		/* An empty line matches everything, browse as usual. */
+		if (dir != LINENOISE_HISTORY_PREV)
+			return -1;
+		if (ls->len == 0)
+		{
+			px->nmatches = px->heaplen = px->visited = 0;
+			return 1;
+		}
+		if (PrefixSessionStart(ls, ls->history_scratch, ls->len) == -1)
+			return -1;
+	}
+	else if (px->nmatches == 0 && px->visited == 0)
+	{
+		/* Browsing with an empty prefix. */
+		int index = ls->history_index + ((dir == LINENOISE_HISTORY_PREV) ? 1 : -1);
+		return index > ls->history_len ? -1 : index;
+	}
+
+	if (dir == LINENOISE_HISTORY_NEXT)
+	{
+		if (px->visited == 0)
+			return -1;
+		if (--px->visited == 0)
+			return 0;
+	}
+	else if (px->visited < px->nmatches - px->heaplen)
+		px->visited++;
+	else if (px->heaplen > 0)
+	{
+		uint32_t top = px->matches[0];
+
+		px->matches[0]				 = px->matches[--px->heaplen];
+		px->matches[px->heaplen]	 = top;
+		MatchSiftDown(ls, px->matches, px->heaplen, 0);
+		px->visited++;
+	}
+	else
+		return -1;
+
+	id = px->matches[px->nmatches - px->visited];
+	return ls->history_len - (int)(id - px->first);
+}
+
+/* The suggestions need the best entry of a range of the index. A tree over
+ * its blocks of LINENOISE_PREFIX_BLOCK positions keeps, for every node, the
+ * newest id and the highest use count and last use of the entries below
+ * it. The newest entry of a range is then found from O(log n) nodes, and
+ * the most frecent one by descending first into the nodes whose counts
+ * could score best, skipping those that can't beat the best entry found so
+ * far: few nodes are visited, as the last uses mostly follow the ids. The
+ * tree is built lazily after a merge moved the ids, the few ids of
+ * the tail are looked at directly. */
+static void PrefixBestJoin(struct PrefixBest *to, const struct PrefixBest *from)
+{
+	if (from->top > to->top)
+		to->top = from->top;
+	if (from->uses > to->uses)
+		to->uses = from->uses;
+	if (from->time > to->time)
+		to->time = from->time;
+}
+
+/* Returns -1 on out of memory. */
+static int PrefixBestBuild(LinenoiseState *ls)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	uint32_t					 nb = (px->len + LINENOISE_PREFIX_BLOCK - 1) / LINENOISE_PREFIX_BLOCK, b, j;
+
+	if (px->bestvalid)
+		return 0;
+	if (2 * nb + 1 > px->bestcap)
+	{
+		struct PrefixBest *best	 = realloc(px->best, sizeof(*best) * (2 * nb + 1));
+		uint32_t *		   queue = best ? realloc(px->queue, sizeof(*queue) * (2 * nb + 1)) : NULL;
+
+		if (best)
+			px->best = best;
+		if (queue == NULL)
+			return -1;
+		px->queue	= queue;
+		px->bestcap = 2 * nb + 1;
+	}
+	px->nblocks = nb;
+	for (b = 0; b < nb; b++)
+	{
+		struct PrefixBest *leaf = &px->best[nb + b];
+
+		memset(leaf, 0, sizeof(*leaf));
+		for (j = b * LINENOISE_PREFIX_BLOCK; j < px->len && j < (b + 1) * LINENOISE_PREFIX_BLOCK; j++)
+		{
+			uint32_t		  id = px->ids[j];
+			struct PrefixBest e;
+
+			if (id < px->first)
+				continue;
+			e.top  = id + 1;
+			e.uses = ls->history_uses[id - px->first];
+			e.time = ls->history_time[id - px->first];
+			PrefixBestJoin(leaf, &e);
+		}
+	}
+	for (j = nb; j-- > 1;)
+	{
+		px->best[j] = px->best[2 * j];
+		PrefixBestJoin(&px->best[j], &px->best[2 * j + 1]);
+	}
+	px->bestvalid = true;
+	return 0;
+}
+
+/* Called after the use count and the last use of the newest entry grew.
+ * Unless it is still in the tail, raise them along its path in the tree. */
+static void PrefixIndexUsed(LinenoiseState *ls)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	uint32_t					 id, pos, q;
+
+	if (px->dirty || !px->bestvalid || px->taillen || px->next == px->first)
+		return;
+	id	= px->next - 1;
+	pos = PrefixLowerBound(ls, px->ids, 0, px->len, PrefixEntry(ls, id), id);
+	if (pos == px->len || px->ids[pos] != id)
+		return;
+	for (q = px->nblocks + pos / LINENOISE_PREFIX_BLOCK; q; q /= 2)
+	{
+		struct PrefixBest e = {id + 1, ls->history_uses[id - px->first], ls->history_time[id - px->first]};
+
+		PrefixBestJoin(&px->best[q], &e);
+	}
+}
+
+/* Make 'cand' the suggestion '*id' if it is better. UINT32_MAX and the
+ * evicted ids are none. */
+static void PrefixOffer(const LinenoiseState *ls, uint32_t cand, uint32_t *id, time_t now)
+{
+	if (cand != UINT32_MAX && cand >= ls->history_prefixes->first &&
+		(*id == UINT32_MAX || PrefixBetter(ls, cand, *id, now)))
+		*id = cand;
+}
+
+/* Return true if the entries below node 'a' may score better than the ones
+ * below 'b', or than the entry 'id' if 'b' is 0. */
+static bool PrefixNodeBetter(const LinenoiseState *ls, uint32_t a, uint32_t b, uint32_t id, time_t now)
+{
+	const struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	double fa = HistoryFrecencyAt(px->best[a].uses, px->best[a].time, now), fb;
+	uint32_t topb;
+
+	if (b)
+	{
+		fb	 = HistoryFrecencyAt(px->best[b].uses, px->best[b].time, now);
+		topb = px->best[b].top;
+	}
+	else
+	{
+		fb	 = HistoryFrecency(ls, id - px->first, now);
+		topb = id + 1;
+	}
+	if (fa != fb)
+		return fa > fb;
+	return px->best[a].top > topb;
+}
+
+static void PrefixQueueSiftDown(const LinenoiseState *ls, uint32_t *heap, uint32_t len, uint32_t j, time_t now)
+{
+	while (true)
+	{
+		uint32_t top = j, l = 2 * j + 1, r = 2 * j + 2, aux;
+
+		if (l < len && PrefixNodeBetter(ls, heap[l], heap[top], 0, now))
+			top = l;
+		if (r < len && PrefixNodeBetter(ls, heap[r], heap[top], 0, now))
+			top = r;
+		if (top == j)
+			return;
+		aux		  = heap[j];
+		heap[j]	  = heap[top];
+		heap[top] = aux;
+		j		  = top;
+	}
+}
+
+static void PrefixQueuePush(const LinenoiseState *ls, uint32_t *heap, uint32_t *len, uint32_t q, time_t now)
+{
+	uint32_t j;
+
+	if (ls->history_prefixes->best[q].top <= ls->history_prefixes->first)
+		return;
+	for (j = (*len)++; j > 0 && PrefixNodeBetter(ls, q, heap[(j - 1) / 2], 0, now); j = (j - 1) / 2)
+		heap[j] = heap[(j - 1) / 2];
+	heap[j] = q;
+}
+
+/* Return the best entry at the positions [lo, hi) of the index, or
+ * UINT32_MAX if there is none. The whole blocks are covered by O(log n)
+ * nodes of the tree, the rest is looked at directly. */
+static uint32_t PrefixBestOf(const LinenoiseState *ls, uint32_t lo, uint32_t hi, time_t now)
+{
+	const struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	const uint32_t					   B  = LINENOISE_PREFIX_BLOCK, nb = px->nblocks;
+	uint32_t						   bl = (lo + B - 1) / B, br = hi / B, id = UINT32_MAX, n = 0, l, r, j;
+
+	if (bl >= br)
+	{
+		for (j = lo; j < hi; j++)
+			PrefixOffer(ls, px->ids[j], &id, now);
+		return id;
+	}
+	for (j = lo; j < bl * B; j++)
+		PrefixOffer(ls, px->ids[j], &id, now);
+	for (j = br * B; j < hi; j++)
+		PrefixOffer(ls, px->ids[j], &id, now);
+
+	if (!ls->history_frecency)
+	{
+		for (l = bl + nb, r = br + nb; l < r; l /= 2, r /= 2)
+		{
+			if (l & 1)
+				PrefixOffer(ls, px->best[l++].top - 1, &id, now);
+			if (r & 1)
+				PrefixOffer(ls, px->best[--r].top - 1, &id, now);
+		}
+		return id;
+	}
+
+	for (l = bl + nb, r = br + nb; l < r; l /= 2, r /= 2)
+	{
+		if (l & 1)
+			PrefixQueuePush(ls, px->queue, &n, l++, now);
+		if (r & 1)
+			PrefixQueuePush(ls, px->queue, &n, --r, now);
+	}
+	while (n)
+	{
+		uint32_t q = px->queue[0];
+
+		if (id != UINT32_MAX && !PrefixNodeBetter(ls, q, 0, id, now))
+			break;
+		px->queue[0] = px->queue[--n];
+		PrefixQueueSiftDown(ls, px->queue, n, 0, now);
+		if (q >= nb)
+		{
+			for (j = (q - nb) * B; j < (q - nb + 1) * B && j < px->len; j++)
+				PrefixOffer(ls, px->ids[j], &id, now);
+		}
+		else
+		{
+			PrefixQueuePush(ls, px->queue, &n, 2 * q, now);
+			PrefixQueuePush(ls, px->queue, &n, 2 * q + 1, now);
+		}
+	}
+	return id;
+}
+
+/* Return the newest (or most frecent) history entry that starts with the
+ * edited line and is longer than it, or NULL if there is none.
+ *
+ * This runs at every refresh. The entries starting with the line are found
+ * with binary searches, inside the ones of the previous call when the line
+ * just grew, which is what happens while typing. The previous suggestion is
+ * still the best one if it still matches, otherwise the tree finds the best
+ * of the index in O(log n), and the tail is looked at directly. */
+static const char *HistorySuggest(LinenoiseState *ls)
+{
+	struct LinenoisePrefixIndex *px = ls->history_prefixes;
+	struct PrefixSpan			 sp;
+	uint32_t					 id = UINT32_MAX, l, h, j;
+
+	if (px == NULL || ls->len == 0 || PrefixIndexUpdate(ls) == -1 || PrefixBestBuild(ls) == -1)
+		return NULL;
+	PrefixSpanAll(ls, &sp);
+
+	if (px->hintvalid && px->hintlen <= ls->len && !memcmp(px->hint, ls->buf, px->hintlen))
+	{
+		if (px->hintlen == ls->len)
+			return px->hintid == UINT32_MAX ? NULL : PrefixEntry(ls, px->hintid);
+		sp = px->hintspan;
+		id = px->hintid;
+	}
+	PrefixSpanNarrow(ls, &sp, ls->buf, ls->len);
+
+	if (id != UINT32_MAX)
+	{
+		const char *line = PrefixEntry(ls, id);
+		if (strncmp(line, ls->buf, ls->len) || line[ls->len] == '\0')
+			id = UINT32_MAX;
+	}
+	if (id == UINT32_MAX)
+	{
+		time_t now = time(NULL);
+
+		/* The entries equal to the line come first, skip them. */
+		for (l = sp.lo, h = sp.hi; l < h;)
+		{
+			uint32_t mid = l + (h - l) / 2, live = PrefixLive(ls, px->ids, mid, h);
+
+			if (live < h && PrefixEntry(ls, px->ids[live])[ls->len] == '\0')
+				l = live + 1;
+			else
+				h = mid;
+		}
+		id = PrefixBestOf(ls, l, sp.hi, now);
+		for (j = sp.tlo; j < sp.thi; j++)
+			if (px->tail[j] >= px->first && PrefixEntry(ls, px->tail[j])[ls->len] != '\0')
+				PrefixOffer(ls, px->tail[j], &id, now);
+	}
+
+	/* Remember the lookup for the next keystroke. */
+	px->hintvalid = false;
+	if (ls->len + 1 > px->hintcap)
+	{
+		char *hint = realloc(px->hint, ls->buflen + 1);
+		if (hint == NULL)
+			return id == UINT32_MAX ? NULL : PrefixEntry(ls, id);
+		px->hint	= hint;
+		px->hintcap = ls->buflen + 1;
+	}
+	memcpy(px->hint, ls->buf, ls->len);
+	px->hintlen	  = ls->len;
+	px->hintspan  = sp;
+	px->hintid	  = id;
+	px->hintvalid = true;
+	return id == UINT32_MAX ? NULL : PrefixEntry(ls, id);
+}
+
+/* Replace the edited line with the current suggestion, if any. Returns 1
+ * if a suggestion was accepted. */
+static int HistoryAcceptSuggestion(LinenoiseState *ls)
+{
+	const char *line;
+
+	if (!ls->history_autosuggest || l_HintsCallback || (line = HistorySuggest(ls)) == NULL)
+		return 0;
+
+	strncpy(ls->buf, line, ls->buflen);
+	ls->buf[ls->buflen - 1] = '\0';
+	ls->len = ls->pos = strlen(ls->buf);
+	RefreshLine(ls);
+	return 1;
+}
+
+/* The prefix index is shared by the prefix navigation and by the
+ * autosuggestions, free it once none of them needs it anymore. */
+static void PrefixIndexRelease(LinenoiseState *ls)
+{
+	if (ls->history_prefix_search || ls->history_autosuggest || ls->history_frecency)
+		return;
+	PrefixIndexFree(ls->history_prefixes);
+	ls->history_prefixes = NULL;
+}
+
+/* Enable or disable the prefix filtered history navigation: when enabled the
+ * up and down keys only step through the entries starting with the text typed
+ * before the browsing started. Returns 1 on success, 0 on out of memory. */
+int LinenoiseHistorySetPrefixSearch(LinenoiseState *ls, int enable)
+{
+	if (enable && PrefixIndexCreate(ls) == -1)
+		return 0;
+	ls->history_prefix_search = enable;
+	PrefixIndexRelease(ls);
+	return 1;
+}
+
+/* Enable or disable fish style autosuggestions: the newest history entry
+ * starting with the edited line is shown in grey after it, and the right
+ * arrow or the end key at the end of the line accept it. A registered hints
+ * callback takes precedence. Returns 1 on success, 0 on out of memory. */
+int LinenoiseHistorySetAutosuggest(LinenoiseState *ls, int enable)
+{
+	if (enable && PrefixIndexCreate(ls) == -1)
+		return 0;
+	ls->history_autosuggest = enable;
+	PrefixIndexRelease(ls);
+	return 1;
+}
+
+/* ============================= History ranking ============================ */
+
+/* Every entry carries the number of times it was used and when it was last
+ * used. Frecency combines the two the way z and the Firefox URL bar do: the
+ * use count is weighted by how recent the last use is. It is only computed
+ * when ranking, so that updating an entry is just a counter increment. */
+static double HistoryFrecencyAt(uint32_t count, uint32_t when, time_t now)
+{
+	double age	= difftime(now, (time_t)when);
+	double uses = count;
+
+	if (age < 3600)
+		return uses * 4;
+	if (age < 86400)
+		return uses * 2;
+	if (age < 604800)
+		return uses / 2;
+	return uses / 4;
+}
+
+static double HistoryFrecency(const LinenoiseState *ls, int j, time_t now)
+{
+	return HistoryFrecencyAt(ls->history_uses[j], ls->history_time[j], now);
+}
+
+/* The use count of a line added again is carried over from the newest
+ * entry equal to it. An open addressing table finds that entry in constant
+ * time whatever the other indexes: every distinct line has a slot with the
+ * sequence number of its newest entry, freed when that entry is evicted.
+ * Like the indexes, it is rebuilt lazily after the history changed at
+ * once. */
+struct LinenoiseHistorySeen
+{
+	uint32_t  first; /* Sequence number of history[0]. */
+	uint32_t  next;	 /* Sequence number of the next entry. */
+	uint64_t *slots; /* Low half of the hash, then sequence number + 1. 0 if free. */
+	uint32_t  cap;	 /* Slots, a power of two. */
+	uint32_t  used;	 /* Slots taken. */
+	bool	  dirty; /* Must be rebuilt before use. */
+};
+
+/* Return the slot of 'line', whose hash is 'hash', or the free slot it
+ * would take. */
+static uint32_t SeenSlot(const LinenoiseState *ls, const char *line, uint32_t hash)
+{
+	const struct LinenoiseHistorySeen *s = ls->history_seen;
+	uint32_t						   j;
+
+	for (j = hash & (s->cap - 1); s->slots[j]; j = (j + 1) & (s->cap - 1))
+		if ((uint32_t)(s->slots[j] >> 32) == hash &&
+			!strcmp(ls->history[(uint32_t)s->slots[j] - 1 - s->first], line))
+			break;
+	return j;
+}
+
+/* Make the newest entry, with sequence number 'id', the one of its line. */
+static int SeenAdd(LinenoiseState *ls, const char *line, uint32_t id)
+{
+	struct LinenoiseHistorySeen *s	  = ls->history_seen;
+	uint32_t					 hash = (uint32_t)HashBytes(line, strlen(line)), j;
+
+	if (s->used * 2 >= s->cap)
+	{
+		uint32_t  cap	= s->cap ? s->cap * 2 : 64, k;
+		uint64_t *slots = calloc(cap, sizeof(*slots));
+
+		if (slots == NULL)
+			return -1;
+		for (k = 0; k < s->cap; k++)
+		{
+			if (!s->slots[k])
+				continue;
+			for (j = (uint32_t)(s->slots[k] >> 32) & (cap - 1); slots[j]; j = (j + 1) & (cap - 1))
+				;
+			slots[j] = s->slots[k];
+		}
+		free(s->slots);
+		s->slots = slots;
+		s->cap	 = cap;
+	}
+	j = SeenSlot(ls, line, hash);
+	s->used += !s->slots[j];
+	s->slots[j] = (uint64_t)hash << 32 | (id + 1);
+	return 0;
+}
+
+/* Make sure the table is up to date. Returns -1 if it could not be
+ * rebuilt. */
+static int SeenUpdate(LinenoiseState *ls)
+{
+	struct LinenoiseHistorySeen *s = ls->history_seen;
+	int							 j;
+
+	if (!s->dirty)
+		return 0;
+	if (s->cap)
+		memset(s->slots, 0, sizeof(*s->slots) * s->cap);
+	s->used	 = 0;
+	s->first = 0;
+	s->next	 = ls->history_len;
+	for (j = 0; j < ls->history_len; j++)
+		if (SeenAdd(ls, ls->history[j], j) == -1)
+			return -1;
+	s->dirty = false;
+	return 0;
+}
+
+/* Called after 'line' was added on top of the history. */
+static void SeenIndexAdd(LinenoiseState *ls, const char *line)
+{
+	struct LinenoiseHistorySeen *s = ls->history_seen;
+
+	if (s == NULL)
+	{
+		if ((s = ls->history_seen = calloc(1, sizeof(*s))) != NULL)
+			s->dirty = true;
+		return;
+	}
+	if (s->dirty)
+		return;
+	if (s->next == UINT32_MAX || SeenAdd(ls, line, s->next++) == -1)
+		s->dirty = true;
+}
+
+/* Called before the oldest 'n' entries are removed from the history: free
+ * the slots still pointing to them, moving back the slots that follow in
+ * the same cluster to keep the lookups short of tombstones. */
+static void SeenIndexEvict(LinenoiseState *ls, int n)
+{
+	struct LinenoiseHistorySeen *s = ls->history_seen;
+	int							 e;
+
+	if (s == NULL || s->dirty)
+		return;
+	for (e = 0; e < n; e++)
+	{
+		const char *line = ls->history[e];
+		uint32_t	hash = (uint32_t)HashBytes(line, strlen(line)), j = SeenSlot(ls, line, hash), k;
+
+		if ((uint32_t)s->slots[j] - 1 != s->first + e)
+			continue;
+		for (k = (j + 1) & (s->cap - 1); s->slots[k]; k = (k + 1) & (s->cap - 1))
+		{
+			uint32_t home = (uint32_t)(s->slots[k] >> 32) & (s->cap - 1);
+
+			/* Move it back unless its home is in (j, k]. */
+			if (j <= k ? (j < home && home <= k) : (j < home || home <= k))
+				continue;
+			s->slots[j] = s->slots[k];
+			j			= k;
+		}
+		s->slots[j] = 0;
+		s->used--;
+	}
+	s->first += n;
+}
+
+static void SeenIndexFree(struct LinenoiseHistorySeen *s)
+{
+	if (s == NULL)
+		return;
+	free(s->slots);
+	free(s);
+}
+
+/* Return the use count of the newest entry equal to 'line', so that a
+ * command used again keeps its count when it is added on top of the
+ * history. */
+static uint32_t HistoryPreviousUses(LinenoiseState *ls, const char *line)
+{
+	struct LinenoiseHistorySeen *s = ls->history_seen;
+	uint32_t					 j;
+
+	if (s == NULL || SeenUpdate(ls) == -1 || s->cap == 0)
+		return 0;
+	j = SeenSlot(ls, line, (uint32_t)HashBytes(line, strlen(line)));
+	return s->slots[j] ? ls->history_uses[(uint32_t)s->slots[j] - 1 - s->first] : 0;
+}
+
+/* Order of the ranking: by frecency, then newest first. */
+static bool RankBetter(const LinenoiseState *ls, int a, int b, time_t now)
+{
+	double fa = HistoryFrecency(ls, a, now);
+	double fb = HistoryFrecency(ls, b, now);
+
+	if (fa != fb)
+		return fa > fb;
+	return a > b;
+}
+
+/* Min heap of the best candidates found so far, the worst one on top. */
+static void RankSiftDown(const LinenoiseState *ls, int *heap, int len, int j, time_t now)
+{
+	while (true)
+	{
+		int top = j, l = 2 * j + 1, r = 2 * j + 2, aux;
+
+		if (l < len && RankBetter(ls, heap[top], heap[l], now))
+			top = l;
+		if (r < len && RankBetter(ls, heap[top], heap[r], now))
+			top = r;
+		if (top == j)
+			return;
+		aux		  = heap[j];
+		heap[j]	  = heap[top];
+		heap[top] = aux;
+		j		  = top;
+	}
+}
+
+static void RankOffer(const LinenoiseState *ls, int *heap, int *len, int k, int cand, time_t now)
+{
+	int j;
+
+	/* Identical entries are ranked once, with the best of their scores.
+	 * A duplicate that is not in the heap can't be better than the entries
+	 * that are: the heap only gets better. */
+	for (j = 0; j < *len; j++)
+	{
+		if (!strcmp(ls->history[heap[j]], ls->history[cand]))
+		{
+			if (RankBetter(ls, cand, heap[j], now))
+			{
+				heap[j] = cand;
+				for (j = *len / 2; j > 0; j--)
+					RankSiftDown(ls, heap, *len, j - 1, now);
+			}
+			return;
+		}
+	}
+
+	if (*len < k)
+	{
+		heap[(*len)++] = cand;
+		for (j = *len - 1; j > 0 && RankBetter(ls, heap[(j - 1) / 2], heap[j], now); j = (j - 1) / 2)
+		{
+			int aux			  = heap[j];
+			heap[j]			  = heap[(j - 1) / 2];
+			heap[(j - 1) / 2] = aux;
+		}
+	}
+	else if (RankBetter(ls, cand, heap[0], now))
+	{
+		heap[0] = cand;
+		RankSiftDown(ls, heap, *len, 0, now);
+	}
+}
+
+/* Store in 'top' the history indexes of the 'k' distinct entries starting
+ * with 'prefix' (NULL for any entry) with the highest frecency, the best
+ * first. Returns the number of indexes stored.
+ *
+ * Only a partial selection is done: a heap of the best 'k' entries is kept
+ * while scanning the candidates, and only these are sorted at the end. The
+ * candidates come from the sorted index when there is one. */
+int LinenoiseHistoryTopFrecent(LinenoiseState *ls, const char *prefix, int *top, int k)
+{
+	struct LinenoisePrefixIndex *px		 = ls->history_prefixes;
+	size_t						 plen	 = prefix ? strlen(prefix) : 0;
+	bool						 indexed = plen && px && PrefixIndexUpdate(ls) == 0;
+	time_t						 now	 = time(NULL);
+	struct PrefixSpan			 sp;
+	uint32_t					 j, id;
+	int							 n = 0;
+
+	if (k <= 0)
+		return 0;
+	if (indexed)
+	{
+		PrefixSpanAll(ls, &sp);
+		PrefixSpanNarrow(ls, &sp, prefix, plen);
+		while ((id = PrefixSpanNext(ls, &sp)) != UINT32_MAX)
+			RankOffer(ls, top, &n, k, (int)(id - px->first), now);
+	}
+	else
+	{
+		for (j = 0; j < (uint32_t)ls->history_len; j++)
+			if (!plen || !strncmp(ls->history[j], prefix, plen))
+				RankOffer(ls, top, &n, k, (int)j, now);
+	}
+
+	/* Heap sort: popping the worst to the end leaves the best first. */
+	for (j = n; j > 1; j--)
+	{
+		int aux	   = top[0];
+		top[0]	   = top[j - 1];
+		top[j - 1] = aux;
+		RankSiftDown(ls, top, j - 1, 0, now);
+	}
+	return n;
+}
+
+/* Rank the prefix navigation and the autosuggestions by frecency instead of
+ * showing the newest entries first. Returns 1 on success, 0 on out of
+ * memory. */
+int LinenoiseHistorySetFrecency(LinenoiseState *ls, int enable)
+{
+	if (enable && PrefixIndexCreate(ls) == -1)
+		return 0;
+	ls->history_frecency = enable;
+	if (ls->history_prefixes)
+		ls->history_prefixes->hintvalid = false;
+	PrefixIndexRelease(ls);
+	return 1;
+}
+
+/* Keep the indexes in sync with the history: called after an entry was added
+ * on top of the history, before the oldest 'n' entries are evicted, and when
+ * an entry was edited in place. */
+static void HistoryIndexAdd(LinenoiseState *ls, const char *line)
+{
+	SeenIndexAdd(ls, line);
+	if (ls->history_trigrams)
+	{
+		TrigramIndexAdd(ls->history_trigrams, line);
+		if (ls->history_trigrams->next == UINT32_MAX)
+			TrigramIndexRebuild(ls);
+	}
+	if (ls->history_prefixes)
+	{
+		PrefixIndexAdd(ls, line);
+		ls->history_prefixes->hintvalid = false;
+	}
+}
+
+static void HistoryIndexEvict(LinenoiseState *ls, int n)
+{
+	SeenIndexEvict(ls, n);
+	if (ls->history_trigrams)
+		ls->history_trigrams->first += n;
+	if (ls->history_prefixes)
+	{
+		PrefixIndexEvict(ls, n);
+		ls->history_prefixes->hintvalid = false;
+	}
+}
+
+/* Called after the use count and the last use of the newest entry grew. */
+static void HistoryIndexUsed(LinenoiseState *ls)
+{
+	if (ls->history_prefixes)
+	{
+		PrefixIndexUsed(ls);
+		ls->history_prefixes->hintvalid = false;
+	}
+}
+
+static void HistoryIndexChanged(LinenoiseState *ls)
+{
+	if (ls->history_seen)
+		ls->history_seen->dirty = true;
+	if (ls->history_prefixes)
+		ls->history_prefixes->dirty = true;
+}
+
+/* Called when entries were moved around in the history. */
+static void HistoryIndexRebuild(LinenoiseState *ls)
+{
+	if (ls->history_trigrams)
+		TrigramIndexRebuild(ls);
+	HistoryIndexChanged(ls);
+}
+
+/* ========================== Fuzzy history finder ========================== */
+
+/* Ctrl+r opens an fzf style finder: the typed query is matched as a
+ * subsequence of the history entries, ignoring case, and the best matches
+ * are listed under the prompt.
+ *
+ * Scoring a very large history has to be fast enough to keep up with the
+ * typing, so it is done in three steps. First every entry has a bitmask of
+ * the characters it contains, computed once when the finder is opened: an
+ * entry whose mask lacks a character of the query can't match. Then the
+ * subsequence is searched with memchr(), which the C library vectorizes.
+ * Only the entries surviving both are scored with a dynamic programming
+ * alignment that rewards consecutive characters and word starts and
+ * penalizes gaps. Large histories are split among a few threads, each one
+ * keeping a small heap of its best matches, and the heaps are merged at the
+ * end. The threads are started when the finder opens and wait for the
+ * search of every keystroke on a condition variable. */
+#define LINENOISE_FUZZY_ROWS 10			/* Matches listed under the prompt. */
+#define LINENOISE_FUZZY_MAX_THREADS 8	/* Threads scoring the history. */
+#define LINENOISE_FUZZY_PER_THREAD 32768 /* Entries each thread should have at least. */
+
+#define FUZZY_SCORE_MATCH 16
+#define FUZZY_BONUS_BOUNDARY 8
+#define FUZZY_BONUS_CONSECUTIVE 8
+#define FUZZY_PENALTY_GAP_START 3
+#define FUZZY_PENALTY_GAP_EXTENSION 1
+#define FUZZY_NONE (INT_MIN / 2)
+
+struct FuzzyMatch
+{
+	int index; /* History index of the entry. */
+	int score; /* Score of the alignment of the query. */
+};
+
+struct FuzzyJob
+{
+	const LinenoiseState *ls;
+	const char *		  query;						/* Lowercase query. */
+	size_t				  qlen;							/* Query length. */
+	uint64_t			  qmask;						/* Characters of the query. */
+	uint64_t *			  masks;						/* Characters of every history entry. */
+	bool				  needmasks;					/* The masks must be computed first. */
+	int					  from;							/* First history index to score. */
+	int					  to;							/* Last history index to score, excluded. */
+	int *				  rows;							/* Dynamic programming rows. */
+	size_t				  rowslen;						/* Allocated length of each row. */
+	struct FuzzyMatch	  top[LINENOISE_FUZZY_ROWS];	/* Best matches, the worst on top. */
+	int					  ntop;							/* Number of matches in 'top'. */
+	struct FuzzyPool *	  pool;							/* Pool of the worker scoring it. */
+};
+
+/* The threads of an open finder. Job 0 is scored by the calling thread. */
+struct FuzzyPool
+{
+	pthread_mutex_t lock;
+	pthread_cond_t	wake;		/* A search was posted, or the pool stops. */
+	pthread_cond_t	done;		/* The last worker finished its job. */
+	pthread_t		threads[LINENOISE_FUZZY_MAX_THREADS];
+	struct FuzzyJob jobs[LINENOISE_FUZZY_MAX_THREADS];
+	int				nthreads;	/* Jobs of every search, the calling thread included. */
+	uint64_t		generation; /* Incremented for every search. */
+	int				pending;	/* Workers still scoring the current search. */
+	bool			stop;
+};
+
+/* Lookup tables of the lowercase version of every byte and of its bit in
+ * the character masks, filled before the first search. */
+static unsigned char fuzzy_lower[256];
+static uint64_t		 fuzzy_bit[256];
+
+static void FuzzyInitTables(void)
+{
+	int c;
+
+	for (c = 0; c < 256; c++)
+	{
+		int l = tolower(c);
+
+		fuzzy_lower[c] = l;
+		if (l >= 'a' && l <= 'z')
+			fuzzy_bit[c] = (uint64_t)1 << (l - 'a');
+		else if (l >= '0' && l <= '9')
+			fuzzy_bit[c] = (uint64_t)1 << (26 + l - '0');
+		else
+			fuzzy_bit[c] = (uint64_t)1 << (36 + l % 28);
+	}
+}
+
+static uint64_t FuzzyMask(const char *s, size_t len)
+{
+	const unsigned char *p	  = (const unsigned char *)s;
+	uint64_t			 mask = 0;
+	size_t				 j;
+
+	for (j = 0; j < len; j++)
+		mask |= fuzzy_bit[p[j]];
+	return mask;
+}
+
+/* Return the first occurrence of 'c' in the 'len' bytes at 's', ignoring
+ * case, or NULL. */
+static const char *FuzzyFind(const char *s, size_t len, char c)
+{
+	const char *lower = memchr(s, c, len);
+	const char *upper;
+
+	if (toupper((unsigned char)c) == c)
+		return lower;
+	upper = memchr(s, toupper((unsigned char)c), lower ? (size_t)(lower - s) : len);
+	return upper ? upper : lower;
+}
+
+/* Check that the query is a subsequence of the entry. Returns the position
+ * of the earliest possible start of the match, or -1. */
+static long FuzzyPrefilter(const struct FuzzyJob *job, const char *s, size_t len)
+{
+	const char *p = s, *start = NULL;
+	size_t		i;
+
+	for (i = 0; i < job->qlen; i++)
+	{
+		p = FuzzyFind(p, len - (p - s), job->query[i]);
+		if (p == NULL)
+			return -1;
+		if (start == NULL)
+			start = p;
+		p++;
+	}
+	return start ? start - s : 0;
+}
+
+static bool FuzzyBoundary(const char *s, size_t j)
+{
+	return j == 0 || !isalnum((unsigned char)s[j - 1]);
+}
+
+/* Best alignment of the query in the entry: 'cur[j]' is the best score with
+ * the current query character matched at position 'j', and 'gap' carries the
+ * best previous row score that can reach 'j' through a gap. */
+static int FuzzyScore(struct FuzzyJob *job, const char *s, size_t start, size_t len)
+{
+	int *  prev, *cur, *aux;
+	int	   best = FUZZY_NONE;
+	size_t i, j;
+
+	if (job->qlen == 0)
+		return 0;
+	if (len > job->rowslen)
+	{
+		int *rows = realloc(job->rows, sizeof(int) * 2 * len);
+		if (rows == NULL)
+			return FUZZY_NONE;
+		job->rows	 = rows;
+		job->rowslen = len;
+	}
+	prev = job->rows;
+	cur	 = job->rows + job->rowslen;
+
+	for (i = 0; i < job->qlen; i++)
+	{
+		int gap = FUZZY_NONE;
+
+		for (j = start; j < len; j++)
+		{
+			int score = FUZZY_NONE;
+
+			if (fuzzy_lower[(unsigned char)s[j]] == (unsigned char)job->query[i])
+			{
+				int bonus = FUZZY_SCORE_MATCH + (FuzzyBoundary(s, j) ? FUZZY_BONUS_BOUNDARY : 0);
+
+				if (i == 0)
+					score = bonus;
+				else
+				{
+					int from = gap;
+					if (j > start && prev[j - 1] != FUZZY_NONE && prev[j - 1] + FUZZY_BONUS_CONSECUTIVE > from)
+						from = prev[j - 1] + FUZZY_BONUS_CONSECUTIVE;
+					if (from != FUZZY_NONE)
+						score = from + bonus;
+				}
+			}
+			cur[j] = score;
+
+			/* Extend the gap by one, or open it after the previous row. */
+			if (gap != FUZZY_NONE)
+				gap -= FUZZY_PENALTY_GAP_EXTENSION;
+			if (j > start && prev[j - 1] != FUZZY_NONE && prev[j - 1] - FUZZY_PENALTY_GAP_START > gap)
+				gap = prev[j - 1] - FUZZY_PENALTY_GAP_START;
+		}
+
+		aux	 = prev;
+		prev = cur;
+		cur	 = aux;
+	}
+
+	for (j = start; j < len; j++)
+	{
+		if (prev[j] > best)
+			best = prev[j];
+	}
+	return best;
+}
+
+/* Matches are ordered by score, then newest first. */
+static bool FuzzyBetter(const struct FuzzyMatch *a, const struct FuzzyMatch *b)
+{
+	if (a->score != b->score)
+		return a->score > b->score;
+	return a->index > b->index;
+}
+
+static void FuzzySiftDown(struct FuzzyMatch *heap, int len, int j)
+{
+	while (true)
+	{
+		int				  top = j, l = 2 * j + 1, r = 2 * j + 2;
+		struct FuzzyMatch aux;
+
+		if (l < len && FuzzyBetter(&heap[top], &heap[l]))
+			top = l;
+		if (r < len && FuzzyBetter(&heap[top], &heap[r]))
+			top = r;
+		if (top == j)
+			return;
+		aux		  = heap[j];
+		heap[j]	  = heap[top];
+		heap[top] = aux;
+		j		  = top;
+	}
+}
+
+/* Offer a match to a heap of the best LINENOISE_FUZZY_ROWS matches, keeping
+ * only the best of identical entries. */
+static void FuzzyOffer(const LinenoiseState *ls, struct FuzzyMatch *heap, int *len, struct FuzzyMatch m)
+{
+	int j;
+
+	/* Most matches are not good enough: if an identical entry is in the heap
+	 * it is better than them too. */
+	if (*len == LINENOISE_FUZZY_ROWS && !FuzzyBetter(&m, &heap[0]))
+		return;
+
+	for (j = 0; j < *len; j++)
+	{
+		if (!strcmp(ls->history[heap[j].index], ls->history[m.index]))
+		{
+			if (FuzzyBetter(&m, &heap[j]))
+			{
+				heap[j] = m;
+				for (j = *len / 2; j > 0; j--)
+					FuzzySiftDown(heap, *len, j - 1);
+			}
+			return;
+		}
+	}
+
+	if (*len < LINENOISE_FUZZY_ROWS)
+	{
+		heap[(*len)++] = m;
+		for (j = *len / 2; j > 0; j--)
+			FuzzySiftDown(heap, *len, j - 1);
+	}
+	else if (FuzzyBetter(&m, &heap[0]))
+	{
+		heap[0] = m;
+		FuzzySiftDown(heap, *len, 0);
+	}
+}
+
+/* Score a share of the history, from the newest entry: on ties the newest
+ * entries win, so once the heap is full of matches as good as the query can
+ * possibly get the older entries can't enter it anymore. */
+static void *FuzzyWork(void *arg)
+{
+	struct FuzzyJob *job = arg;
+	int				 best, j;
+
+	best = (int)job->qlen * (FUZZY_SCORE_MATCH + FUZZY_BONUS_BOUNDARY);
+	if (job->qlen > 1)
+		best += (int)(job->qlen - 1) * FUZZY_BONUS_CONSECUTIVE;
+
+	for (j = job->to - 1; j >= job->from; j--)
+	{
+		const char *	  s = job->ls->history[j];
+		struct FuzzyMatch m;
+		size_t			  len;
+		long			  start;
+
+		if (job->needmasks)
+			job->masks[j] = FuzzyMask(s, strlen(s));
+		if (job->ntop == LINENOISE_FUZZY_ROWS && job->top[0].score >= best)
+		{
+			if (job->needmasks)
+				continue;
+			break;
+		}
+		if (job->qmask & ~job->masks[j])
+			continue;
+		len = strlen(s);
+		if ((start = FuzzyPrefilter(job, s, len)) == -1)
+			continue;
+
+		m.index = j;
+		m.score = FuzzyScore(job, s, start, len);
+		if (m.score != FUZZY_NONE)
+			FuzzyOffer(job->ls, job->top, &job->ntop, m);
+	}
+	return NULL;
+}
+
+/* Score the job of every search posted to the pool until it stops. */
+static void *FuzzyWorker(void *arg)
+{
+	struct FuzzyJob * job  = arg;
+	struct FuzzyPool *pool = job->pool;
+	uint64_t		  seen = 0;
+
+	pthread_mutex_lock(&pool->lock);
+	while (true)
+	{
+		while (!pool->stop && pool->generation == seen)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stop)
+			break;
+		seen = pool->generation;
+		pthread_mutex_unlock(&pool->lock);
+
+		FuzzyWork(job);
+
+		pthread_mutex_lock(&pool->lock);
+		if (--pool->pending == 0)
+			pthread_cond_signal(&pool->done);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+/* Start the threads scoring a history of 'len' entries. When some can't be
+ * started the others take their share. */
+static void FuzzyPoolStart(struct FuzzyPool *pool, int len)
+{
+	long ncpu	  = sysconf(_SC_NPROCESSORS_ONLN);
+	int	 nthreads = len / LINENOISE_FUZZY_PER_THREAD;
+
+	if (nthreads > ncpu)
+		nthreads = ncpu;
+	if (nthreads > LINENOISE_FUZZY_MAX_THREADS)
+		nthreads = LINENOISE_FUZZY_MAX_THREADS;
+
+	memset(pool, 0, sizeof(*pool));
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->wake, NULL);
+	pthread_cond_init(&pool->done, NULL);
+	for (pool->nthreads = 1; pool->nthreads < nthreads; pool->nthreads++)
+	{
+		pool->jobs[pool->nthreads].pool = pool;
+		if (pthread_create(&pool->threads[pool->nthreads], NULL, FuzzyWorker, &pool->jobs[pool->nthreads]) != 0)
+			break;
+	}
+}
+
+static void FuzzyPoolStop(struct FuzzyPool *pool)
+{
+	int t;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = true;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (t = 0; t < pool->nthreads; t++)
+	{
+		if (t > 0)
+			pthread_join(pool->threads[t], NULL);
+		free(pool->jobs[t].rows);
+	}
+	pthread_mutex_destroy(&pool->lock);
+	pthread_cond_destroy(&pool->wake);
+	pthread_cond_destroy(&pool->done);
+}
+
+/* Score the whole history against 'query' with the threads of 'pool',
+ * storing the best matches in 'out', the best first. Returns the number of
+ * matches. 'masks' must have room for every entry, 'needmasks' tells if
+ * they must be computed. */
+static int FuzzySearch(struct FuzzyPool *pool, const LinenoiseState *ls, const char *query, uint64_t *masks, bool needmasks,
+					   struct FuzzyMatch *out)
+{
+	char   lower[LINENOISE_MAX_LINE];
+	int	   nthreads = pool->nthreads;
+	int	   n		= 0, j, t;
+	size_t qlen		= strlen(query), i;
+
+	if (qlen >= sizeof(lower))
+		qlen = sizeof(lower) - 1;
+	if (fuzzy_bit[0] == 0)
+		FuzzyInitTables();
+	for (i = 0; i < qlen; i++)
+		lower[i] = fuzzy_lower[(unsigned char)query[i]];
+	lower[qlen] = '\0';
+
+	/* The rows are kept from a search to the next. */
+	for (t = 0; t < nthreads; t++)
+	{
+		struct FuzzyJob *job = &pool->jobs[t];
+
+		job->ls		   = ls;
+		job->query	   = lower;
+		job->qlen	   = qlen;
+		job->qmask	   = FuzzyMask(lower, qlen);
+		job->masks	   = masks;
+		job->needmasks = needmasks;
+		job->from	   = (int)((long long)ls->history_len * t / nthreads);
+		job->to		   = (int)((long long)ls->history_len * (t + 1) / nthreads);
+		job->ntop	   = 0;
+	}
+
+	/* Wake the workers, take the first share, and wait for the others. */
+	pthread_mutex_lock(&pool->lock);
+	pool->generation++;
+	pool->pending = nthreads - 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	FuzzyWork(&pool->jobs[0]);
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+
+	/* Merge the heaps of every thread, then sort the result. */
+	for (t = 0; t < nthreads; t++)
+		for (j = 0; j < pool->jobs[t].ntop; j++)
+			FuzzyOffer(ls, out, &n, pool->jobs[t].top[j]);
+	for (j = n; j > 1; j--)
+	{
+		struct FuzzyMatch aux = out[0];
+		out[0]				  = out[j - 1];
+		out[j - 1]			  = aux;
+		FuzzySiftDown(out, j - 1, 0);
+	}
+	return n;
+}
+
+/* Number of bytes of 's' shown in at most 'cols' columns, without cutting
+ * an UTF-8 sequence: every character is taken to fill one column. */
+static size_t FuzzyFit(const char *s, size_t len, size_t cols)
+{
+	size_t j;
+
+	for (j = 0; j < len; j++)
+	{
+		if (((unsigned char)s[j] & 0xC0) == 0x80)
+			continue;
+		if (cols == 0)
+			break;
+		cols--;
+	}
+	return j;
+}
+
+/* Draw the query on the prompt row and the matches under it, then put the
+ * cursor back after the query. */
+static void FuzzyRefresh(const LinenoiseState *ls, const char *query, const struct FuzzyMatch *matches, int n, int selected)
+{
+	static const char prompt[] = "(fuzzy) ";
+	size_t			  qlen	   = strlen(query), qcols = 0, j;
+	size_t			  width	   = ls->cols > sizeof(prompt) ? ls->cols - sizeof(prompt) : 1;
+	size_t			  rowwidth = ls->cols > 2 ? ls->cols - 2 : 0;
+	char			  seq[64];
+	struct abuf		  ab;
+	int				  r;
+
+	/* Show the end of the query when it is too long. */
+	for (j = 0; j < qlen; j++)
+		if (((unsigned char)query[j] & 0xC0) != 0x80)
+			qcols++;
+	for (; qcols > width; qcols--)
+	{
+		do
+			query++, qlen--;
+		while (qlen && ((unsigned char)*query & 0xC0) == 0x80);
+	}
+
+	abInit(&ab);
+	abAppend(&ab, "\r", 1);
+	abAppend(&ab, prompt, sizeof(prompt) - 1);
+	abAppend(&ab, query, qlen);
+	abAppend(&ab, "\x1b[0K", 4);
+
+	for (r = 0; r < LINENOISE_FUZZY_ROWS; r++)
+	{
+		abAppend(&ab, "\r\n\x1b[0K", 6);
+		if (r < n)
+		{
+			const char *s	= ls->history[matches[r].index];
+			size_t		len = FuzzyFit(s, strlen(s), rowwidth);
+
+			abAppend(&ab, r == selected ? "> \x1b[7m" : "  ", r == selected ? 6 : 2);
+			for (j = 0; j < len; j++)
+				abAppend(&ab, iscntrl((unsigned char)s[j]) ? " " : s + j, 1);
+			if (r == selected)
+				abAppend(&ab, "\x1b[0m", 4);
+		}
+	}
+
+	snprintf(seq, sizeof(seq), "\x1b[%dA\r\x1b[%dC", LINENOISE_FUZZY_ROWS, (int)(sizeof(prompt) - 1 + qcols));
+	abAppend(&ab, seq, strlen(seq));
+	if (write(ls->ofd, ab.b, ab.len) == -1)
+		; /* Can't recover from write error. */
+	abFree(&ab);
+}
+
+/* Run the fuzzy finder, started with the edited line as query. Enter puts
+ * the selected entry in the edited line, Ctrl+g or Ctrl+c leave it as it
+ * was. Returns -1 on read errors, 0 otherwise. */
+static int HistoryFuzzyFind(LinenoiseState *ls)
+{
+	struct FuzzyMatch matches[LINENOISE_FUZZY_ROWS];
+	struct FuzzyPool  pool;
+	char			  query[LINENOISE_MAX_LINE];
+	uint64_t *		  masks;
+	size_t			  qlen = ls->len < sizeof(query) - 1 ? ls->len : sizeof(query) - 1;
+	int				  n = 0, selected = 0, ret = 0, r;
+	bool			  needmasks = true, done = false;
+	char			  seq[2];
+
+	if (ls->history_len == 0)
+		return 0;
+	masks = malloc(sizeof(uint64_t) * ls->history_len);
+	if (masks == NULL)
+		return 0;
+	memcpy(query, ls->buf, qlen);
+	query[qlen] = '\0';
+	FuzzyPoolStart(&pool, ls->history_len);
+
+	/* Clear the edited line, also when it spans many rows. */
+	ls->buf[0] = '\0';
+	ls->len = ls->pos = 0;
+	RefreshLine(ls);
+	memcpy(ls->buf, query, qlen + 1);
+	ls->len = ls->pos = qlen;
+
+	while (!done)
+	{
+		char c;
+
+		n		  = FuzzySearch(&pool, ls, query, masks, needmasks, matches);
+		needmasks = false;
+		if (selected >= n)
+			selected = n ? n - 1 : 0;
+		FuzzyRefresh(ls, query, matches, n, selected);
+
+		if (read(ls->ifd, &c, 1) <= 0)
+		{
+			ret = -1;
+			break;
+		}
+		switch (c)
+		{
+			case ENTER:
+				if (n > 0)
+				{
+					strncpy(ls->buf, ls->history[matches[selected].index], ls->buflen);
+					ls->buf[ls->buflen - 1] = '\0';
+					ls->len = ls->pos = strlen(ls->buf);
+				}
+				done = true;
+				break;
+			case CTRL_C:
+			case CTRL_G:
+				done = true;
+				break;
+			case BACKSPACE:
+			case CTRL_H:
+				if (qlen > 0)
+					query[--qlen] = '\0';
+				selected = 0;
+				break;
+			case CTRL_U:
+				query[qlen = 0] = '\0';
+				selected		= 0;
+				break;
+			case CTRL_N:
+			case CTRL_R:
+				if (selected + 1 < n)
+					selected++;
+				break;
+			case CTRL_P:
+				if (selected > 0)
+					selected--;
+				break;
+			case ESC:
+				if (read(ls->ifd, seq, 1) == -1 || read(ls->ifd, seq + 1, 1) == -1 || seq[0] != '[')
+					break;
+				if (seq[1] == 'A' && selected > 0)
+					selected--;
+				else if (seq[1] == 'B' && selected + 1 < n)
+					selected++;
+				break;
+			default:
+				if (!iscntrl((unsigned char)c) && qlen < sizeof(query) - 1)
+				{
+					query[qlen++] = c;
+					query[qlen]	  = '\0';
+					selected	  = 0;
+				}
+				break;
+		}
+	}
+	FuzzyPoolStop(&pool);
+	free(masks);
+
+	/* Clear the list and show the edited line again. */
+	for (r = 0; r < LINENOISE_FUZZY_ROWS; r++)
+		dprintf(ls->ofd, "\r\n\x1b[0K");
+	dprintf(ls->ofd, "\x1b[%dA", LINENOISE_FUZZY_ROWS);
+	RefreshLine(ls);
+	return ret;
+}
+
+/* =========================== History metadata ============================= */
+
+/* Optional metadata of the history entries, besides the use count and time
+ * that every entry has: how long the command ran, its exit status and the
+ * directory it ran in. Every field is a column parallel to ls->history, so
+ * that filtering the history on a field scans a dense array instead of
+ * chasing pointers. The directories are interned, the column holds ids in
+ * a table of the distinct directories seen. */
+struct LinenoiseHistoryColumns
+{
+	uint32_t *duration;	  /* How long every command ran, in milliseconds. */
+	int32_t * status;	  /* Exit status of every command, LINENOISE_HISTORY_NO_STATUS if unknown. */
+	uint32_t *cwd;		  /* Directory every command ran in, 0 if unknown. */
+	char **	  dirs;		  /* Interned directories, id 'n' being dirs[n - 1]. */
+	uint32_t  dirs_len;	  /* Directories interned. */
+	uint32_t  dirs_cap;	  /* Room in dirs. */
+	uint32_t *dirs_table; /* Open addressing table of the ids by hash. */
+	uint32_t  table_cap;  /* Slots in dirs_table, a power of two. */
+};
+
+#define LINENOISE_FILTER_BLOCK 256
+
+static uint64_t HashBytes(const char *p, size_t len)
+{
+	uint64_t h = 1469598103934665603ULL; /* FNV-1a */
+	size_t	 j;
+
+	for (j = 0; j < len; j++)
+		h = (h ^ (unsigned char)p[j]) * 1099511628211ULL;
+	return h ? h : 1;
+}
+
+/* Allocate the columns for 'len' entries. Returns 0 on out of memory. */
+static int ColumnsAlloc(struct LinenoiseHistoryColumns *c, int len)
+{
+	c->duration = malloc(sizeof(uint32_t) * len);
+	c->status	= malloc(sizeof(int32_t) * len);
+	c->cwd		= malloc(sizeof(uint32_t) * len);
+	if (c->duration == NULL || c->status == NULL || c->cwd == NULL)
+	{
+		free(c->duration);
+		free(c->status);
+		free(c->cwd);
+		c->duration = c->cwd = NULL;
+		c->status			 = NULL;
+		return 0;
+	}
+	return 1;
+}
+
+static void ColumnsFree(struct LinenoiseHistoryColumns *c)
+{
+	free(c->duration);
+	free(c->status);
+	free(c->cwd);
+	c->duration = c->cwd = NULL;
+	c->status			 = NULL;
+}
+
+/* Forget the metadata of the entry 'j'. */
+static void ColumnsClear(struct LinenoiseHistoryColumns *c, int j)
+{
+	c->duration[j] = 0;
+	c->status[j]   = LINENOISE_HISTORY_NO_STATUS;
+	c->cwd[j]	   = 0;
+}
+
+/* Copy the metadata of the 'n' entries starting at 'from' in 'src' to the
+ * ones starting at 'to' in 'dst'. */
+static void ColumnsCopy(struct LinenoiseHistoryColumns *dst, int to, const struct LinenoiseHistoryColumns *src, int from, int n)
+{
+	memmove(dst->duration + to, src->duration + from, sizeof(uint32_t) * n);
+	memmove(dst->status + to, src->status + from, sizeof(int32_t) * n);
+	memmove(dst->cwd + to, src->cwd + from, sizeof(uint32_t) * n);
+}
+
+/* Move the columns 'n' entries forward, like the history window. */
+static void ColumnsShift(struct LinenoiseHistoryColumns *c, int n)
+{
+	c->duration += n;
+	c->status += n;
+	c->cwd += n;
+}
+
+/* Reallocate the columns for 'cap' entries, keeping their first 'n' ones.
+ * The columns start 'start' entries into their allocation. Returns 0 on
+ * out of memory, leaving the columns untouched. */
+static int ColumnsResize(struct LinenoiseHistoryColumns *c, int cap, int start, int n)
+{
+	struct LinenoiseHistoryColumns fresh;
+
+	if (!ColumnsAlloc(&fresh, cap))
+		return 0;
+	if (c->duration)
+	{
+		ColumnsCopy(&fresh, 0, c, 0, n);
+		ColumnsShift(c, -start);
+		ColumnsFree(c);
+	}
+	c->duration = fresh.duration;
+	c->status	= fresh.status;
+	c->cwd		= fresh.cwd;
+	return 1;
+}
+
+static void HistoryColumnsFree(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryColumns *c = ls->history_columns;
+	uint32_t						j;
+
+	if (c == NULL)
+		return;
+	if (c->duration)
+		ColumnsShift(c, -ls->history_start);
+	ColumnsFree(c);
+	for (j = 0; j < c->dirs_len; j++)
+		free(c->dirs[j]);
+	free(c->dirs);
+	free(c->dirs_table);
+	free(c);
+	ls->history_columns = NULL;
+}
+
+/* Returns the id of the directory 'dir', or 0 if it was never seen. */
+static uint32_t ColumnsLookup(const struct LinenoiseHistoryColumns *c, const char *dir)
+{
+	uint32_t j, id;
+
+	if (c->table_cap == 0)
+		return 0;
+	for (j = HashBytes(dir, strlen(dir)) & (c->table_cap - 1); (id = c->dirs_table[j]); j = (j + 1) & (c->table_cap - 1))
+		if (!strcmp(c->dirs[id - 1], dir))
+			return id;
+	return 0;
+}
+
+/* Returns the id of the directory 'dir', interning it if needed, or 0 on
+ * out of memory. */
+static uint32_t ColumnsIntern(struct LinenoiseHistoryColumns *c, const char *dir)
+{
+	uint32_t id = ColumnsLookup(c, dir), j;
+	char *	 copy;
+
+	if (id)
+		return id;
+	if ((c->dirs_len + 1) * 2 > c->table_cap)
+	{
+		uint32_t  cap	= c->table_cap ? c->table_cap * 2 : 64;
+		uint32_t *table = calloc(cap, sizeof(uint32_t));
+
+		if (table == NULL)
+			return 0;
+		for (id = 1; id <= c->dirs_len; id++)
+		{
+			for (j = HashBytes(c->dirs[id - 1], strlen(c->dirs[id - 1])) & (cap - 1); table[j]; j = (j + 1) & (cap - 1))
+				;
+			table[j] = id;
+		}
+		free(c->dirs_table);
+		c->dirs_table = table;
+		c->table_cap  = cap;
+	}
+	if (c->dirs_len == c->dirs_cap)
+	{
+		uint32_t cap  = c->dirs_cap ? c->dirs_cap * 2 : 16;
+		char **	 dirs = realloc(c->dirs, sizeof(char *) * cap);
+
+		if (dirs == NULL)
+			return 0;
+		c->dirs		= dirs;
+		c->dirs_cap = cap;
+	}
+	copy = strdup(dir);
+	if (copy == NULL)
+		return 0;
+	c->dirs[c->dirs_len++] = copy;
+	for (j = HashBytes(dir, strlen(dir)) & (c->table_cap - 1); c->dirs_table[j]; j = (j + 1) & (c->table_cap - 1))
+		;
+	c->dirs_table[j] = c->dirs_len;
+	return c->dirs_len;
+}
+
+/* Enable or disable the metadata columns. Disabling them forgets the
+ * metadata of every entry. Returns 0 on out of memory. */
+int LinenoiseHistorySetMetadata(LinenoiseState *ls, int enable)
+{
+	struct LinenoiseHistoryColumns *c;
+	int								j;
+
+	if (!enable)
+	{
+		HistoryColumnsFree(ls);
+		return 1;
+	}
+	if (ls->history_columns)
+		return 1;
+	c = calloc(1, sizeof(*c));
+	if (c == NULL)
+		return 0;
+	if (ls->history)
+	{
+		if (!ColumnsAlloc(c, ls->history_cap))
+		{
+			free(c);
+			return 0;
+		}
+		ColumnsShift(c, ls->history_start);
+		for (j = 0; j < ls->history_len; j++)
+			ColumnsClear(c, j);
+	}
+	ls->history_columns = c;
+	return 1;
+}
+
+/* Attach to the newest history entry the result of running it: its exit
+ * 'status', how long it ran in milliseconds and the directory it ran in,
+ * if 'cwd' is not NULL. Call it once the command of the line just added
+ * finished. Returns 0 if metadata is disabled, the history is empty or on
+ * out of memory. */
+int LinenoiseHistorySetResult(LinenoiseState *ls, int status, uint32_t duration, const char *cwd)
+{
+	struct LinenoiseHistoryColumns *c = ls->history_columns;
+	int								j = ls->history_len - 1;
+	uint32_t						id;
+
+	if (c == NULL || j < 0)
+		return 0;
+	c->status[j]   = status;
+	c->duration[j] = duration;
+	if (cwd)
+	{
+		if ((id = ColumnsIntern(c, cwd)) == 0)
+			return 0;
+		c->cwd[j] = id;
+	}
+	return 1;
+}
+
+/* Fill 'meta' with the metadata of the history entry 'index'. The cwd
+ * string is owned by the state. Returns 0 if there is no such entry. */
+int LinenoiseHistoryGetMeta(const LinenoiseState *ls, int index, LinenoiseHistoryMeta *meta)
+{
+	const struct LinenoiseHistoryColumns *c = ls->history_columns;
+
+	if (index < 0 || index >= ls->history_len)
+		return 0;
+	meta->time	   = ls->history_time[index];
+	meta->uses	   = ls->history_uses[index];
+	meta->duration = c ? c->duration[index] : 0;
+	meta->status   = c ? c->status[index] : LINENOISE_HISTORY_NO_STATUS;
+	meta->cwd	   = c && c->cwd[index] ? c->dirs[c->cwd[index] - 1] : NULL;
+	return 1;
+}
+
+/* Store in 'out' the indexes of up to 'max' history entries matching all
+ * the conditions of 'q', the newest first. Returns the number of indexes
+ * stored.
+ *
+ * The history is scanned from its top in blocks. Every condition is a
+ * branchless pass over its column that compilers turn into SIMD code,
+ * narrowing a mask of the block's matching entries. */
+int LinenoiseHistoryFilter(const LinenoiseState *ls, const LinenoiseHistoryQuery *q, int *out, int max)
+{
+	const struct LinenoiseHistoryColumns *c = ls->history_columns;
+	uint8_t								  match[LINENOISE_FILTER_BLOCK];
+	uint32_t							  cwd = 0;
+	int									  hi, n = 0;
+
+	if (c == NULL && (q->failed || q->min_duration || q->cwd))
+		return 0;
+	if (q->cwd && (cwd = ColumnsLookup(c, q->cwd)) == 0)
+		return 0;
+
+	for (hi = ls->history_len; hi > 0 && n < max; hi -= LINENOISE_FILTER_BLOCK)
+	{
+		int lo = hi > LINENOISE_FILTER_BLOCK ? hi - LINENOISE_FILTER_BLOCK : 0;
+		int len = hi - lo, k;
+
+		memset(match, 1, len);
+		if (q->since)
+		{
+			const uint32_t *col = ls->history_time + lo;
+
+			for (k = 0; k < len; k++)
+				match[k] &= col[k] >= q->since;
+		}
+		if (q->failed)
+		{
+			const int32_t *col = c->status + lo;
+
+			for (k = 0; k < len; k++)
+				match[k] &= (col[k] != 0) & (col[k] != LINENOISE_HISTORY_NO_STATUS);
+		}
+		if (q->min_duration)
+		{
+			const uint32_t *col = c->duration + lo;
+
+			for (k = 0; k < len; k++)
+				match[k] &= col[k] >= q->min_duration;
+		}
+		if (cwd)
+		{
+			const uint32_t *col = c->cwd + lo;
+
+			for (k = 0; k < len; k++)
+				match[k] &= col[k] == cwd;
+		}
+		for (k = len - 1; k >= 0 && n < max; k--)
+			if (match[k])
+				out[n++] = lo + k;
+	}
+	return n;
+}
+
+/* ========================== Shared history store ========================== */
+
+/* History entries interned in a process-wide store, shared by the sessions
+ * that enable it with LinenoiseHistorySetInterned(): every distinct line is
+ * stored once and reference counted, and the histories point to its text.
+ * The store is split in shards with a lock each, picked by the hash of the
+ * line, so sessions interning at the same time rarely contend. */
+#define LINENOISE_INTERN_SHARDS 64
+
+struct InternString
+{
+	struct InternString *next; /* Next string in the same bucket. */
+	uint64_t			 hash;
+	size_t				 refs; /* Histories entries pointing to it. */
+	size_t				 len;
+	char				 line[];
+};
+
+struct InternShard
+{
+	pthread_mutex_t		  lock;
+	struct InternString **buckets;
+	size_t				  nbuckets; /* A power of two. */
+	size_t				  count;	/* Strings in the shard. */
+	size_t				  bytes;	/* Bytes taken by them, headers included. */
+};
+
+static struct InternShard intern_shards[LINENOISE_INTERN_SHARDS];
+static pthread_once_t	  intern_once = PTHREAD_ONCE_INIT;
+
+static void InternInit(void)
+{
+	int j;
+
+	for (j = 0; j < LINENOISE_INTERN_SHARDS; j++)
+		pthread_mutex_init(&intern_shards[j].lock, NULL);
+}
+
+/* The shard is picked by the top bits of the hash, the bucket by the low
+ * ones. */
+static struct InternShard *InternShardOf(uint64_t hash)
+{
+	return &intern_shards[hash >> 58];
+}
+
+/* Double the buckets of the shard, that must be locked. Failing is fine, the
+ * chains just get longer. */
+static void InternGrow(struct InternShard *sh)
+{
+	size_t				  cap = sh->nbuckets ? sh->nbuckets * 2 : 64, j;
+	struct InternString **buckets = calloc(cap, sizeof(*buckets));
+
+	if (buckets == NULL)
+		return;
+	for (j = 0; j < sh->nbuckets; j++)
+	{
+		struct InternString *s = sh->buckets[j], *next;
+
+		for (; s; s = next)
+		{
+			next					  = s->next;
+			s->next					  = buckets[s->hash & (cap - 1)];
+			buckets[s->hash & (cap - 1)] = s;
+		}
+	}
+	free(sh->buckets);
+	sh->buckets	 = buckets;
+	sh->nbuckets = cap;
+}
+
+/* Returns the interned copy of the 'len' bytes 'line', taking a reference
+ * to it, or NULL on out of memory. */
+static char *InternAcquire(const char *line, size_t len)
+{
+	uint64_t			 hash = HashBytes(line, len);
+	struct InternShard * sh	  = InternShardOf(hash);
+	struct InternString *s;
+
+	pthread_once(&intern_once, InternInit);
+	pthread_mutex_lock(&sh->lock);
+	if (sh->nbuckets)
+		for (s = sh->buckets[hash & (sh->nbuckets - 1)]; s; s = s->next)
+			if (s->hash == hash && s->len == len && !memcmp(s->line, line, len))
+			{
+				s->refs++;
+				pthread_mutex_unlock(&sh->lock);
+				return s->line;
+			}
+
+	if (sh->count >= sh->nbuckets)
+		InternGrow(sh);
+	s = sh->nbuckets ? malloc(sizeof(*s) + len + 1) : NULL;
+	if (s == NULL)
+	{
+		pthread_mutex_unlock(&sh->lock);
+		return NULL;
+	}
+	s->hash = hash;
+	s->refs = 1;
+	s->len	= len;
+	memcpy(s->line, line, len);
+	s->line[len]						  = '\0';
+	s->next								  = sh->buckets[hash & (sh->nbuckets - 1)];
+	sh->buckets[hash & (sh->nbuckets - 1)] = s;
+	sh->count++;
+	sh->bytes += sizeof(*s) + len + 1;
+	pthread_mutex_unlock(&sh->lock);
+	return s->line;
+}
+
+/* Drop a reference to the interned 'line', freeing it with the last one. */
+static void InternRelease(char *line)
+{
+	struct InternString * s	 = (struct InternString *)(line - offsetof(struct InternString, line));
+	struct InternShard *  sh = InternShardOf(s->hash);
+	struct InternString **p;
+
+	pthread_mutex_lock(&sh->lock);
+	if (--s->refs == 0)
+	{
+		for (p = &sh->buckets[s->hash & (sh->nbuckets - 1)]; *p != s; p = &(*p)->next)
+			;
+		*p = s->next;
+		sh->count--;
+		sh->bytes -= sizeof(*s) + s->len + 1;
+		free(s);
+	}
+	pthread_mutex_unlock(&sh->lock);
+}
+
+/* Fill 'strings' and 'bytes', if not NULL, with the distinct lines in the
+ * shared store and the bytes they take. */
+void LinenoiseHistoryGetInternStats(size_t *strings, size_t *bytes)
+{
+	size_t count = 0, total = 0;
+	int	   j;
+
+	pthread_once(&intern_once, InternInit);
+	for (j = 0; j < LINENOISE_INTERN_SHARDS; j++)
+	{
+		pthread_mutex_lock(&intern_shards[j].lock);
+		count += intern_shards[j].count;
+		total += intern_shards[j].bytes;
+		pthread_mutex_unlock(&intern_shards[j].lock);
+	}
+	if (strings)
+		*strings = count;
+	if (bytes)
+		*bytes = total;
+}
+
+/* ======================== Append-only history file ======================== */
+
+/* LinenoiseHistorySave() rewrites the whole file every time. Once a file is
+ * opened with LinenoiseHistoryOpen() it is instead kept open in append mode
+ * and LinenoiseHistoryAppend() writes just the entries added since the last
+ * call, with a single write(). The file is only rewritten, to a temporary
+ * file renamed over it, when it grows past the compaction size: a crash can
+ * then leave either the old or the new file, never a truncated one. */
+
+#define LINENOISE_DEFAULT_COMPACT_SIZE (1024 * 1024)
+
+#if defined(__APPLE__)
+#	define fdatasync fsync
+#endif
+
+/* With LinenoiseHistorySetWriter() the entries are not written by the
+ * caller but queued, already formatted, and a worker thread writes them.
+ * The worker waits for the configured interval to collect the entries
+ * added meanwhile, then writes the whole batch with one write() and, with
+ * LINENOISE_DURABILITY_INTERVAL, makes it durable with one fdatasync(). */
+struct LinenoiseHistoryWriter
+{
+	pthread_t		thread;
+	pthread_mutex_t lock;
+	pthread_cond_t	wake;		/* New entries, a flush request or stop. */
+	pthread_cond_t	idle;		/* A batch was written. */
+	char *			queue;		/* Entries waiting, one per line. */
+	size_t			len, cap;	/* Bytes used and allocated in 'queue'. */
+	size_t			queued;		/* Entries in 'queue'. */
+	int				fd;			/* File to write to. */
+	off_t			size;		/* Size of the file after the last batch. */
+	int				interval;	/* Milliseconds to wait before writing a batch. */
+	int				durability; /* One of LINENOISE_DURABILITY_*. */
+	int				flushers;	/* Callers waiting for the queue to be written. */
+	bool			busy;		/* The worker is writing a batch. */
+	bool			stop;		/* The worker should exit once the queue is written. */
+	uint64_t		written;	/* Statistics, see LinenoiseHistoryGetWriterStats(). */
+	uint64_t		batches;
+	uint64_t		syncs;
+	uint64_t		errors;
+};
+
+struct LinenoiseHistoryFile
+{
+	int							   fd;			 /* The file, opened with O_APPEND. */
+	char *						   name;		 /* Its name, to replace it when compacting. */
+	int							   unsaved;		 /* Entries added to the history since the last append. */
+	off_t						   compacted;	 /* Size of the file after the last compaction. */
+	size_t						   compact_size; /* Compact the file when it grows past this size. */
+	struct LinenoiseHistoryWriter *writer;		 /* Background writer, if enabled. */
+	bool						   shared;		 /* Merge the entries of other processes on append. */
+	bool						   live;		 /* Also merge them at every prompt. */
+	off_t						   offset;		 /* Bytes of the file already in the history. */
+	bool						   binary;		 /* The file is in the binary format. */
+	int							   inotify;		 /* inotify instance watching the file, or -1. */
+	int							   watch;		 /* Its watch descriptor. */
+};
+
+static void *HistoryWriterWork(void *arg)
+{
+	struct LinenoiseHistoryWriter *w	 = arg;
+	char *						   batch = NULL;
+	size_t						   batchcap = 0;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;)
+	{
+		struct timespec deadline;
+		size_t			len, cap, queued;
+		char *			tmp;
+		int				fd, ret, durability;
+		struct stat		st;
+
+		while (w->len == 0 && !w->stop)
+			pthread_cond_wait(&w->wake, &w->lock);
+		if (w->len == 0)
+			break;
+
+		/* Give the prompt thread some time to queue more entries, unless
+		 * somebody is waiting for them to be written. */
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += w->interval / 1000;
+		deadline.tv_nsec += (long)(w->interval % 1000) * 1000000;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+		while (!w->stop && !w->flushers &&
+			   pthread_cond_timedwait(&w->wake, &w->lock, &deadline) != ETIMEDOUT)
+			;
+
+		/* Take the whole queue, leaving our empty buffer in its place. */
+		tmp		 = batch;
+		batch	 = w->queue;
+		w->queue = tmp;
+		cap		 = batchcap;
+		batchcap = w->cap;
+		w->cap	 = cap;
+		len		 = w->len;
+		queued	 = w->queued;
+		w->len = w->queued = 0;
+		w->busy			   = true;
+		fd				   = w->fd;
+		durability		   = w->durability;
+		pthread_mutex_unlock(&w->lock);
+
+		ret = WriteAll(fd, batch, len);
+		if (ret == 0 && durability != LINENOISE_DURABILITY_NONE)
+			ret = fdatasync(fd);
+
+		pthread_mutex_lock(&w->lock);
+		if (ret == 0)
+		{
+			w->written += queued;
+			w->syncs += durability != LINENOISE_DURABILITY_NONE;
+		}
+		else
+			w->errors++;
+		w->batches++;
+		if (fstat(fd, &st) == 0)
+			w->size = st.st_size;
+		w->busy = false;
+		pthread_cond_broadcast(&w->idle);
+	}
+	pthread_mutex_unlock(&w->lock);
+	free(batch);
+	return NULL;
+}
+
+/* Queue 'line' to be written by the worker. */
+static void HistoryWriterQueue(struct LinenoiseHistoryWriter *w, const char *line)
+{
+	size_t len = strlen(line);
+
+	pthread_mutex_lock(&w->lock);
+	if (w->len + len + 1 > w->cap)
+	{
+		size_t cap	 = w->cap ? w->cap : 4096;
+		char * queue;
+
+		while (cap < w->len + len + 1)
+			cap *= 2;
+		queue = realloc(w->queue, cap);
+		if (queue == NULL)
+		{
+			w->errors++;
+			pthread_mutex_unlock(&w->lock);
+			return;
+		}
+		w->queue = queue;
+		w->cap	 = cap;
+	}
+	memcpy(w->queue + w->len, line, len);
+	w->queue[w->len + len] = '\n';
+	w->len += len + 1;
+	w->queued++;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Wait until every queued entry was written. */
+static void HistoryWriterFlush(struct LinenoiseHistoryWriter *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->flushers++;
+	pthread_cond_signal(&w->wake);
+	while (w->len || w->busy)
+		pthread_cond_wait(&w->idle, &w->lock);
+	w->flushers--;
+	pthread_mutex_unlock(&w->lock);
+}
+
+/* Write what is left in the queue and stop the worker. */
+static void HistoryWriterStop(struct LinenoiseHistoryFile *hf)
+{
+	struct LinenoiseHistoryWriter *w = hf->writer;
+
+	if (w == NULL)
+		return;
+	pthread_mutex_lock(&w->lock);
+	w->stop = true;
+	pthread_cond_signal(&w->wake);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_mutex_destroy(&w->lock);
+	pthread_cond_destroy(&w->wake);
+	pthread_cond_destroy(&w->idle);
+	free(w->queue);
+	free(w);
+	hf->writer = NULL;
+}
+
+/* Called for every entry added to the history while a file is open. */
+static void HistoryFileAdded(LinenoiseState *ls, const char *line)
+{
+	if (ls->history_file->writer)
+		HistoryWriterQueue(ls->history_file->writer, line);
+	else
+		ls->history_file->unsaved++;
+}
+
+/* Watch the current file, replacing the watch of the file it replaced. */
+static void HistoryFileWatch(struct LinenoiseHistoryFile *hf)
+{
+#ifdef __linux__
+	if (hf->inotify == -1)
+		return;
+	if (hf->watch != -1)
+		inotify_rm_watch(hf->inotify, hf->watch);
+	hf->watch = inotify_add_watch(hf->inotify, hf->name, IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+#else
+	(void)hf;
+#endif
+}
+
+static void HistoryFileClose(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+
+	if (hf == NULL)
+		return;
+	HistoryWriterStop(hf);
+	if (hf->inotify != -1)
+		close(hf->inotify);
+	close(hf->fd);
+	free(hf->name);
+	free(hf);
+	ls->history_file = NULL;
+}
+
+/* Replace the file with the current history. */
+static int HistoryFileCompact(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+	struct stat					 st;
+	int							 fd;
+
+	fd = HistoryReplaceFile(ls, hf->name, hf->binary);
+	if (fd == -1)
+		return -1;
+
+	/* Keep appending to the new file. */
+	if (fstat(fd, &st) == -1 || (!hf->binary && fcntl(fd, F_SETFL, O_APPEND) == -1))
+	{
+		close(fd);
+		return -1;
+	}
+	close(hf->fd);
+	hf->fd		  = fd;
+	hf->compacted = hf->offset = st.st_size;
+	HistoryFileWatch(hf);
+	return 0;
+}
+
+/* Load the history from 'filename', creating it if needed, and keep it open
+ * to append the new entries with LinenoiseHistoryAppend(). Returns 0 on
+ * success, -1 on error. */
+int LinenoiseHistoryOpen(LinenoiseState *ls, const char *filename)
+{
+	struct LinenoiseHistoryFile *hf;
+	int							 fd, ret;
+	off_t						 size;
+
+	fd = open(filename, O_RDWR | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+	if (fd == -1)
+		return -1;
+	hf = calloc(1, sizeof(*hf));
+	if (hf == NULL || (hf->name = strdup(filename)) == NULL)
+	{
+		free(hf);
+		close(fd);
+		return -1;
+	}
+
+	/* Don't read a line while another process is appending it. */
+	flock(fd, LOCK_SH);
+	ret = HistoryLoadFd(ls, fd, &size);
+	flock(fd, LOCK_UN);
+	if (ret == -1)
+	{
+		free(hf->name);
+		free(hf);
+		close(fd);
+		return -1;
+	}
+
+	/* Binary files are updated in place, not just appended to. */
+	{
+		char magic[LINENOISE_BINARY_MAGIC_LEN];
+
+		hf->binary = pread(fd, magic, sizeof(magic), 0) == sizeof(magic) &&
+					 !memcmp(magic, LINENOISE_BINARY_MAGIC, sizeof(magic));
+		if (hf->binary)
+			fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_APPEND);
+	}
+
+	HistoryFileClose(ls);
+	hf->fd			 = fd;
+	hf->offset		 = size;
+	hf->compact_size = LINENOISE_DEFAULT_COMPACT_SIZE;
+	hf->inotify		 = -1;
+	ls->history_file = hf;
+	return 0;
+}
+
+/* Add to the history the lines other processes appended to the shared file
+ * since we last looked at it, below our 'keep' newest entries that are not
+ * in the file yet. If the file was replaced by a compaction, its tail
+ * replaces the history instead. Called with the file locked. */
+static int HistoryFilePull(LinenoiseState *ls, int keep)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+	struct stat					 st, cur;
+	char **						 lines = NULL;
+	uint32_t *					 uses = NULL, *when = NULL;
+	struct LinenoiseHistoryColumns meta = {0};
+	size_t						 bytes = 0;
+	bool						 replaced;
+	int							 j, ret = 0;
+
+	if (fstat(hf->fd, &st) == -1)
+		return -1;
+
+	/* Follow the file until the one we lock is still the current one. */
+	replaced = false;
+	while (stat(hf->name, &cur) == 0 && (cur.st_ino != st.st_ino || cur.st_dev != st.st_dev))
+	{
+		int fd = open(hf->name, O_RDWR | O_APPEND);
+
+		if (fd == -1 || flock(fd, LOCK_EX) == -1 || fstat(fd, &st) == -1)
+		{
+			if (fd != -1)
+				close(fd);
+			return -1;
+		}
+		close(hf->fd);
+		hf->fd	   = fd;
+		hf->offset = hf->compacted = 0;
+		replaced				   = true;
+		HistoryFileWatch(hf);
+	}
+	if (st.st_size <= hf->offset)
+	{
+		hf->offset = st.st_size;
+		return 0;
+	}
+
+	/* Set our entries apart, the new lines go below them. */
+	keep = keep < ls->history_len ? keep : ls->history_len;
+	if (keep)
+	{
+		lines = malloc(sizeof(char *) * keep);
+		uses  = malloc(sizeof(uint32_t) * keep);
+		when  = malloc(sizeof(uint32_t) * keep);
+		if (lines == NULL || uses == NULL || when == NULL ||
+			(ls->history_columns && !ColumnsAlloc(&meta, keep)))
+		{
+			free(lines);
+			free(uses);
+			free(when);
+			return -1;
+		}
+		ls->history_len -= keep;
+		HistoryIndexChanged(ls);
+		for (j = 0; j < keep; j++)
+			bytes += HistoryEntryBytes(strlen(ls->history[ls->history_len + j]));
+		ls->history_bytes -= bytes;
+		memcpy(lines, ls->history + ls->history_len, sizeof(char *) * keep);
+		memcpy(uses, ls->history_uses + ls->history_len, sizeof(uint32_t) * keep);
+		memcpy(when, ls->history_time + ls->history_len, sizeof(uint32_t) * keep);
+		if (ls->history_columns)
+			ColumnsCopy(&meta, 0, ls->history_columns, ls->history_len, keep);
+	}
+	if (replaced)
+		FreeHistory(ls);
+
+	/* Map just the new bytes, from the page they start in. */
+	{
+		off_t start = hf->offset - hf->offset % sysconf(_SC_PAGESIZE);
+		char *map	= mmap(NULL, st.st_size - start, PROT_READ, MAP_PRIVATE, hf->fd, start);
+
+		if (map == MAP_FAILED)
+			ret = -1;
+		else
+		{
+			ret = HistoryLoadTail(ls, map + (hf->offset - start), st.st_size - hf->offset, (uint32_t)time(NULL));
+			munmap(map, st.st_size - start);
+			hf->offset = st.st_size;
+		}
+	}
+
+	/* Put our entries back on top. */
+	if (keep)
+	{
+		if (!HistoryMakeRoom(ls, keep, bytes))
+		{
+			for (j = 0; j < keep; j++)
+				HistoryFreeEntry(ls, lines[j]);
+			keep = 0;
+			ret	 = -1;
+		}
+		for (j = 0; j < keep; j++)
+			HistoryPush(ls, lines[j], uses[j], when[j]);
+		if (keep && ls->history_columns)
+			ColumnsCopy(ls->history_columns, ls->history_len - keep, &meta, 0, keep);
+		ColumnsFree(&meta);
+		free(lines);
+		free(uses);
+		free(when);
+		HistoryIndexRebuild(ls);
+	}
+	return ret;
+}
+
+/* Append to the file opened with LinenoiseHistoryOpen() the entries added
+ * to the history since the last call, compacting the file if it grew too
+ * much. With the background writer the entries were already queued as they
+ * were added, and this only waits for them with LINENOISE_DURABILITY_SYNC.
+ * Returns 0 on success, -1 on error or if no file is open. */
+int LinenoiseHistoryAppend(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryFile *  hf = ls->history_file;
+	struct LinenoiseHistoryWriter *w;
+	struct stat					   st;
+	off_t						   size;
+	int							   n, ret = 0;
+
+	if (hf == NULL)
+		return -1;
+	w = hf->writer;
+	if (w)
+	{
+		bool sync;
+
+		pthread_mutex_lock(&w->lock);
+		sync = w->durability == LINENOISE_DURABILITY_SYNC;
+		pthread_mutex_unlock(&w->lock);
+		if (sync)
+			HistoryWriterFlush(w);
+		pthread_mutex_lock(&w->lock);
+		size = w->size;
+		pthread_mutex_unlock(&w->lock);
+	}
+	else
+	{
+		n = hf->unsaved < ls->history_len ? hf->unsaved : ls->history_len;
+		if (n == 0 && !hf->shared)
+			return 0;
+
+		/* In shared mode the file is locked from reading what the other
+		 * processes appended until our own entries follow them. */
+		if (hf->shared)
+		{
+			if (flock(hf->fd, LOCK_EX) == -1)
+				return -1;
+			ret = HistoryFilePull(ls, n);
+		}
+		if (n && hf->binary)
+		{
+			/* Binary files are written at their end, not in O_APPEND
+			 * mode: keep other processes out from finding the end to
+			 * committing the header. */
+			if (flock(hf->fd, LOCK_EX) == -1 || HistoryAppendBinary(ls, hf->fd, ls->history_len - n) == -1)
+				ret = -1;
+			flock(hf->fd, LOCK_UN);
+		}
+		else if (n && !hf->binary && HistoryWrite(ls, hf->fd, ls->history_len - n) == -1)
+			ret = -1;
+		hf->unsaved = 0;
+		size		= fstat(hf->fd, &st) == 0 ? st.st_size : 0;
+		hf->offset	= size;
+	}
+
+	/* The history may be much bigger than the threshold, don't compact
+	 * again until the file doubled. */
+	if ((size_t)size <= hf->compact_size || size <= 2 * hf->compacted)
+	{
+		if (hf->shared)
+			flock(hf->fd, LOCK_UN);
+		return ret;
+	}
+	if (w == NULL)
+	{
+		/* Closing the old file releases its lock, the new one is locked
+		 * from before it replaced the old one. */
+		if (HistoryFileCompact(ls) == -1)
+			ret = -1;
+		if (hf->shared)
+			flock(hf->fd, LOCK_UN);
+		return ret;
+	}
+
+	/* Only the prompt thread queues entries, so once the queue is written
+	 * the worker stays idle until we queue again. */
+	HistoryWriterFlush(w);
+	ret = HistoryFileCompact(ls);
+	pthread_mutex_lock(&w->lock);
+	w->fd	= hf->fd;
+	w->size = hf->compacted;
+	pthread_mutex_unlock(&w->lock);
+	return ret;
+}
+
+/* Share the file opened with LinenoiseHistoryOpen() with other processes:
+ * LinenoiseHistoryAppend() locks the file with flock(), merges in the
+ * history the lines appended by the others since the previous call, and
+ * then appends our own entries. Only the new part of the file is read. Not
+ * available with the background writer. Returns 1 on success, 0 on error. */
+int LinenoiseHistorySetShared(LinenoiseState *ls, int enable)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+
+	if (hf == NULL || hf->writer || hf->binary)
+		return 0;
+	hf->shared = enable;
+	return 1;
+}
+
+/* Keep the history in sync with the file opened with LinenoiseHistoryOpen()
+ * while other processes append to it: the new entries are merged at the
+ * start of every prompt, or when LinenoiseHistorySync() is called. This
+ * also enables the shared mode of LinenoiseHistorySetShared(). On Linux the
+ * file is watched with inotify, so nothing is read until it changes.
+ * Returns 1 on success, 0 on error. */
+int LinenoiseHistorySetLiveSync(LinenoiseState *ls, int enable)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+
+	if (hf == NULL)
+		return 0;
+	if (!enable)
+	{
+		if (hf->inotify != -1)
+			close(hf->inotify);
+		hf->inotify = -1;
+		hf->live	= false;
+		return 1;
+	}
+	if (hf->live)
+		return 1;
+	if (!LinenoiseHistorySetShared(ls, true))
+		return 0;
+#ifdef __linux__
+	hf->inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	hf->watch	= -1;
+	HistoryFileWatch(hf);
+#endif
+	hf->live = true;
+	return 1;
+}
+
+/* Return a descriptor that becomes readable when the file synced with
+ * LinenoiseHistorySetLiveSync() changes, so that the program can call
+ * LinenoiseHistorySync() while idle, or -1 if there is none. */
+int LinenoiseHistoryWatchFd(const LinenoiseState *ls)
+{
+	return ls->history_file ? ls->history_file->inotify : -1;
+}
+
+/* Merge in the history the entries other processes appended to the synced
+ * file since the last time. Returns 1 if the file was read, 0 if it did not
+ * change or is not synced, and -1 on error. */
+int LinenoiseHistorySync(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+	int							 keep, ret;
+
+	if (hf == NULL || !hf->live)
+		return 0;
+#ifdef __linux__
+	if (hf->inotify != -1)
+	{
+		char buf[4096];
+		bool changed = false;
+
+		while (read(hf->inotify, buf, sizeof(buf)) > 0)
+			changed = true;
+		if (!changed)
+			return 0;
+	}
+#endif
+
+	if (flock(hf->fd, LOCK_EX) == -1)
+		return -1;
+	keep = hf->unsaved < ls->history_len ? hf->unsaved : ls->history_len;
+	ret	 = HistoryFilePull(ls, keep);
+	flock(hf->fd, LOCK_UN);
+
+	/* Only our own entries still have to be appended. */
+	hf->unsaved = keep;
+	return ret == -1 ? -1 : 1;
+}
+
+/* Write the entries added to the history in a background thread, that
+ * collects them for 'interval' milliseconds before writing them at once
+ * with the given durability, one of LINENOISE_DURABILITY_*. A negative
+ * interval stops the thread after writing what is left. Needs a file
+ * opened with LinenoiseHistoryOpen(). Returns 1 on success, 0 on error. */
+int LinenoiseHistorySetWriter(LinenoiseState *ls, int interval, int durability)
+{
+	struct LinenoiseHistoryFile *  hf = ls->history_file;
+	struct LinenoiseHistoryWriter *w;
+	struct stat					   st;
+	int							   j;
+
+	if (hf == NULL)
+		return 0;
+	if (interval < 0)
+	{
+		HistoryWriterStop(hf);
+		return 1;
+	}
+	if (hf->shared || hf->binary)
+		return 0;
+	if (durability < LINENOISE_DURABILITY_NONE || durability > LINENOISE_DURABILITY_SYNC)
+		return 0;
+
+	/* Just update the settings of a running writer. */
+	if ((w = hf->writer) != NULL)
+	{
+		pthread_mutex_lock(&w->lock);
+		w->interval	  = interval;
+		w->durability = durability;
+		pthread_mutex_unlock(&w->lock);
+		return 1;
+	}
+
+	w = calloc(1, sizeof(*w));
+	if (w == NULL)
+		return 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->wake, NULL);
+	pthread_cond_init(&w->idle, NULL);
+	w->fd		  = hf->fd;
+	w->size		  = fstat(hf->fd, &st) == 0 ? st.st_size : 0;
+	w->interval	  = interval;
+	w->durability = durability;
+	if (pthread_create(&w->thread, NULL, HistoryWriterWork, w) != 0)
+	{
+		pthread_mutex_destroy(&w->lock);
+		pthread_cond_destroy(&w->wake);
+		pthread_cond_destroy(&w->idle);
+		free(w);
+		return 0;
+	}
+	hf->writer = w;
+
+	/* Hand over what was not appended yet. */
+	j = hf->unsaved < ls->history_len ? hf->unsaved : ls->history_len;
+	for (j = ls->history_len - j; j < ls->history_len; j++)
+		HistoryWriterQueue(w, ls->history[j]);
+	hf->unsaved = 0;
+	return 1;
+}
+
+/* Wait for the background writer to write every queued entry, with the
+ * durability it was configured with. The queue is also flushed when the
+ * state is freed. */
+void LinenoiseHistoryFlush(LinenoiseState *ls)
+{
+	if (ls->history_file && ls->history_file->writer)
+		HistoryWriterFlush(ls->history_file->writer);
+}
+
+/* Fill 'stats' with the counters of the background writer. Returns 0 if
+ * the writer is not running. */
+int LinenoiseHistoryGetWriterStats(const LinenoiseState *ls, LinenoiseHistoryWriterStats *stats)
+{
+	struct LinenoiseHistoryWriter *w;
+
+	if (ls->history_file == NULL || (w = ls->history_file->writer) == NULL)
+		return 0;
+	pthread_mutex_lock(&w->lock);
+	stats->queued		= w->queued;
+	stats->queued_bytes = w->len;
+	stats->written		= w->written;
+	stats->batches		= w->batches;
+	stats->syncs		= w->syncs;
+	stats->errors		= w->errors;
+	pthread_mutex_unlock(&w->lock);
+	return 1;
+}
+
+/* Set the size in bytes past which the file opened with
+ * LinenoiseHistoryOpen() is compacted. Returns 0 if no file is open. */
+int LinenoiseHistorySetCompactSize(LinenoiseState *ls, size_t size)
+{
+	if (ls->history_file == NULL)
+		return 0;
+	ls->history_file->compact_size = size;
+	return 1;
+}
+
+/* ================================ History ================================= */
+
+/* A binary history file mapped in memory: the entries loaded from it point
+ * into the map instead of being copied, so it stays mapped as long as the
+ * state lives. */
+struct LinenoiseHistoryMap
+{
+	struct LinenoiseHistoryMap *next;
+	char *						base;
+	size_t						size;
+};
+
+/* Returns true if the history entry 'line' lives in a mapped binary file. */
+static bool HistoryEntryMapped(const LinenoiseState *ls, const char *line)
+{
+	struct LinenoiseHistoryMap *m;
+
+	for (m = ls->history_maps; m; m = m->next)
+		if (line >= m->base && line < m->base + m->size)
+			return true;
+	return false;
+}
+
+/* Returns a copy of the 'len' bytes 'line', a reference to the shared store
+ * if 'interned'. NULL on out of memory. */
+static char *HistoryEntryCopy(bool interned, const char *line, size_t len)
+{
+	return interned ? InternAcquire(line, len) : strndup(line, len);
+}
+
+/* Release a copy made by HistoryEntryCopy() with the same 'interned'. */
+static void HistoryEntryRelease(bool interned, char *line)
+{
+	if (interned)
+		InternRelease(line);
+	else
+		free(line);
+}
+
+/* Returns a new history entry holding the 'len' bytes 'line': a heap copy,
+ * or a reference to the shared store. NULL on out of memory. */
+static char *HistoryNewEntry(const LinenoiseState *ls, const char *line, size_t len)
+{
+	return HistoryEntryCopy(ls->history_interned, line, len);
+}
+
+/* Free an history entry, unless it lives in a mapped binary file. */
+static void HistoryFreeEntry(LinenoiseState *ls, char *line)
+{
+	if (!HistoryEntryMapped(ls, line))
+		HistoryEntryRelease(ls->history_interned, line);
+}
+
+/* Make the history entries point into the process-wide store shared by the
+ * sessions enabling it, or own private copies again. The entries already
+ * in the history are moved over. Returns 0 on out of memory, leaving the
+ * history as it was. */
+int LinenoiseHistorySetInterned(LinenoiseState *ls, int enable)
+{
+	char **lines;
+	int	   j;
+
+	if (!enable == !ls->history_interned)
+		return 1;
+	lines = malloc(sizeof(char *) * (ls->history_len ? ls->history_len : 1));
+	if (lines == NULL)
+		return 0;
+	for (j = 0; j < ls->history_len; j++)
+	{
+		char *line = ls->history[j];
+
+		lines[j] = HistoryEntryMapped(ls, line) ? line : HistoryEntryCopy(enable, line, strlen(line));
+		if (lines[j] == NULL)
+		{
+			while (j--)
+				if (lines[j] != ls->history[j])
+					HistoryEntryRelease(enable, lines[j]);
+			free(lines);
+			return 0;
+		}
+	}
+	for (j = 0; j < ls->history_len; j++)
+	{
+		HistoryFreeEntry(ls, ls->history[j]);
+		ls->history[j] = lines[j];
+	}
+	free(lines);
+	ls->history_interned = enable;
+	return 1;
+}
+
+static void HistoryMapsFree(LinenoiseState *ls)
+{
+	while (ls->history_maps)
+	{
+		struct LinenoiseHistoryMap *m = ls->history_maps;
+
+		ls->history_maps = m->next;
+		munmap(m->base, m->size);
+		free(m);
+	}
+}
+
+/* Free the history, but does not reset it. Only used when we have to
+ * exit() to avoid memory leaks are reported by valgrind & co. */
+static void FreeHistory(LinenoiseState *ls)
+{
+	if (ls->history)
+	{
+		int j;
+
+		for (j = 0; j < ls->history_len; j++)
+			HistoryFreeEntry(ls, ls->history[j]);
+
+		free(ls->history - ls->history_start);
+		free(ls->history_uses - ls->history_start);
+		free(ls->history_time - ls->history_start);
+		if (ls->history_columns)
+		{
+			ColumnsShift(ls->history_columns, -ls->history_start);
+			ColumnsFree(ls->history_columns);
+		}
+	}
+	ls->history = NULL;
+	ls->history_uses = ls->history_time = NULL;
+	ls->history_len = ls->history_start = ls->history_cap = 0;
+	ls->history_bytes = 0;
+	if (ls->history_trigrams)
+		TrigramIndexReset(ls->history_trigrams);
+	if (ls->history_prefixes)
+		ls->history_prefixes->dirty = true;
+	if (ls->history_seen)
+		ls->history_seen->dirty = true;
+}
+
+
+void LinenoiseFreeState(LinenoiseState *ls)
+{
+	int j;
+
+	CompletionCancel(ls);
+	LinenoiseSetCompletionCache(ls, 0, 0);
+	if (ls->completion_fd != -1)
+		close(ls->completion_fd);
+	if (ls->completion_wfd != -1 && ls->completion_wfd != ls->completion_fd)
+		close(ls->completion_wfd);
+	FreeHistory(ls);
+	HistoryColumnsFree(ls);
+	TrigramIndexFree(ls->history_trigrams);
+	PrefixIndexFree(ls->history_prefixes);
+	SeenIndexFree(ls->history_seen);
+	HistoryFileClose(ls);
+	HistoryRingDetach(ls);
+	HistoryMapsFree(ls);
+	for (j = 0; j < ls->history_edits_cap; j++)
+		free(ls->history_edits[j].line);
+	free(ls->history_edits);
+	free(ls->history_scratch);
+	free(ls->buf);
+	free((void *)ls->prompt);
+	free(ls);
+}
+
+/* At exit we'll try to fix the terminal to the initial conditions. */
+void LinenoiseRestore(LinenoiseState *ls)
+{
+	DisableRawMode(ls, ls->ifd);
+	tcsetattr(ls->ifd, TCSAFLUSH, &ls->orig_termios);
+	FreeHistory(ls);
+}
+
+/* Bytes accounted for a 'len' bytes long history entry: the string with
+ * its terminator and its slot in the history arrays. */
+static size_t HistoryEntryBytes(size_t len)
+{
+	return len + 1 + LINENOISE_HISTORY_ENTRY_OVERHEAD;
+}
+
+/* Room of the history arrays when they hold 'len' entries at most. The
+ * slack lets the entries slide forward for a while after evictions. */
+static int HistoryMaxCap(int len)
+{
+	return len + len / 2 + 1;
+}
+
+/* Move the history entries (and their columns) at the start of new arrays
+ * of 'cap' entries. Returns 0 on out of memory. */
+static int HistoryResize(LinenoiseState *ls, int cap)
+{
+	char **	  lines = malloc(sizeof(char *) * cap);
+	uint32_t *uses	= malloc(sizeof(uint32_t) * cap);
+	uint32_t *when	= malloc(sizeof(uint32_t) * cap);
+
+	if (lines == NULL || uses == NULL || when == NULL ||
+		(ls->history_columns && !ColumnsResize(ls->history_columns, cap, ls->history_start, ls->history_len)))
+	{
+		free(lines);
+		free(uses);
+		free(when);
+		return 0;
+	}
+	if (ls->history)
+	{
+		memcpy(lines, ls->history, sizeof(char *) * ls->history_len);
+		memcpy(uses, ls->history_uses, sizeof(uint32_t) * ls->history_len);
+		memcpy(when, ls->history_time, sizeof(uint32_t) * ls->history_len);
+		free(ls->history - ls->history_start);
+		free(ls->history_uses - ls->history_start);
+		free(ls->history_time - ls->history_start);
+	}
+	ls->history		  = lines;
+	ls->history_uses  = uses;
+	ls->history_time  = when;
+	ls->history_start = 0;
+	ls->history_cap	  = cap;
+	return 1;
+}
+
+/* Allocate the history arrays on first use. They start small and grow as
+ * entries are added. Returns 0 on out of memory. */
+static int HistoryInit(LinenoiseState *ls)
+{
+	int cap = HistoryMaxCap(ls->history_max_len);
+
+	if (ls->history)
+		return 1;
+	return HistoryResize(ls, cap < 64 ? cap : 64);
+}
+
+/* Make room in the history arrays for 'n' more entries past the top one.
+ * The entries are moved back to the start of the arrays when at least a
+ * third of them is free, so every entry is moved once per cap / 3 added
+ * ones, otherwise the arrays are grown. Returns 0 on out of memory. */
+static int HistoryReserve(LinenoiseState *ls, int n)
+{
+	int need = ls->history_len + n, cap;
+
+	if (!HistoryInit(ls))
+		return 0;
+	if (ls->history_start + need <= ls->history_cap)
+		return 1;
+	if (need * 3 <= ls->history_cap * 2)
+	{
+		memmove(ls->history - ls->history_start, ls->history, sizeof(char *) * ls->history_len);
+		memmove(ls->history_uses - ls->history_start, ls->history_uses, sizeof(uint32_t) * ls->history_len);
+		memmove(ls->history_time - ls->history_start, ls->history_time, sizeof(uint32_t) * ls->history_len);
+		ls->history -= ls->history_start;
+		ls->history_uses -= ls->history_start;
+		ls->history_time -= ls->history_start;
+		if (ls->history_columns)
+		{
+			ColumnsShift(ls->history_columns, -ls->history_start);
+			ColumnsCopy(ls->history_columns, 0, ls->history_columns, ls->history_start, ls->history_len);
+		}
+		ls->history_start = 0;
+		return 1;
+	}
+	cap = ls->history_cap * 2 > HistoryMaxCap(need) ? ls->history_cap * 2 : HistoryMaxCap(need);
+	if (cap > HistoryMaxCap(ls->history_max_len))
+		cap = HistoryMaxCap(ls->history_max_len);
+	return HistoryResize(ls, cap);
+}
+
+/* Remove the 'n' oldest entries of the history. The arrays just start 'n'
+ * entries further, so evicting costs nothing but freeing the entries. */
+static void HistoryEvict(LinenoiseState *ls, int n)
+{
+	int j;
+
+	if (n <= 0)
+		return;
+	HistoryIndexEvict(ls, n);
+	for (j = 0; j < n; j++)
+	{
+		ls->history_bytes -= HistoryEntryBytes(strlen(ls->history[j]));
+		HistoryFreeEntry(ls, ls->history[j]);
+	}
+	ls->history += n;
+	ls->history_uses += n;
+	ls->history_time += n;
+	if (ls->history_columns)
+		ColumnsShift(ls->history_columns, n);
+	ls->history_start += n;
+	ls->history_len -= n;
+}
+
+/* Evict the oldest entries until 'n' more entries, taking 'bytes' bytes
+ * as accounted by HistoryEntryBytes(), fit both the entry and the byte
+ * limits, and make room for them in the arrays. Returns 0 on out of
+ * memory. */
+static int HistoryMakeRoom(LinenoiseState *ls, int n, size_t bytes)
+{
+	int evict = ls->history_len + n - ls->history_max_len;
+
+	if (evict < 0)
+		evict = 0;
+	if (ls->history_max_bytes)
+	{
+		size_t used = ls->history_bytes;
+		int	   j;
+
+		for (j = 0; j < evict; j++)
+			used -= HistoryEntryBytes(strlen(ls->history[j]));
+		while (evict < ls->history_len && used + bytes > ls->history_max_bytes)
+			used -= HistoryEntryBytes(strlen(ls->history[evict++]));
+	}
+	HistoryEvict(ls, evict);
+	return HistoryReserve(ls, n);
+}
+
+/* Put the heap allocated 'line' on top of the history, that must have room
+ * for it. */
+static void HistoryPush(LinenoiseState *ls, char *line, uint32_t uses, uint32_t when)
+{
+	ls->history_bytes += HistoryEntryBytes(strlen(line));
+	ls->history[ls->history_len]	  = line;
+	ls->history_uses[ls->history_len] = uses;
+	ls->history_time[ls->history_len] = when;
+	if (ls->history_columns)
+		ColumnsClear(ls->history_columns, ls->history_len);
+	ls->history_len++;
+	HistoryIndexAdd(ls, line);
+	if (ls->history_file)
+		HistoryFileAdded(ls, line);
+}
+
+/* Add 'line', last used at 'when', to the history of this process only. */
+static int HistoryAddLocal(LinenoiseState *ls, const char *line, uint32_t when)
+{
+	char *	 linecopy;
+	uint32_t uses;
+
+	if (ls->history_max_len == 0)
+		return 0;
+
+	/* Initialization on first call. */
+	if (!HistoryInit(ls))
+		return 0;
+	if (ls->history_max_bytes && HistoryEntryBytes(strlen(line)) > ls->history_max_bytes)
+		return 0;
+
+	/* Don't add duplicated lines, just account for the new use. */
+	if (ls->history_len && !strcmp(ls->history[ls->history_len - 1], line))
+	{
+		if (ls->history_uses[ls->history_len - 1] < UINT32_MAX)
+			ls->history_uses[ls->history_len - 1]++;
+		ls->history_time[ls->history_len - 1] = when;
+		HistoryIndexUsed(ls);
+		return 0;
+	}
+
+	/* Add an heap allocated copy of the line in the history.
+	 * If we reached the max length, remove the older line. */
+	linecopy = HistoryNewEntry(ls, line, strlen(line));
+	if (!linecopy)
+		return 0;
+	uses = HistoryPreviousUses(ls, line);
+	if (!HistoryMakeRoom(ls, 1, HistoryEntryBytes(strlen(line))))
+	{
+		HistoryFreeEntry(ls, linecopy);
+		return 0;
+	}
+
+	HistoryPush(ls, linecopy, uses < UINT32_MAX ? uses + 1 : uses, when);
+	return 1;
+}
+
+/* This is the API call to add a new entry in the linenoise history.
+ * The entries are a window sliding over their arrays: evicting the oldest
+ * entry when the history max length is reached just advances the start of
+ * the window, and the entries are only moved back to the start of the
+ * arrays once the window reaches their end, so adding costs O(1) amortized
+ * whatever the history size. */
+int LinenoiseHistoryAdd(LinenoiseState *ls, const char *line)
+{
+	/* With a shared ring the line goes through it, and comes back in the
+	 * history in the same order the other processes see it. */
+	if (ls->history_ring && ls->history_max_len && HistoryRingPublish(ls, line) == 0)
+		return 1;
+	return HistoryAddLocal(ls, line, (uint32_t)time(NULL));
+}
+
+/* Set the maximum length for the history. This function can be called even
+ * if there is already some history, the function will make sure to retain
+ * just the latest 'len' elements if the new history length value is smaller
+ * than the amount of items already inside the history. */
+int LinenoiseHistorySetMaxLen(LinenoiseState *ls, int len)
+{
+	if (len < 1)
+		return 0;
+	if (ls->history)
+	{
+		/* If we can't keep everything, free the entries we'll not use. */
+		HistoryEvict(ls, ls->history_len - len);
+
+		/* Give back the memory of arrays bigger than needed now, keeping
+		 * them if the smaller ones can't be allocated. */
+		if (ls->history_cap > HistoryMaxCap(len))
+			HistoryResize(ls, HistoryMaxCap(len));
+	}
+
+	ls->history_max_len = len;
+	return 1;
+}
+
+/* Set the maximum number of bytes the history may take, as reported by
+ * LinenoiseHistoryGetBytes(), or 0 for no limit. The oldest entries are
+ * evicted until the history fits, and lines too long to fit alone are not
+ * added at all. The entry limit of LinenoiseHistorySetMaxLen() still
+ * applies. */
+int LinenoiseHistorySetMaxBytes(LinenoiseState *ls, size_t bytes)
+{
+	ls->history_max_bytes = bytes;
+	if (ls->history)
+		HistoryMakeRoom(ls, 0, 0);
+	return 1;
+}
+
+/* Returns the bytes taken by the history entries: their strings, with the
+ * terminator, and LINENOISE_HISTORY_ENTRY_OVERHEAD bytes each for their
+ * slots in the history arrays. */
+size_t LinenoiseHistoryGetBytes(const LinenoiseState *ls)
+{
+	return ls->history_bytes;
+}
+
+/* Start iterating over the history in 'order', a LinenoiseHistoryOrder,
+ * only visiting the entries starting with 'prefix' unless it is NULL. The
+ * prefix is not copied and must outlive the iteration. */
+void LinenoiseHistoryIterBegin(const LinenoiseState *ls, LinenoiseHistoryIter *it, int order, const char *prefix)
+{
+	it->ls		   = ls;
+	it->prefix	   = prefix;
+	it->prefix_len = prefix ? strlen(prefix) : 0;
+	it->step	   = order == LINENOISE_HISTORY_OLDEST_FIRST ? 1 : -1;
+	it->next	   = it->step > 0 ? 0 : ls->history_len - 1;
+	it->index	   = -1;
+}
+
+/* Point 'line' and 'len' to the next entry of the iteration, and its index
+ * to it->index. The entry stays owned by the history, nothing is copied.
+ * Returns 0 when there are no more entries. The history must not change
+ * during the iteration. */
+int LinenoiseHistoryIterNext(LinenoiseHistoryIter *it, const char **line, size_t *len)
+{
+	const LinenoiseState *ls = it->ls;
+
+	for (; it->next >= 0 && it->next < ls->history_len; it->next += it->step)
+	{
+		const char *entry = ls->history[it->next];
+
+		if (it->prefix_len && strncmp(entry, it->prefix, it->prefix_len))
+			continue;
+		it->index = it->next;
+		it->next += it->step;
+		*line = entry;
+		if (len)
+			*len = strlen(entry);
+		return 1;
+	}
+	return 0;
+}
+
+/* Save the history in the specified file. On success 0 is returned
+ * otherwise -1 is returned. */
+int LinenoiseHistorySave(const LinenoiseState *ls, const char *filename)
+{
+	mode_t old_umask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
+	FILE * fp;
+	int	   j;
+
+	fp = fopen(filename, "w");
+	umask(old_umask);
+	if (fp == NULL)
+		return -1;
+
+	chmod(filename, S_IRUSR | S_IWUSR);
+	for (j = 0; j < ls->history_len; j++)
+		fprintf(fp, "%s\n", ls->history[j]);
+
+	fclose(fp);
+	return 0;
+}
+
+#if defined(__APPLE__)
+/* Mac OS X libc has no memrchr(). */
+static void *memrchr(const void *s, int c, size_t n)
+{
+	const unsigned char *p = (const unsigned char *)s + n;
+
+	while (p != s)
+		if (*--p == (unsigned char)c)
+			return (void *)p;
+	return NULL;
+}
+#endif
+
+/* A line of the history file, still inside the file buffer. */
+struct HistoryRecord
+{
+	const char *line;
+	size_t		len;
+	uint32_t	uses;
+	uint32_t	time;
+};
+
+/* Put the 'n' records in 'recs', newest first, on top of the history in a
+ * single pass, evicting at once the old entries that don't fit anymore.
+ * The lines are copied, unless they live in a mapped binary history file.
+ * Returns -1 on out of memory. */
+static int HistoryInsert(LinenoiseState *ls, struct HistoryRecord *recs, int n, bool copy)
+{
+	size_t bytes = 0;
+	int	   j;
+
+	/* The oldest record may repeat the newest entry already there. */
+	if (n && ls->history_len)
+	{
+		const char *top = ls->history[ls->history_len - 1];
+
+		if (strlen(top) == recs[n - 1].len && !memcmp(top, recs[n - 1].line, recs[n - 1].len))
+		{
+			uint64_t uses = (uint64_t)ls->history_uses[ls->history_len - 1] + recs[n - 1].uses;
+
+			ls->history_uses[ls->history_len - 1] = uses < UINT32_MAX ? uses : UINT32_MAX;
+			n--;
+		}
+	}
+
+	/* With a byte limit, only the newest records that fit it are kept. */
+	for (j = 0; j < n; j++)
+	{
+		if (ls->history_max_bytes && bytes + HistoryEntryBytes(recs[j].len) > ls->history_max_bytes)
+			break;
+		bytes += HistoryEntryBytes(recs[j].len);
+	}
+	n = j;
+
+	/* Inserting every line in the sorted prefix index would cost a memmove
+	 * of the index each, just let it be rebuilt once when needed. */
+	if (!HistoryMakeRoom(ls, n, bytes))
+		return -1;
+	HistoryIndexChanged(ls);
+	for (j = n - 1; j >= 0; j--)
+	{
+		char *line = copy ? HistoryNewEntry(ls, recs[j].line, recs[j].len) : (char *)recs[j].line;
+
+		if (line == NULL)
+			return -1;
+		HistoryPush(ls, line, recs[j].uses, recs[j].time);
+	}
+	return 0;
+}
+
+/* Add to the history the last lines of the 'size' bytes long file content
+ * in 'buf', as if LinenoiseHistoryAdd() was called for every line of the
+ * file. Since only the last history_max_len lines can survive, the buffer
+ * is scanned backwards from its end and the older lines are never looked
+ * at. The lines found are then added in a single pass, evicting the old
+ * entries that don't fit anymore at once. Returns -1 on out of memory. */
+static int HistoryLoadTail(LinenoiseState *ls, const char *buf, size_t size, uint32_t when)
+{
+	struct HistoryRecord *recs;
+	size_t				  end = size;
+	int					  n = 0, ret;
+
+	if (ls->history_max_len == 0 || size == 0)
+		return 0;
+	if (!HistoryInit(ls))
+		return -1;
+	recs = malloc(sizeof(*recs) * ls->history_max_len);
+	if (recs == NULL)
+		return -1;
+
+	/* The newline terminating the last line does not start a new one. */
+	if (buf[end - 1] == '\n')
+		end--;
+
+	/* Collect the lines newest first. Adjacent duplicates are merged like
+	 * LinenoiseHistoryAdd() does, counting the uses. */
+	while (n < ls->history_max_len)
+	{
+		const char *nl	  = end ? memrchr(buf, '\n', end) : NULL;
+		size_t		start = nl ? (size_t)(nl - buf) + 1 : 0;
+		const char *line  = buf + start;
+		size_t		len	  = end - start;
+		const char *cr	  = memchr(line, '\r', len);
+
+		if (cr)
+			len = cr - line;
+		if (n && recs[n - 1].len == len && !memcmp(recs[n - 1].line, line, len))
+		{
+			if (recs[n - 1].uses < UINT32_MAX)
+				recs[n - 1].uses++;
+		}
+		else
+		{
+			recs[n].line = line;
+			recs[n].len	 = len;
+			recs[n].uses = 1;
+			recs[n].time = when;
+			n++;
+		}
+
+		if (nl == NULL)
+			break;
+		end = start - 1;
+	}
+
+	ret = HistoryInsert(ls, recs, n, true);
+	free(recs);
+	return ret;
+}
+
+/* Load the history reading 'fp' line by line, used when the file can't be
+ * mapped in memory, like pipes and special files. */
+static int HistoryLoadStream(LinenoiseState *ls, FILE *fp)
+{
+	char buf[LINENOISE_MAX_LINE];
+
+	while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL)
+	{
+		char *p;
+
+		p = strchr(buf, '\r');
+		if (!p)
+			p = strchr(buf, '\n');
+
+		if (p)
+			*p = '\0';
+		LinenoiseHistoryAdd(ls, buf);
+	}
+	return 0;
+}
+
+/* Load the history from the file open as 'fd', storing in 'size' how many
+ * bytes of it were read. The descriptor is left open. */
+static int HistoryLoadFd(LinenoiseState *ls, int fd, off_t *size)
+{
+	struct stat st;
+	void *		map;
+	int			ret;
+
+	*size = 0;
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (S_ISREG(st.st_mode) && st.st_size == 0)
+		return 0;
+
+	map = S_ISREG(st.st_mode) ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	if (map == MAP_FAILED)
+	{
+		FILE *fp;
+
+		fd = dup(fd);
+		if (fd == -1)
+			return -1;
+		fp = fdopen(fd, "r");
+		if (fp == NULL)
+		{
+			close(fd);
+			return -1;
+		}
+		ret = HistoryLoadStream(ls, fp);
+		fclose(fp);
+		return ret;
+	}
+
+	*size = st.st_size;
+	if ((size_t)st.st_size >= LINENOISE_BINARY_MAGIC_LEN &&
+		!memcmp(map, LINENOISE_BINARY_MAGIC, LINENOISE_BINARY_MAGIC_LEN))
+		return HistoryLoadBinary(ls, map, st.st_size);
+
+	ret = HistoryLoadTail(ls, map, st.st_size, (uint32_t)st.st_mtime);
+	munmap(map, st.st_size);
+	return ret;
+}
+
+/* Load the history from the specified file. Returns 0 on success, -1 on
+ * error, also when the file does not exist: errno is ENOENT then, and the
+ * history is left as it was.
+ *
+ * The file is mapped in memory and only its last history_max_len lines are
+ * parsed, so loading takes the same time however long the file grew. The
+ * entries loaded are stamped with the modification time of the file.
+ * Binary history files, see LinenoiseHistorySaveBinary(), are recognized
+ * and stay mapped. */
+int LinenoiseHistoryLoad(LinenoiseState *ls, const char *filename)
+{
+	int	  fd = open(filename, O_RDONLY);
+	off_t size;
+	int	  ret;
+
+	if (fd == -1)
+		return -1;
+	ret = HistoryLoadFd(ls, fd, &size);
+	close(fd);
+	return ret;
+}
+
+/* Write 'len' bytes to 'fd', retrying on short writes. */
+static int WriteAll(int fd, const char *buf, size_t len)
+{
+	while (len)
+	{
+		ssize_t n = write(fd, buf, len);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+/* Write the history entries from 'from' to the newest one to 'fd', one per
+ * line, with a single write so that they can't interleave with the lines
+ * appended by other processes. */
+static int HistoryWrite(const LinenoiseState *ls, int fd, int from)
+{
+	size_t len = 0, off = 0;
+	char * buf;
+	int	   j, ret;
+
+	for (j = from; j < ls->history_len; j++)
+		len += strlen(ls->history[j]) + 1;
+	if (len == 0)
+		return 0;
+	buf = malloc(len);
+	if (buf == NULL)
+		return -1;
+	for (j = from; j < ls->history_len; j++)
+	{
+		size_t l = strlen(ls->history[j]);
+
+		memcpy(buf + off, ls->history[j], l);
+		off += l;
+		buf[off++] = '\n';
+	}
+	ret = WriteAll(fd, buf, len);
+	free(buf);
+	return ret;
+}
+
+/* ============================= History import ============================= */
+
+/* LinenoiseHistoryImport() loads huge history archives keeping the newest
+ * distinct entries, with the number of times every one of them occurs as
+ * its use count. The mapped file is split in chunks starting after a
+ * newline, one per thread. Every thread finds the lines of its chunk with
+ * memchr() and collapses the repeated ones in hash tables of its own, one
+ * per partition of the hashes. Then every thread merges the tables of one
+ * partition, later chunks holding newer occurrences, and keeps its newest
+ * history_max_len distinct entries. Only those are sorted, once the newest
+ * history_max_len of them all are selected, and added to the history. */
+
+#define LINENOISE_IMPORT_MAX_THREADS 16
+#define LINENOISE_IMPORT_MIN_CHUNK (1024 * 1024)
+
+struct ImportEntry
+{
+	uint64_t hash;	/* 0 for empty slots. */
+	uint64_t off;	/* Offset of the newest occurrence. */
+	uint32_t len;	/* Length of the line. */
+	uint32_t count; /* Occurrences. */
+};
+
+struct ImportTable
+{
+	const char *		base; /* The mapped file. */
+	struct ImportEntry *slots;
+	size_t				cap, used; /* cap is a power of two. */
+	int					oom;
+};
+
+struct ImportJob
+{
+	struct ImportTable tables[LINENOISE_IMPORT_MAX_THREADS]; /* The lines of the chunk, by partition. */
+	struct ImportJob * jobs;								  /* Every job, there is one per partition. */
+	int				   njobs;
+	size_t			   start, end; /* The chunk. */
+	size_t			   keep, kept; /* Entries wanted and found in the merged partition. */
+	pthread_t		   thread;
+};
+
+/* Map the regular file 'filename' in memory, filling 'st'. An empty file
+ * is not mapped and sets 'map' to NULL. Returns -1 on error. */
+static int ImportMap(const char *filename, char **map, struct stat *st)
+{
+	int fd = open(filename, O_RDONLY);
+
+	*map = NULL;
+	if (fd == -1)
+		return -1;
+	if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode))
+	{
+		close(fd);
+		return -1;
+	}
+	if (st->st_size)
+	{
+		*map = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (*map == MAP_FAILED)
 		{
-			case ENTER: /* enter */
-				if (ls->history_len > 0)
-				{
-					ls->history_len--;
-					free(ls->history[ls->history_len]);
-				}
-				if (ls->mlmode)
-					LinenoiseEditMoveEnd(ls);
-				if (l_HintsCallback)
-				{
-					/* Force a refresh without hints to leave the previous
-					 * line as the user typed it after a newline. */
-					LinenoiseHintsCallback *hc = l_HintsCallback;
-					l_HintsCallback			   = NULL;
-					RefreshLine(ls);
-					l_HintsCallback = hc;
-				}
-				return (int)ls->len;
-			case CTRL_C: /* ctrl-c */
-				errno = EAGAIN;
-				return -1;
-			case BACKSPACE: /* backspace */
-			case 8:			/* ctrl-h */
-				LinenoiseEditBackspace(ls);
-				break;
-			case CTRL_D: /* ctrl-d, remove char at right of cursor, or if the
-							line is empty, act as end-of-file. */
-				if (ls->len > 0)
-					LinenoiseEditDelete(ls);
-				else
-				{
-					ls->history_len--;
-					free(ls->history[ls->history_len]);
-					return -1;
-				}
-				break;
-			case CTRL_T: /* ctrl-t, swaps current character with previous. */
-				if (ls->pos > 0 && ls->pos < ls->len)
-				{
-					int aux			 = ls->buf[ls->pos - 1];
-					ls->buf[ls->pos - 1] = ls->buf[ls->pos];
-					ls->buf[ls->pos]	 = aux;
-					if (ls->pos != ls->len - 1)
-						ls->pos++;
-					RefreshLine(ls);
-				}
-				break;
-			case CTRL_B: /* ctrl-b */
-				LinenoiseEditMoveLeft(ls);
-				break;
-			case CTRL_F: /* ctrl-f */
-				LinenoiseEditMoveRight(ls);
-				break;
-			case CTRL_P: /* ctrl-p */
-				LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_PREV);
-				break;
-			case CTRL_N: /* ctrl-n */
-				LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_NEXT);
+			*map = NULL;
+			close(fd);
+			return -1;
+		}
+		madvise(*map, st->st_size, MADV_SEQUENTIAL);
+	}
+	close(fd);
+	return 0;
+}
+
+/* Account for an occurrence of the 'len' bytes line at 'off', or of
+ * 'count' of them when merging tables. */
+static void ImportAdd(struct ImportTable *t, uint64_t hash, uint64_t off, uint32_t len, uint32_t count)
+{
+	size_t j;
+
+	if ((t->used + 1) * 2 > t->cap)
+	{
+		struct ImportEntry *old = t->slots;
+		size_t				oldcap = t->cap, k;
+
+		t->cap	 = oldcap ? oldcap * 2 : 1024;
+		t->slots = calloc(t->cap, sizeof(*t->slots));
+		if (t->slots == NULL)
+		{
+			t->slots = old;
+			t->cap	 = oldcap;
+			t->oom	 = 1;
+			return;
+		}
+		for (k = 0; k < oldcap; k++)
+		{
+			if (old[k].hash == 0)
+				continue;
+			for (j = old[k].hash & (t->cap - 1); t->slots[j].hash; j = (j + 1) & (t->cap - 1))
+				;
+			t->slots[j] = old[k];
+		}
+		free(old);
+	}
+
+	for (j = hash & (t->cap - 1); t->slots[j].hash; j = (j + 1) & (t->cap - 1))
+	{
+		struct ImportEntry *e = &t->slots[j];
+
+		if (e->hash == hash && e->len == len && !memcmp(t->base + e->off, t->base + off, len))
+		{
+			if (off > e->off)
+				e->off = off;
+			e->count = e->count + count < e->count ? UINT32_MAX : e->count + count;
+			return;
+		}
+	}
+	t->slots[j].hash  = hash;
+	t->slots[j].off	  = off;
+	t->slots[j].len	  = len;
+	t->slots[j].count = count;
+	t->used++;
+}
+
+/* The partition of a hash. The table slots use its low bits, this the high
+ * ones. */
+static int ImportPartition(uint64_t hash, int nparts) { return (int)(((hash >> 32) * (uint64_t)nparts) >> 32); }
+
+static void *ImportWork(void *arg)
+{
+	struct ImportJob *job  = arg;
+	const char *	  base = job->tables[0].base;
+	size_t			  pos  = job->start;
+
+	while (pos < job->end)
+	{
+		const char *nl	= memchr(base + pos, '\n', job->end - pos);
+		size_t		end = nl ? (size_t)(nl - base) : job->end;
+		const char *cr	= memchr(base + pos, '\r', end - pos);
+		size_t		len = (cr ? (size_t)(cr - base) : end) - pos;
+
+		if (len <= UINT32_MAX)
+		{
+			uint64_t			hash = HashBytes(base + pos, len);
+			struct ImportTable *tb	 = &job->tables[ImportPartition(hash, job->njobs)];
+
+			ImportAdd(tb, hash, pos, len, 1);
+			if (tb->oom)
 				break;
-			case ESC: /* escape sequence */
-				/* Read the next two bytes representing the escape sequence.
-				 * Use two calls to handle slow terminals returning the two
-				 * chars at different times. */
-				if (read(ls->ifd, seq, 1) == -1)
-					break;
-				if (read(ls->ifd, seq + 1, 1) == -1)
-					break;
+		}
+		pos = end + 1;
+	}
+	return NULL;
+}
 
-				/* ESC [ sequences. */
-				if (seq[0] == '[')
-				{
-					if (seq[1] >= '0' && seq[1] <= '9')
-					{
-						/* Extended escape, read additional byte. */
-						if (read(ls->ifd, seq + 2, 1) == -1)
-							break;
-						if (seq[2] == '~')
-						{
-							switch (seq[1])
-							{
-								case '3': /* Delete key. */
-									LinenoiseEditDelete(ls);
-									break;
-							}
-						}
-					}
-					else
-					{
-						switch (seq[1])
-						{
-							case 'A': /* Up */
-								LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_PREV);
-								break;
-							case 'B': /* Down */
-								LinenoiseEditHistoryNext(ls, LINENOISE_HISTORY_NEXT);
-								break;
-							case 'C': /* Right */
-								LinenoiseEditMoveRight(ls);
-								break;
-							case 'D': /* Left */
-								LinenoiseEditMoveLeft(ls);
-								break;
-							case 'H': /* Home */
-								LinenoiseEditMoveHome(ls);
-								break;
-							case 'F': /* End*/
-								LinenoiseEditMoveEnd(ls);
-								break;
-						}
-					}
-				}
+/* Move the 'k' newest of the 'n' entries of 'e' first, in any order. */
+static void ImportSelect(struct ImportEntry *e, size_t n, size_t k)
+{
+	size_t lo = 0, hi = n;
+
+	while (k > lo && k < hi)
+	{
+		size_t			   mid = lo + (hi - lo) / 2, store = lo, j;
+		uint64_t		   pivot = e[mid].off;
+		struct ImportEntry aux;
+
+		aux		  = e[mid];
+		e[mid]	  = e[hi - 1];
+		e[hi - 1] = aux;
+		for (j = lo; j < hi - 1; j++)
+		{
+			if (e[j].off > pivot)
+			{
+				aux		 = e[j];
+				e[j]	 = e[store];
+				e[store] = aux;
+				store++;
+			}
+		}
+		aux		  = e[store];
+		e[store]  = e[hi - 1];
+		e[hi - 1] = aux;
+		if (k <= store)
+			hi = store;
+		else
+			lo = store + 1;
+	}
+}
+
+/* Merge the tables of the partition of 'job' from every chunk, and keep its
+ * newest entries. */
+static void *ImportMergeWork(void *arg)
+{
+	struct ImportJob *  job = arg;
+	int					p	= (int)(job - job->jobs), t;
+	struct ImportTable *all = &job->jobs[0].tables[p];
+	size_t				j, k;
+
+	for (t = 1; t < job->njobs; t++)
+	{
+		struct ImportTable *tb = &job->jobs[t].tables[p];
+
+		all->oom |= tb->oom;
+		for (j = 0; j < tb->cap && !all->oom; j++)
+			if (tb->slots[j].hash)
+				ImportAdd(all, tb->slots[j].hash, tb->slots[j].off, tb->slots[j].len, tb->slots[j].count);
+		free(tb->slots);
+		tb->slots = NULL;
+	}
+	if (all->oom)
+		return NULL;
+	for (j = k = 0; j < all->cap; j++)
+		if (all->slots[j].hash)
+			all->slots[k++] = all->slots[j];
+	ImportSelect(all->slots, k, job->keep);
+	job->kept = k < job->keep ? k : job->keep;
+	return NULL;
+}
+
+/* Run 'work' on every job, each in a thread of its own if possible. */
+static void ImportRun(struct ImportJob *jobs, int njobs, void *(*work)(void *))
+{
+	int t, started = 0;
+
+	for (t = 1; t < njobs; t++)
+		if (pthread_create(&jobs[t].thread, NULL, work, &jobs[t]) == 0)
+			started |= 1 << t;
+	work(&jobs[0]);
+	for (t = 1; t < njobs; t++)
+	{
+		if (started & (1 << t))
+			pthread_join(jobs[t].thread, NULL);
+		else
+			work(&jobs[t]);
+	}
+}
+
+static int ImportCompare(const void *a, const void *b)
+{
+	const struct ImportEntry *x = a, *y = b;
+
+	return x->off < y->off ? 1 : x->off > y->off ? -1 : 0;
+}
+
+/* Import the whole history file 'filename', that can be huge, using up to
+ * 'threads' threads, or one per core if 0. Unlike LinenoiseHistoryLoad(),
+ * a line repeated anywhere in the file is added once, at the position of
+ * its newest occurrence. Returns 0 on success, -1 on error. */
+int LinenoiseHistoryImport(LinenoiseState *ls, const char *filename, int threads)
+{
+	struct ImportJob	  jobs[LINENOISE_IMPORT_MAX_THREADS];
+	struct ImportEntry *  best = NULL;
+	struct HistoryRecord *recs;
+	struct stat			  st;
+	char *				  map;
+	size_t				  size, j, k, n;
+	int					  t, p, ret = -1;
+
+	if (ImportMap(filename, &map, &st) == -1)
+		return -1;
+	size = st.st_size;
+	if (map == NULL || ls->history_max_len == 0)
+	{
+		if (map)
+			munmap(map, size);
+		return 0;
+	}
+	if (size >= LINENOISE_BINARY_MAGIC_LEN && !memcmp(map, LINENOISE_BINARY_MAGIC, LINENOISE_BINARY_MAGIC_LEN))
+	{
+		/* Binary files hold distinct entries already. */
+		munmap(map, size);
+		return LinenoiseHistoryLoad(ls, filename);
+	}
 
-				/* ESC O sequences. */
-				else if (seq[0] == 'O')
-				{
-					switch (seq[1])
-					{
-						case 'H': /* Home */
-							LinenoiseEditMoveHome(ls);
-							break;
-						case 'F': /* End*/
-							LinenoiseEditMoveEnd(ls);
-							break;
-					}
-				}
-				break;
-			default:
-				if (LinenoiseEditInsert(ls, c))
-					return -1;
-				break;
-			case CTRL_U: /* Ctrl+u, delete the whole line. */
-				ls->buf[0] = '\0';
-				ls->pos = ls->len = 0;
-				RefreshLine(ls);
-				break;
-			case CTRL_K: /* Ctrl+k, delete from current to end of line. */
-				ls->buf[ls->pos] = '\0';
-				ls->len	   = ls->pos;
-				RefreshLine(ls);
-				break;
-			case CTRL_A: /* Ctrl+a, go to the start of the line */
-				LinenoiseEditMoveHome(ls);
-				break;
-			case CTRL_E: /* ctrl+e, go to the end of the line */
-				LinenoiseEditMoveEnd(ls);
-				break;
-			case CTRL_L: /* ctrl+l, clear screen */
-				LinenoiseClearScreen(ls);
-				RefreshLine(ls);
-				break;
-			case CTRL_W: /* ctrl+w, delete previous word */
-				LinenoiseEditDeletePrevWord(ls);
-				break;
+	if (threads <= 0)
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if ((size_t)threads > size / LINENOISE_IMPORT_MIN_CHUNK)
+		threads = size / LINENOISE_IMPORT_MIN_CHUNK;
+	threads = threads < 1 ? 1 : threads > LINENOISE_IMPORT_MAX_THREADS ? LINENOISE_IMPORT_MAX_THREADS : threads;
+
+	/* Every chunk starts after the newline preceding its nominal start. */
+	memset(jobs, 0, sizeof(jobs));
+	for (t = 0; t < threads; t++)
+	{
+		size_t start = size / threads * t;
+
+		if (t)
+		{
+			const char *nl = memchr(map + start - 1, '\n', size - start + 1);
+
+			start = nl ? (size_t)(nl - map) + 1 : size;
 		}
+		for (p = 0; p < threads; p++)
+			jobs[t].tables[p].base = map;
+		jobs[t].jobs  = jobs;
+		jobs[t].njobs = threads;
+		jobs[t].keep  = ls->history_max_len;
+		jobs[t].start = start;
+		if (t)
+			jobs[t - 1].end = start > jobs[t - 1].start ? start : jobs[t - 1].start;
 	}
-	return ls->len;
+	jobs[threads - 1].end = size;
+
+	ImportRun(jobs, threads, ImportWork);
+	for (t = 0; t < threads; t++)
+		for (p = 0; p < threads; p++)
+			if (jobs[t].tables[p].oom)
+				goto out;
+	ImportRun(jobs, threads, ImportMergeWork);
+
+	/* Keep the newest distinct entries of every partition, newest first. */
+	for (p = k = 0; p < threads; p++)
+	{
+		if (jobs[0].tables[p].oom)
+			goto out;
+		k += jobs[p].kept;
+	}
+	best = malloc(sizeof(*best) * (k ? k : 1));
+	if (best == NULL)
+		goto out;
+	for (p = k = 0; p < threads; p++)
+	{
+		memcpy(best + k, jobs[0].tables[p].slots, sizeof(*best) * jobs[p].kept);
+		k += jobs[p].kept;
+	}
+	n = k < (size_t)ls->history_max_len ? k : (size_t)ls->history_max_len;
+	ImportSelect(best, k, n);
+	qsort(best, n, sizeof(*best), ImportCompare);
+	recs = malloc(sizeof(*recs) * (n ? n : 1));
+	if (recs == NULL || !HistoryInit(ls))
+	{
+		free(recs);
+		goto out;
+	}
+	for (j = 0; j < n; j++)
+	{
+		recs[j].line = map + best[j].off;
+		recs[j].len	 = best[j].len;
+		recs[j].uses = best[j].count;
+		recs[j].time = (uint32_t)st.st_mtime;
+	}
+	ret = HistoryInsert(ls, recs, n, true);
+	free(recs);
+
+out:
+	for (t = 0; t < threads; t++)
+		for (p = 0; p < threads; p++)
+			free(jobs[t].tables[p].slots);
+	free(best);
+	munmap(map, size);
+	return ret;
 }
 
-/* This special mode is used by linenoise in order to print scan codes
- * on screen for debugging / development purposes. It is implemented
- * by the linenoise_example program using the --keycodes option. */
-void LinenoisePrintKeyCodes(LinenoiseState *ls)
+/* The shell importers parse the file in a single pass, keeping only the
+ * last history_max_len commands in a ring of records pointing into the
+ * mapped file. Only the commands that survive are decoded and copied. */
+
+struct ShellImport
 {
-	char quit[4];
+	struct HistoryRecord *recs;		 /* Ring of the last commands. */
+	int					  max, n, next; /* Size, commands in the ring, next slot. */
+};
 
-	dprintf(ls->ofd,
-			"Linenoise key codes debugging mode.\n"
-			"Press keys to see scan codes. Type 'quit' at any time to exit.\n");
-	if (EnableRawMode(ls, ls->ifd) == -1)
-		return;
-	memset(quit, ' ', 4);
-	while (true)
+/* Record the 'len' bytes command at 'line', merging it with the previous
+ * one when they are the same like LinenoiseHistoryAdd() does. */
+static struct HistoryRecord *ShellImportAdd(struct ShellImport *im, const char *line, size_t len, uint32_t when)
+{
+	struct HistoryRecord *r;
+
+	if (len == 0)
+		return NULL;
+	if (im->n)
 	{
-		char c;
-		int	 nread;
+		r = &im->recs[(im->next + im->max - 1) % im->max];
+		if (r->len == len && !memcmp(r->line, line, len))
+		{
+			if (r->uses < UINT32_MAX)
+				r->uses++;
+			r->time = when;
+			return r;
+		}
+	}
+	r		 = &im->recs[im->next];
+	r->line	 = line;
+	r->len	 = len;
+	r->uses	 = 1;
+	r->time	 = when;
+	im->next = (im->next + 1) % im->max;
+	if (im->n < im->max)
+		im->n++;
+	return r;
+}
 
-		nread = read(ls->ifd, &c, 1);
-		if (nread <= 0)
-			continue;
+/* Parse the decimal number at 'p', before 'end', into 'value' if not NULL.
+ * Returns the first byte after it, or NULL if there are no digits. */
+static const char *ShellParseNumber(const char *p, const char *end, uint32_t *value)
+{
+	const char *start = p;
+	uint64_t	v	  = 0;
 
-		memmove(quit, quit + 1, sizeof(quit) - 1); /* shift string to left. */
-		quit[sizeof(quit) - 1] = c;				   /* Insert current char on the right. */
+	for (; p < end && *p >= '0' && *p <= '9'; p++)
+		if (v < UINT32_MAX)
+			v = v * 10 + (*p - '0');
+	if (p == start)
+		return NULL;
+	if (value)
+		*value = v < UINT32_MAX ? v : UINT32_MAX;
+	return p;
+}
 
-		if (memcmp(quit, "quit", sizeof(quit)) == 0)
+/* Bash writes a "#<time>" line before every command when HISTTIMEFORMAT is
+ * set. Commands without one get the time of the last seen. */
+static void ShellParseBash(struct ShellImport *im, const char *p, const char *end, uint32_t when)
+{
+	while (p < end)
+	{
+		const char *nl = memchr(p, '\n', end - p);
+		const char *e  = nl ? nl : end;
+		uint32_t	t;
+
+		if (*p == '#' && ShellParseNumber(p + 1, e, &t) == e)
+			when = t;
+		else
+			ShellImportAdd(im, p, e - p, when);
+		p = e + 1;
+	}
+}
+
+/* Zsh with EXTENDED_HISTORY writes ": <time>:<duration>;<command>". The
+ * newlines inside a command are escaped by a backslash, so the command
+ * goes on as long as its lines end with one. */
+static void ShellParseZsh(struct ShellImport *im, const char *p, const char *end, uint32_t when)
+{
+	while (p < end)
+	{
+		const char *cmd = p, *e = p, *q;
+		uint32_t	t	= when;
+
+		if (end - p > 2 && p[0] == ':' && p[1] == ' ' && (q = ShellParseNumber(p + 2, end, &t)) && q < end &&
+			*q == ':' && (q = ShellParseNumber(q + 1, end, NULL)) && q < end && *q == ';')
+			cmd = q + 1;
+		else
+			t = when;
+
+		for (;;)
+		{
+			const char *nl = memchr(e, '\n', end - e);
+
+			if (nl == NULL)
+			{
+				e = end;
+				break;
+			}
+			if (nl > cmd && nl[-1] == '\\')
+			{
+				e = nl + 1;
+				continue;
+			}
+			e = nl;
 			break;
+		}
+		ShellImportAdd(im, cmd, e - cmd, t);
+		p = e + 1;
+	}
+}
 
-		dprintf(ls->ofd, "'%c' %02x (%d) (type quit to exit)\n", isprint(c) ? c : '?', (int)c, (int)c);
-		dprintf(ls->ofd, "\r"); /* Go left edge manually, we are in raw mode. */
+/* Fish writes "- cmd: <command>" followed by an indented "  when: <time>"
+ * and possibly other fields, that are skipped. */
+static void ShellParseFish(struct ShellImport *im, const char *p, const char *end, uint32_t when)
+{
+	struct HistoryRecord *last = NULL;
+
+	while (p < end)
+	{
+		const char *nl	= memchr(p, '\n', end - p);
+		const char *e	= nl ? nl : end;
+		size_t		len = e - p;
+
+		if (len >= 7 && !memcmp(p, "- cmd: ", 7))
+			last = ShellImportAdd(im, p + 7, len - 7, when);
+		else if (len >= 8 && !memcmp(p, "  when: ", 8) && last)
+			ShellParseNumber(p + 8, e, &last->time);
+		p = e + 1;
 	}
-	DisableRawMode(ls, ls->ifd);
 }
 
-/* This function calls the line editing function linenoiseEdit() using
- * the STDIN file descriptor set in raw mode. */
-static int LinenoiseRaw(LinenoiseState *ls)
+/* Decode the 'len' bytes command at 'src' as written by the shell of
+ * 'format' into 'dst', that has room for 'len' bytes. Returns the length
+ * of the decoded command. */
+static size_t ShellDecode(int format, const char *src, size_t len, char *dst)
 {
-	int count;
+	size_t j, n = 0;
 
-	if (ls->buflen == 0)
+	for (j = 0; j < len; j++)
+	{
+		if (format == LINENOISE_HISTORY_ZSH && src[j] == '\\' && j + 1 < len && src[j + 1] == '\n')
+			dst[n++] = src[++j];
+		else if (format == LINENOISE_HISTORY_ZSH && (unsigned char)src[j] == 0x83 && j + 1 < len)
+			dst[n++] = src[++j] ^ 32; /* Metafied byte. */
+		else if (format == LINENOISE_HISTORY_FISH && src[j] == '\\' && j + 1 < len && src[j + 1] == '\\')
+			dst[n++] = src[++j];
+		else if (format == LINENOISE_HISTORY_FISH && src[j] == '\\' && j + 1 < len && src[j + 1] == 'n')
+		{
+			dst[n++] = '\n';
+			j++;
+		}
+		else
+			dst[n++] = src[j];
+	}
+	return n;
+}
+
+/* Import the history file 'filename' of another shell, 'format' being one
+ * of LINENOISE_HISTORY_BASH, LINENOISE_HISTORY_ZSH or LINENOISE_HISTORY_FISH.
+ * The commands keep the time they were run at, when the file records it,
+ * and are added at once on top of the history. Returns 0 on success, -1 on
+ * error. */
+int LinenoiseHistoryImportShell(LinenoiseState *ls, const char *filename, int format)
+{
+	struct ShellImport	  im;
+	struct HistoryRecord *recs;
+	struct stat			  st;
+	char *				  map, *buf;
+	size_t				  total = 0, off = 0;
+	int					  j, ret = -1;
+
+	if (format != LINENOISE_HISTORY_BASH && format != LINENOISE_HISTORY_ZSH && format != LINENOISE_HISTORY_FISH)
 	{
 		errno = EINVAL;
 		return -1;
 	}
+	if (ImportMap(filename, &map, &st) == -1)
+		return -1;
+	if (map == NULL || ls->history_max_len == 0)
+	{
+		if (map)
+			munmap(map, st.st_size);
+		return 0;
+	}
 
-	if (EnableRawMode(ls, ls->ifd) == -1)
+	memset(&im, 0, sizeof(im));
+	im.max	= ls->history_max_len;
+	im.recs = malloc(sizeof(*im.recs) * im.max);
+	if (im.recs == NULL)
+	{
+		munmap(map, st.st_size);
 		return -1;
-	count = LinenoiseEdit(ls);
-	DisableRawMode(ls, ls->ifd);
-	dprintf(ls->ofd, "\n");
-	return count;
+	}
+	if (format == LINENOISE_HISTORY_BASH)
+		ShellParseBash(&im, map, map + st.st_size, (uint32_t)st.st_mtime);
+	else if (format == LINENOISE_HISTORY_ZSH)
+		ShellParseZsh(&im, map, map + st.st_size, (uint32_t)st.st_mtime);
+	else
+		ShellParseFish(&im, map, map + st.st_size, (uint32_t)st.st_mtime);
+
+	/* Decode the commands left, newest first as HistoryInsert() wants. */
+	for (j = 0; j < im.n; j++)
+		total += im.recs[j].len;
+	buf	 = malloc(total ? total : 1);
+	recs = malloc(sizeof(*recs) * (im.n ? im.n : 1));
+	if (buf && recs && HistoryInit(ls))
+	{
+		for (j = 0; j < im.n; j++)
+		{
+			recs[j]		 = im.recs[(im.next + im.max - 1 - j) % im.max];
+			recs[j].len	 = ShellDecode(format, recs[j].line, recs[j].len, buf + off);
+			recs[j].line = buf + off;
+			off += recs[j].len;
+		}
+		ret = HistoryInsert(ls, recs, im.n, true);
+	}
+	free(recs);
+	free(buf);
+	free(im.recs);
+	munmap(map, st.st_size);
+	return ret;
 }
 
-/* This function is called when linenoise() is called with the standard
- * input file descriptor not attached to a TTY. So for example when the
- * program using linenoise is called in pipe or with a file redirected
- * to its standard input. In this case, we want to be able to return the
- * line regardless of its length (by default we are limited to 4k). */
-static char *LinenoiseNoTTY(void)
+/* =========================== Binary history file ========================== */
+
+/* The binary history format keeps entries that contain newlines intact and
+ * can be loaded without parsing: the file is mapped and the entries point
+ * straight into it, so only the pages of the entries actually shown are
+ * ever read. All the integers are in the byte order of the machine.
+ *
+ *   header  struct LinenoiseBinaryHeader
+ *   records struct LinenoiseBinaryRecord, the entry and a null term,
+ *           padded to a multiple of 8 bytes
+ *   index   struct LinenoiseBinaryBlock, then a LinenoiseBinaryEntry for
+ *           every record written together with it
+ *
+ * Appending writes the new records followed by an index block for them,
+ * linked to the previous block, and commits them by updating the header
+ * last: a crash before that only leaves garbage after the committed data.
+ * Loading walks the blocks from the newest one until the history is full.
+ * Every entry must end with its null term before its block, and the block
+ * headers must have their zeroes, so that the entries of a corrupted file
+ * can't run past the end of the map: the first block failing the checks
+ * ends the walk. */
+
+#define LINENOISE_BINARY_ORDER 0x01020304
+#define LINENOISE_BINARY_VERSION 1
+#define LINENOISE_BINARY_ALIGN(x) (((x) + 7) & ~(uint64_t)7)
+
+struct LinenoiseBinaryHeader
 {
-	char * line = NULL;
-	size_t len = 0, maxlen = 0;
+	char	 magic[LINENOISE_BINARY_MAGIC_LEN];
+	uint32_t order;	  /* LINENOISE_BINARY_ORDER, to detect the byte order. */
+	uint32_t version; /* LINENOISE_BINARY_VERSION. */
+	uint64_t count;	  /* Entries in the file. */
+	uint64_t index;	  /* Offset of the newest index block, 0 if none. */
+};
 
-	while (true)
+struct LinenoiseBinaryRecord
+{
+	uint32_t len;  /* Length of the entry. */
+	uint32_t uses; /* Use count and last use when the record was written. */
+	uint32_t time;
+	uint32_t reserved;
+};
+
+struct LinenoiseBinaryBlock
+{
+	uint64_t prev;	   /* Offset of the previous index block, 0 if none. */
+	uint32_t count;	   /* Entries in this block. */
+	uint32_t reserved; /* Zero. */
+};
+
+struct LinenoiseBinaryEntry
+{
+	uint64_t offset; /* Offset of the record. */
+	uint32_t len;	 /* Copy of the record fields, so that loading does */
+	uint32_t uses;	 /* not have to touch the records. */
+	uint32_t time;
+	uint32_t reserved;
+};
+
+static bool BinaryHeaderValid(const struct LinenoiseBinaryHeader *hdr)
+{
+	return !memcmp(hdr->magic, LINENOISE_BINARY_MAGIC, LINENOISE_BINARY_MAGIC_LEN) &&
+		   hdr->order == LINENOISE_BINARY_ORDER && hdr->version == LINENOISE_BINARY_VERSION;
+}
+
+/* Load the history from the binary file mapped at 'map', taking ownership
+ * of the map. A corrupted block ends the walk, keeping the newer entries
+ * already collected. Returns -1 if the header is not valid or on out of
+ * memory. */
+static int HistoryLoadBinary(LinenoiseState *ls, char *map, size_t size)
+{
+	const struct LinenoiseBinaryHeader *hdr = (const void *)map;
+	struct LinenoiseHistoryMap *		m;
+	struct HistoryRecord *				recs = NULL;
+	uint64_t							block, limit = size;
+	int									n = 0, ret = -1;
+
+	if (size < sizeof(*hdr) || !BinaryHeaderValid(hdr))
+		goto out;
+	if (ls->history_max_len == 0 || hdr->count == 0)
 	{
-		if (len == maxlen)
+		ret = 0;
+		goto out;
+	}
+	if (!HistoryInit(ls) || (recs = malloc(sizeof(*recs) * ls->history_max_len)) == NULL)
+		goto out;
+
+	/* Collect the entries newest first, checking that every block comes
+	 * before the one visited previously and every record before its block. */
+	block = hdr->index;
+	while (block && n < ls->history_max_len)
+	{
+		const struct LinenoiseBinaryBlock *b;
+		const struct LinenoiseBinaryEntry *e;
+		int64_t							   k;
+		int								   first = n;
+
+		if (block % 8 || block < sizeof(*hdr) || block > limit || limit - block < sizeof(*b))
+			break;
+		b = (const void *)(map + block);
+		e = (const void *)(b + 1);
+		if (b->reserved != 0 || b->count > (limit - block - sizeof(*b)) / sizeof(*e))
+			break;
+		for (k = (int64_t)b->count - 1; k >= 0 && n < ls->history_max_len; k--)
 		{
-			if (maxlen == 0)
-				maxlen = 16;
-			maxlen *= 2;
-			char *oldval = line;
-			line		 = realloc(line, maxlen);
-			if (line == NULL)
-			{
-				if (oldval)
-					free(oldval);
-				return NULL;
-			}
+			const uint64_t rec = sizeof(struct LinenoiseBinaryRecord);
+
+			/* The entry and its null term must fit before the block. */
+			if (e[k].offset < sizeof(*hdr) || e[k].offset > block || block - e[k].offset < rec + 1 ||
+				e[k].len > block - e[k].offset - rec - 1 || map[e[k].offset + rec + e[k].len] != '\0')
+				break;
+			recs[n].line = map + e[k].offset + rec;
+			recs[n].len	 = e[k].len;
+			recs[n].uses = e[k].uses;
+			recs[n].time = e[k].time;
+			n++;
 		}
-		int c = fgetc(stdin);
-		if (c == EOF || c == '\n')
+		if (k >= 0 && n < ls->history_max_len)
 		{
-			if (c == EOF && len == 0)
-			{
-				free(line);
-				return NULL;
-			}
-			else
-			{
-				line[len] = '\0';
-				return line;
-			}
+			n = first;
+			break;
+		}
+		limit = block;
+		block = b->prev;
+	}
+
+	m = malloc(sizeof(*m));
+	if (m == NULL)
+		goto out;
+	m->base			 = map;
+	m->size			 = size;
+	m->next			 = ls->history_maps;
+	ls->history_maps = m;
+	ret				 = HistoryInsert(ls, recs, n, false);
+	free(recs);
+	return ret;
+
+out:
+	free(recs);
+	munmap(map, size);
+	return ret;
+}
+
+/* Like WriteAll(), at the given offset. */
+static int PWriteAll(int fd, const char *buf, size_t len, off_t off)
+{
+	while (len)
+	{
+		ssize_t n = pwrite(fd, buf, len, off);
+
+		if (n == -1)
+		{
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+		off += n;
+	}
+	return 0;
+}
+
+/* Append to the binary history file 'fd', that must not be in O_APPEND
+ * mode, the history entries from 'from' to the newest one. An empty file
+ * gets its header first. The caller locks a file other processes may
+ * append to. Returns 0 on success, -1 on error. */
+static int HistoryAppendBinary(const LinenoiseState *ls, int fd, int from)
+{
+	struct LinenoiseBinaryHeader hdr;
+	struct LinenoiseBinaryBlock *b;
+	struct LinenoiseBinaryEntry *e;
+	struct stat					 st;
+	uint64_t					 end, len = 0, off = 0;
+	char *						 buf;
+	int							 j, n = ls->history_len - from, ret;
+
+	if (fstat(fd, &st) == -1)
+		return -1;
+	if (st.st_size == 0)
+	{
+		memset(&hdr, 0, sizeof(hdr));
+		memcpy(hdr.magic, LINENOISE_BINARY_MAGIC, LINENOISE_BINARY_MAGIC_LEN);
+		hdr.order	= LINENOISE_BINARY_ORDER;
+		hdr.version = LINENOISE_BINARY_VERSION;
+		if (PWriteAll(fd, (const char *)&hdr, sizeof(hdr), 0) == -1)
+			return -1;
+		end = sizeof(hdr);
+	}
+	else
+	{
+		if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || !BinaryHeaderValid(&hdr))
+			return -1;
+		end = LINENOISE_BINARY_ALIGN((uint64_t)st.st_size);
+	}
+	if (n <= 0)
+		return 0;
+
+	/* Format the records and their index block in a single buffer. */
+	for (j = from; j < ls->history_len; j++)
+		len += LINENOISE_BINARY_ALIGN(sizeof(struct LinenoiseBinaryRecord) + strlen(ls->history[j]) + 1);
+	len += sizeof(*b) + sizeof(*e) * n;
+	buf = calloc(1, len);
+	if (buf == NULL)
+		return -1;
+	e = (struct LinenoiseBinaryEntry *)(buf + len - sizeof(*e) * n);
+	b = (struct LinenoiseBinaryBlock *)e - 1;
+	for (j = 0; j < n; j++)
+	{
+		struct LinenoiseBinaryRecord *r	   = (struct LinenoiseBinaryRecord *)(buf + off);
+		const char *				  line = ls->history[from + j];
+
+		r->len	= strlen(line);
+		r->uses = ls->history_uses[from + j];
+		r->time = ls->history_time[from + j];
+		memcpy(r + 1, line, r->len);
+		e[j].offset = end + off;
+		e[j].len	= r->len;
+		e[j].uses	= r->uses;
+		e[j].time	= r->time;
+		off += LINENOISE_BINARY_ALIGN(sizeof(*r) + r->len + 1);
+	}
+	b->prev	 = hdr.index;
+	b->count = n;
+
+	/* Commit the new entries only once they are on disk, or the header
+	 * could reach it before them. */
+	ret = PWriteAll(fd, buf, len, end);
+	free(buf);
+	if (ret == -1 || fdatasync(fd) == -1)
+		return -1;
+	hdr.count += n;
+	hdr.index = end + off;
+	return PWriteAll(fd, (const char *)&hdr, sizeof(hdr), 0);
+}
+
+/* Write 'ls' to a temporary file then rename it to 'filename', in the
+ * binary format if 'binary' is true. Replacing the file instead of
+ * rewriting it keeps the processes that mapped it safe. The descriptor
+ * returned is locked if the history file of 'ls' is shared. */
+static int HistoryReplaceFile(const LinenoiseState *ls, const char *filename, bool binary)
+{
+	size_t len = strlen(filename);
+	char * tmp = malloc(len + 8);
+	int	   fd;
+
+	if (tmp == NULL)
+		return -1;
+	memcpy(tmp, filename, len);
+	memcpy(tmp + len, ".XXXXXX", 8);
+	fd = mkstemp(tmp);
+	if (fd == -1)
+	{
+		free(tmp);
+		return -1;
+	}
+
+	/* A shared file is locked from the moment it appears under its name,
+	 * until the caller appended to it. */
+	fchmod(fd, S_IRUSR | S_IWUSR);
+	if ((binary ? HistoryAppendBinary(ls, fd, 0) : HistoryWrite(ls, fd, 0)) == -1 || fsync(fd) == -1 ||
+		(ls->history_file && ls->history_file->shared && flock(fd, LOCK_EX) == -1) || rename(tmp, filename) == -1)
+	{
+		close(fd);
+		unlink(tmp);
+		free(tmp);
+		return -1;
+	}
+	free(tmp);
+	return fd;
+}
+
+/* Save the history in the specified file in the binary format, that is
+ * loaded by LinenoiseHistoryLoad() without parsing it, and can be appended
+ * to with LinenoiseHistoryOpen(). On success 0 is returned otherwise -1 is
+ * returned. */
+int LinenoiseHistorySaveBinary(const LinenoiseState *ls, const char *filename)
+{
+	int fd = HistoryReplaceFile(ls, filename, true);
+
+	if (fd == -1)
+		return -1;
+	close(fd);
+	return 0;
+}
+
+/* Read the whole history file 'from' and save it in 'to', in the binary
+ * format if 'binary' is true or as text otherwise. The converted history
+ * keeps every entry regardless of the history length, but it is loaded like
+ * any history, so adjacent duplicates are merged into one entry. */
+static int HistoryConvert(const char *from, const char *to, bool binary)
+{
+	LinenoiseState tmp;
+	struct stat	   st;
+	char *		   map;
+	uint64_t	   count = 0;
+	int			   fd, ret;
+
+	/* Count the entries to size the history. */
+	fd = open(from, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1)
+	{
+		if (fd != -1)
+			close(fd);
+		return -1;
+	}
+	map = st.st_size ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+	close(fd);
+	if (map == MAP_FAILED)
+		return -1;
+	if ((size_t)st.st_size >= sizeof(struct LinenoiseBinaryHeader) &&
+		!memcmp(map, LINENOISE_BINARY_MAGIC, LINENOISE_BINARY_MAGIC_LEN))
+		count = ((struct LinenoiseBinaryHeader *)map)->count;
+	else
+	{
+		const char *p = map, *end = map + st.st_size;
+
+		while (p < end && (p = memchr(p, '\n', end - p)) != NULL)
+		{
+			count++;
+			p++;
 		}
+		count++;
+	}
+	if (map)
+		munmap(map, st.st_size);
+	if (count >= INT_MAX)
+		return -1;
+
+	memset(&tmp, 0, sizeof(tmp));
+	tmp.history_max_len = count ? count : 1;
+	ret					= LinenoiseHistoryLoad(&tmp, from);
+	if (ret == 0)
+	{
+		if (binary)
+			ret = LinenoiseHistorySaveBinary(&tmp, to);
 		else
 		{
-			line[len] = c;
-			len++;
+			fd = HistoryReplaceFile(&tmp, to, false);
+			ret = fd == -1 ? -1 : close(fd);
 		}
 	}
+	FreeHistory(&tmp);
+	HistoryMapsFree(&tmp);
+	return ret;
 }
 
-void LinenoiseSetNonblock(const LinenoiseState *ls)
+/* Convert the text history file 'from' to the binary file 'to'. Returns 0
+ * on success, -1 on error. */
+int LinenoiseHistoryTextToBinary(const char *from, const char *to)
 {
-	int flags = 0;
-	if ((flags = fcntl(ls->ifd, F_GETFL, 0)) < 0)
-	{
-		dprintf(ls->efd, "Error calling fcntl in %s: %s\n", __FUNCTION__, strerror(errno));
-	}
+	return HistoryConvert(from, to, true);
 }
 
-LinenoiseState *LinenoiseCreate(int ls_stdin, int ls_stdout, int ls_stderr, const char *prompt)
+/* Convert the binary history file 'from' to the text file 'to'. Entries
+ * containing newlines will be split. Returns 0 on success, -1 on error. */
+int LinenoiseHistoryBinaryToText(const char *from, const char *to)
 {
-	LinenoiseState *ls = malloc(sizeof(LinenoiseState));
-	if (!ls)
-		return NULL;
+	return HistoryConvert(from, to, false);
+}
 
-	memset(ls, 0, sizeof(LinenoiseState));
+/* ======================== Shared memory history ring ====================== */
 
-	/* Populate the linenoise state that we pass to functions implementing
-	 * specific editing functionalities. */
-	ls->ifd	   = ls_stdin;
-	ls->ofd	   = ls_stdout;
-	ls->efd	   = ls_stderr;
-	ls->buf	   = malloc(LINENOISE_MAX_LINE);
-	ls->buflen = LINENOISE_MAX_LINE;
-	ls->prompt = strdup(prompt);
-	ls->plen   = strlen(prompt);
-	ls->oldpos = ls->pos = 0;
-	ls->len				 = 0;
-	ls->cols			 = GetColumns(ls_stdin, ls_stdout);
-	ls->maxrows			 = 0;
-	ls->history_index	 = 0;
-	ls->mlmode = false;
-	ls->rawmode = false;
-	ls->nonblock = false;
-	ls->history = NULL;
-	ls->history_len = 0;
-	ls->history_max_len = LINENOISE_DEFAULT_HISTORY_MAX_LEN;
+/* Many short lived processes on the same host can share their history
+ * through a ring buffer in shared memory, without any file to parse. Every
+ * process appends its entries to the ring, reserving the space with an
+ * atomic add on the head, and pulls the entries of the others at every
+ * prompt. The head only grows, so the position of a record in the ring is
+ * its offset modulo the ring size.
+ *
+ * A record is committed by storing its offset in its header last: readers
+ * stop at a record whose header does not carry the expected offset, as it
+ * is still being written or belongs to a previous lap of the ring. After
+ * copying a record they check the head again, to detect a writer that
+ * lapped them meanwhile. A reader that falls too far behind looks for the
+ * first record that is still whole. */
+
+#define LINENOISE_DEFAULT_RING_SIZE (1024 * 1024)
+#define LINENOISE_RING_PUBLISH_TRIES 8	/* Pulls waiting for the records before ours. */
+#define LINENOISE_RING_ATTACH_WAIT 1000 /* Milliseconds to wait for the creator of a ring. */
+#define LINENOISE_RING_MAGIC "LNRING01"
+#define LINENOISE_RING_ALIGN(x) (((x) + 15) & ~(uint64_t)15)
+
+struct LinenoiseRingHeader
+{
+	char			 magic[8];
+	_Atomic uint32_t state; /* 2 once its creator initialized it. */
+	uint32_t		 size;	/* Bytes of the data area, a multiple of 16. */
+	_Atomic uint64_t head;	/* Bytes ever reserved. */
+};
 
-	/* Buffer starts empty. */
-	memset(ls->buf, 0, ls->buflen);
-	ls->buflen--; /* Make sure there is always space for the nulterm */
+struct LinenoiseRingRecord
+{
+	_Atomic uint64_t offset; /* Where the record starts, stored last. */
+	uint32_t		 len;	 /* Length of the entry that follows. */
+	uint32_t		 time;	 /* When it was added. */
+};
 
-	/* The latest history entry is always our current buffer, that
-	 * initially is just an empty string. */
-	LinenoiseHistoryAdd(ls, "");
+/* One of our records not pulled yet. */
+struct LinenoiseRingMine
+{
+	uint64_t offset;
+	bool	 local; /* It was added to the history directly. */
+};
 
-	return ls;
-}
+struct LinenoiseHistoryRing
+{
+	struct LinenoiseRingHeader *hdr;
+	unsigned char *				data;
+	size_t						mapsize;
+	uint64_t					tail;  /* Offset of the next record to read. */
+	struct LinenoiseRingMine *	mine;  /* Our records not pulled yet, oldest first. */
+	size_t						nmine; /* Used and allocated in 'mine'. */
+	size_t						capmine;
+};
 
-/* The high level function that is the main API of the linenoise library.
- * This function checks if the terminal has basic capabilities, just checking
- * for a blacklist of stupid terminals, and later either calls the line
- * editing function or uses dummy fgets() so that you will be able to type
- * something even in the most desperate of the conditions. */
-char *Linenoise(LinenoiseState *ls)
+/* Copy 'len' bytes from the ring at offset 'off', that may wrap. */
+static void RingCopy(const struct LinenoiseHistoryRing *r, char *dst, uint64_t off, size_t len)
 {
-	int	 count;
-	ls->buf[0] = '\0';
+	size_t pos	 = off % r->hdr->size;
+	size_t first = r->hdr->size - pos < len ? r->hdr->size - pos : len;
 
-	if (!isatty(ls->ifd))
+	memcpy(dst, r->data + pos, first);
+	memcpy(dst + first, r->data, len - first);
+}
+
+/* Find the first committed record at or after 'off', used when we don't
+ * know where the records start. Never goes back before the tail, whose
+ * records were read already. */
+static uint64_t RingResync(const struct LinenoiseHistoryRing *r, uint64_t off, uint64_t head)
+{
+	if (off < r->tail)
+		off = r->tail;
+	for (off = LINENOISE_RING_ALIGN(off); off < head; off += 16)
 	{
-		/* Not a tty: read from file / pipe. In this mode we don't want any
-		 * limit to the line size, so we call a function to handle that. */
-		return LinenoiseNoTTY();
+		struct LinenoiseRingRecord *rec = (void *)(r->data + off % r->hdr->size);
+
+		if (atomic_load_explicit(&rec->offset, memory_order_acquire) == off)
+			return off;
 	}
-	else if (IsUnsupportedTerm())
+	return head;
+}
+
+/* Remove the oldest of our records not pulled yet. */
+static void RingForgetMine(struct LinenoiseHistoryRing *r)
+{
+	r->nmine--;
+	memmove(r->mine, r->mine + 1, sizeof(*r->mine) * r->nmine);
+}
+
+/* Add 'line', a record published by another process, to the history. It
+ * is in the history file of that process already, if any, so it must not
+ * be appended to ours. The entries of ours not appended yet have to stay
+ * the newest ones for LinenoiseHistoryAppend() to find them: append them
+ * first. */
+static void HistoryRingAddForeign(LinenoiseState *ls, const char *line, uint32_t when)
+{
+	struct LinenoiseHistoryFile *hf = ls->history_file;
+
+	if (hf && hf->unsaved)
+		LinenoiseHistoryAppend(ls);
+	ls->history_file = NULL;
+	HistoryAddLocal(ls, line, when);
+	ls->history_file = hf;
+}
+
+/* Add to the history the records appended to the ring since the last pull,
+ * ours included. */
+static void HistoryRingPull(LinenoiseState *ls)
+{
+	struct LinenoiseHistoryRing *r = ls->history_ring;
+	uint64_t					 head;
+	char *						 line = NULL;
+	size_t						 cap  = 0;
+
+	head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+	if (head - r->tail > r->hdr->size)
+		r->tail = RingResync(r, head - r->hdr->size, head);
+
+	while (r->tail < head)
 	{
-		size_t len;
+		struct LinenoiseRingRecord *rec = (void *)(r->data + r->tail % r->hdr->size);
+		uint32_t					len, when;
 
-		dprintf(ls->ofd, "%s", ls->prompt);
-		if (fgets(ls->buf, ls->buflen, stdin) == NULL)
-			return NULL;
+		if (atomic_load_explicit(&rec->offset, memory_order_acquire) != r->tail)
+		{
+			/* Still being written, unless its writer died long ago: then
+			 * skip just that record, its length may not even be there. */
+			if (head - r->tail > r->hdr->size / 2)
+			{
+				r->tail = RingResync(r, r->tail + 16, head);
+				continue;
+			}
+			break;
+		}
+		len	 = rec->len;
+		when = rec->time;
+		if (len > r->hdr->size / 4)
+		{
+			r->tail = RingResync(r, r->tail + 16, head);
+			continue;
+		}
+		if (len + 1 > cap)
+		{
+			char *p = realloc(line, len + 1);
 
-		len = strlen(ls->buf);
-		while (len && (ls->buf[len - 1] == '\n' || ls->buf[len - 1] == '\r'))
+			if (p == NULL)
+				break;
+			line = p;
+			cap	 = len + 1;
+		}
+		RingCopy(r, line, r->tail + sizeof(*rec), len);
+		line[len] = '\0';
+
+		/* If a writer reserved space past a lap from the record while we
+		 * were copying it, what we read may be garbage. */
+		atomic_thread_fence(memory_order_acquire);
+		head = atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+		if (head - r->tail > r->hdr->size)
 		{
-			len--;
-			ls->buf[len] = '\0';
+			r->tail = RingResync(r, head - r->hdr->size, head);
+			continue;
 		}
-		dprintf(ls->ofd, "\r");
-		return strdup(ls->buf);
-	}
-	else
-	{
-		count = LinenoiseRaw(ls);
-		if (count == -1)
-			return NULL;
-		dprintf(ls->ofd, "\r");
-		return strdup(ls->buf);
+
+		/* Our records come back in the order we published them, those
+		 * before the tail were skipped. */
+		while (r->nmine && r->mine[0].offset < r->tail)
+			RingForgetMine(r);
+		if (r->nmine && r->mine[0].offset == r->tail)
+		{
+			if (!r->mine[0].local)
+				HistoryAddLocal(ls, line, when);
+			RingForgetMine(r);
+		}
+		else
+			HistoryRingAddForeign(ls, line, when);
+		r->tail += LINENOISE_RING_ALIGN(sizeof(*rec) + len + 1);
 	}
+	free(line);
 }
 
-/* This is just a wrapper the user may want to call in order to make sure
- * the linenoise returned buffer is freed with the same allocator it was
- * created with. Useful when the main program is using an alternative
- * allocator. */
-void LinenoiseFree(void *ptr)
+/* Append 'line' to the ring and pull it back, together with the records
+ * added by the others before it. Returns -1 if the line should be added to
+ * the local history only. */
+static int HistoryRingPublish(LinenoiseState *ls, const char *line)
 {
-	free(ptr);
-}
+	struct LinenoiseHistoryRing *r	 = ls->history_ring;
+	size_t						 len = strlen(line);
+	struct LinenoiseRingRecord * rec;
+	struct LinenoiseRingMine *	 mine;
+	uint64_t					 off, size;
+	int							 spins;
+
+	/* Duplicates just bump the use count of the local entry. */
+	if (ls->history_len && !strcmp(ls->history[ls->history_len - 1], line))
+		return -1;
+	size = LINENOISE_RING_ALIGN(sizeof(*rec) + len + 1);
+	if (size > r->hdr->size / 4)
+		return -1;
+	if (r->nmine == r->capmine)
+	{
+		size_t cap = r->capmine ? r->capmine * 2 : 4;
 
-/* ================================ History ================================= */
+		mine = realloc(r->mine, sizeof(*mine) * cap);
+		if (mine == NULL)
+			return -1;
+		r->mine	   = mine;
+		r->capmine = cap;
+	}
 
-/* Free the history, but does not reset it. Only used when we have to
- * exit() to avoid memory leaks are reported by valgrind & co. */
-static void FreeHistory(LinenoiseState *ls)
-{
-	if (ls->history)
+	off = atomic_fetch_add_explicit(&r->hdr->head, size, memory_order_acq_rel);
+	rec = (void *)(r->data + off % r->hdr->size);
+	atomic_store_explicit(&rec->offset, UINT64_MAX, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	rec->len  = len;
+	rec->time = (uint32_t)time(NULL);
 	{
-		int j;
+		size_t pos	 = (off + sizeof(*rec)) % r->hdr->size;
+		size_t first = r->hdr->size - pos < len + 1 ? r->hdr->size - pos : len + 1;
 
-		for (j = 0; j < ls->history_len; j++)
-			free(ls->history[j]);
+		memcpy(r->data + pos, line, first);
+		memcpy(r->data, line + first, len + 1 - first);
+	}
+	atomic_store_explicit(&rec->offset, off, memory_order_release);
 
-		free(ls->history);
+	/* Records reserved before ours may still be in flight. Don't keep the
+	 * prompt waiting for a stalled writer though. */
+	r->mine[r->nmine].offset  = off;
+	r->mine[r->nmine++].local = false;
+	for (spins = 0; r->tail <= off && spins < LINENOISE_RING_PUBLISH_TRIES; spins++)
+	{
+		HistoryRingPull(ls);
+		if (r->tail <= off)
+			sched_yield();
 	}
-	ls->history = NULL;
-	ls->history_len = 0;
+	if (r->nmine == 0 || r->mine[r->nmine - 1].offset != off)
+		return 0;
+
+	/* Our record was skipped because we fell behind, or it is still queued
+	 * after a stuck one: add it now, and don't add it again if it is pulled
+	 * later. */
+	if (r->tail > off)
+		r->nmine--;
+	else
+		r->mine[r->nmine - 1].local = true;
+	return -1;
 }
 
-void LinenoiseFreeState(LinenoiseState *ls)
+static void HistoryRingDetach(LinenoiseState *ls)
 {
-	FreeHistory(ls);
-	free(ls->buf);
-	free((void *)ls->prompt);
-	free(ls);
+	if (ls->history_ring == NULL)
+		return;
+	munmap(ls->history_ring->hdr, ls->history_ring->mapsize);
+	free(ls->history_ring->mine);
+	free(ls->history_ring);
+	ls->history_ring = NULL;
 }
 
-/* At exit we'll try to fix the terminal to the initial conditions. */
-void LinenoiseRestore(LinenoiseState *ls)
+/* Where shared memory is not available the ring called 'name' is a file
+ * in the temporary directory. */
+static void RingPath(const char *name, char *path, size_t size)
 {
-	DisableRawMode(ls, ls->ifd);
-	tcsetattr(ls->ifd, TCSAFLUSH, &ls->orig_termios);
-	FreeHistory(ls);
+	const char *dir = getenv("TMPDIR");
+
+	snprintf(path, size, "%s/%s", dir ? dir : "/tmp", name[0] == '/' ? name + 1 : name);
 }
 
-/* This is the API call to add a new entry in the linenoise history.
- * It uses a fixed array of char pointers that are shifted (memmoved)
- * when the history max length is reached in order to remove the older
- * entry and make room for the new one, so it is not exactly suitable for huge
- * histories, but will work well for a few hundred of entries.
- *
- * Using a circular buffer is smarter, but a bit more complex to handle. */
-int LinenoiseHistoryAdd(LinenoiseState *ls, const char *line)
+/* Open the ring called 'name', setting 'created' if we created it. The
+ * file used where shared memory is not available must not be a link
+ * planted by someone else. */
+static int RingOpen(const char *name, bool *created)
 {
-	char *linecopy;
+	char path[PATH_MAX];
+	int	 fd;
 
-	if (ls->history_max_len == 0)
-		return 0;
-
-	/* Initialization on first call. */
-	if (ls->history == NULL)
+	*created = true;
+	if ((fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR)) != -1)
+		return fd;
+	if (errno == EEXIST)
 	{
-		ls->history = malloc(sizeof(char *) * ls->history_max_len);
-		if (ls->history == NULL)
-			return 0;
-		memset(ls->history, 0, (sizeof(char *) * ls->history_max_len));
+		*created = false;
+		return shm_open(name, O_RDWR, 0);
 	}
 
-	/* Don't add duplicated lines. */
-	if (ls->history_len && !strcmp(ls->history[ls->history_len - 1], line))
-		return 0;
+	RingPath(name, path, sizeof(path));
+	if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, S_IRUSR | S_IWUSR)) != -1 || errno != EEXIST)
+		return fd;
+	*created = false;
+	return open(path, O_RDWR | O_NOFOLLOW);
+}
 
-	/* Add an heap allocated copy of the line in the history.
-	 * If we reached the max length, remove the older line. */
-	linecopy = strdup(line);
-	if (!linecopy)
-		return 0;
-	if (ls->history_len == ls->history_max_len)
+/* Remove the ring called 'name' if it is still the object 'st', whose
+ * creator died before initializing it, so that the next process creates
+ * it again instead of waiting for it forever. */
+static void RingUnlinkStale(const char *name, const struct stat *st)
+{
+	char		path[PATH_MAX];
+	struct stat cur;
+	bool		shm = true;
+	int			fd;
+
+	if ((fd = shm_open(name, O_RDONLY, 0)) == -1)
 	{
-		free(ls->history[0]);
-		memmove(ls->history, ls->history + 1, sizeof(char *) * (ls->history_max_len - 1));
-		ls->history_len--;
+		RingPath(name, path, sizeof(path));
+		shm = false;
+		if ((fd = open(path, O_RDONLY | O_NOFOLLOW)) == -1)
+			return;
 	}
-
-	ls->history[ls->history_len] = linecopy;
-	ls->history_len++;
-	return 1;
+	if (fstat(fd, &cur) == 0 && cur.st_dev == st->st_dev && cur.st_ino == st->st_ino)
+	{
+		if (shm)
+			shm_unlink(name);
+		else
+			unlink(path);
+	}
+	close(fd);
 }
 
-/* Set the maximum length for the history. This function can be called even
- * if there is already some history, the function will make sure to retain
- * just the latest 'len' elements if the new history length value is smaller
- * than the amount of items already inside the history. */
-int LinenoiseHistorySetMaxLen(LinenoiseState *ls, int len)
+/* Map the ring called 'name', creating it with 'size' bytes of data if it
+ * does not exist, and wait for its creator to initialize it. Sets 'st' to
+ * the object mapped, and 'stale' if its creator did not finish in time.
+ * Returns NULL on error. */
+static struct LinenoiseRingHeader *RingMap(const char *name, size_t size, struct stat *st, bool *stale)
 {
-	char **new;
-
-	if (len < 1)
-		return 0;
-	if (ls->history)
+	struct LinenoiseRingHeader *hdr;
+	struct timespec				ms = {0, 1000000};
+	void *						map;
+	bool						created;
+	int							fd, waited;
+
+	/* Only share with processes of the same user. */
+	*stale = false;
+	fd	   = RingOpen(name, &created);
+	if (fd == -1)
+		return NULL;
+	if (fstat(fd, st) == -1 || !S_ISREG(st->st_mode) || st->st_uid != geteuid() ||
+		(st->st_mode & (S_IRWXG | S_IRWXO)))
 	{
-		int tocopy = ls->history_len;
+		close(fd);
+		return NULL;
+	}
 
-		new = malloc(sizeof(char *) * len);
-		if (new == NULL)
-			return 0;
+	/* Only the creator sets the size, the others wait for it. */
+	if (created && (ftruncate(fd, sizeof(*hdr) + size) == -1 || fstat(fd, st) == -1))
+	{
+		close(fd);
+		return NULL;
+	}
+	for (waited = 0; st->st_size == 0 && waited < LINENOISE_RING_ATTACH_WAIT; waited++)
+	{
+		nanosleep(&ms, NULL);
+		if (fstat(fd, st) == -1)
+			break;
+	}
+	if ((size_t)st->st_size < sizeof(*hdr) + 4096)
+	{
+		*stale = st->st_size == 0;
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st->st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
 
-		/* If we can't copy everything, free the elements we'll not use. */
-		if (len < tocopy)
+	/* The others wait for the creator to initialize the header. */
+	hdr = map;
+	if (created)
+	{
+		memcpy(hdr->magic, LINENOISE_RING_MAGIC, sizeof(hdr->magic));
+		hdr->size = (st->st_size - sizeof(*hdr)) & ~(uint64_t)15;
+		atomic_store(&hdr->head, 0);
+		atomic_store_explicit(&hdr->state, 2, memory_order_release);
+	}
+	for (waited = 0; atomic_load_explicit(&hdr->state, memory_order_acquire) != 2; waited++)
+	{
+		if (waited == LINENOISE_RING_ATTACH_WAIT)
 		{
-			int j;
-
-			for (j = 0; j < tocopy - len; j++)
-				free(ls->history[j]);
-			tocopy = len;
+			*stale = true;
+			munmap(map, st->st_size);
+			return NULL;
 		}
-		memset(new, 0, sizeof(char *) * len);
-		memcpy(new, ls->history + (ls->history_len - tocopy), sizeof(char *) * tocopy);
-		free(ls->history);
-		ls->history = new;
+		nanosleep(&ms, NULL);
 	}
-
-	ls->history_max_len = len;
-	if (ls->history_len > ls->history_max_len)
-		ls->history_len = ls->history_max_len;
-	return 1;
+	if (memcmp(hdr->magic, LINENOISE_RING_MAGIC, sizeof(hdr->magic)) || hdr->size > st->st_size - sizeof(*hdr))
+	{
+		munmap(map, st->st_size);
+		return NULL;
+	}
+	return hdr;
 }
 
-/* Save the history in the specified file. On success 0 is returned
- * otherwise -1 is returned. */
-int LinenoiseHistorySave(const LinenoiseState *ls, const char *filename)
+/* Share the history with every process attaching the ring called 'name',
+ * a POSIX shared memory object of 'size' bytes, or the default size if 0.
+ * Where shared memory is not available a file with the same name in the
+ * temporary directory is used. The entries already in the ring are added
+ * to the history, and from now on LinenoiseHistoryAdd() goes through the
+ * ring. Returns 0 on success, -1 on error. */
+int LinenoiseHistoryAttachRing(LinenoiseState *ls, const char *name, size_t size)
 {
-	mode_t old_umask = umask(S_IXUSR | S_IRWXG | S_IRWXO);
-	FILE * fp;
-	int	   j;
+	struct LinenoiseHistoryRing *r;
+	struct LinenoiseRingHeader * hdr;
+	struct stat					 st;
+	bool						 stale;
 
-	fp = fopen(filename, "w");
-	umask(old_umask);
-	if (fp == NULL)
+	size = LINENOISE_RING_ALIGN(size ? size : LINENOISE_DEFAULT_RING_SIZE);
+	if (size < 4096 || size > UINT32_MAX - 15)
 		return -1;
 
-	chmod(filename, S_IRUSR | S_IWUSR);
-	for (j = 0; j < ls->history_len; j++)
-		fprintf(fp, "%s\n", ls->history[j]);
-
-	fclose(fp);
-	return 0;
-}
-
-/* Load the history from the specified file. If the file does not exist
- * zero is returned and no operation is performed.
- *
- * If the file exists and the operation succeeded 0 is returned, otherwise
- * on error -1 is returned. */
-int LinenoiseHistoryLoad(LinenoiseState *ls, const char *filename)
-{
-	FILE *fp = fopen(filename, "r");
-	char  buf[LINENOISE_MAX_LINE];
-
-	if (fp == NULL)
+	/* A ring whose creator died before initializing it would never be
+	 * usable: replace it, once. */
+	hdr = RingMap(name, size, &st, &stale);
+	if (hdr == NULL && stale)
+	{
+		RingUnlinkStale(name, &st);
+		hdr = RingMap(name, size, &st, &stale);
+	}
+	if (hdr == NULL)
 		return -1;
-
-	while (fgets(buf, LINENOISE_MAX_LINE, fp) != NULL)
+	r = malloc(sizeof(*r));
+	if (r == NULL)
 	{
-		char *p;
+		munmap(hdr, st.st_size);
+		return -1;
+	}
 
-		p = strchr(buf, '\r');
-		if (!p)
-			p = strchr(buf, '\n');
+	HistoryRingDetach(ls);
+	r->hdr			 = hdr;
+	r->data			 = (unsigned char *)(hdr + 1);
+	r->mapsize		 = st.st_size;
+	r->tail			 = 0;
+	r->mine			 = NULL;
+	r->nmine		 = 0;
+	r->capmine		 = 0;
+	ls->history_ring = r;
+
+	/* Read what the ring still holds. */
+	{
+		uint64_t head = atomic_load_explicit(&hdr->head, memory_order_acquire);
 
-		if (p)
-			*p = '\0';
-		LinenoiseHistoryAdd(ls, buf);
+		if (head > hdr->size)
+			r->tail = RingResync(r, head - hdr->size, head);
 	}
-	fclose(fp);
+	HistoryRingPull(ls);
 	return 0;
 }
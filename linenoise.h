@@ -38,6 +38,7 @@
 
 #pragma once
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <termios.h>
 
@@ -46,12 +47,93 @@ extern "C"
 {
 #endif
 
+	struct LinenoiseTrigramIndex;
+	struct LinenoisePrefixIndex;
+	struct LinenoiseHistorySeen;
+	struct LinenoiseHistoryFile;
+	struct LinenoiseHistoryMap;
+	struct LinenoiseHistoryRing;
+	struct LinenoiseHistoryColumns;
+	struct LinenoiseHistoryEdit;
+
+	struct LinenoiseCompletionChunk;
+	struct LinenoiseCompletionCache;
+	typedef struct LinenoiseCompletionRequest LinenoiseCompletionRequest;
+	typedef struct LinenoiseTrie			  LinenoiseTrie;
+
 	typedef struct LinenoiseCompletions
 	{
-		size_t len;
-		char **cvec;
+		size_t							 len;
+		char **							 cvec;
+		size_t							 cap;	/* Room in cvec. */
+		struct LinenoiseCompletionChunk *arena; /* Blocks the strings are stored in. */
 	} LinenoiseCompletions;
 
+	/* How hard the background history writer tries to get the entries on
+	 * disk, see LinenoiseHistorySetWriter(). */
+	enum LinenoiseDurability
+	{
+		LINENOISE_DURABILITY_NONE,	   /* Just write(), the kernel syncs when it likes. */
+		LINENOISE_DURABILITY_INTERVAL, /* One fdatasync() after every batch. */
+		LINENOISE_DURABILITY_SYNC	   /* Also LinenoiseHistoryAppend() waits for the batch. */
+	};
+
+	enum LinenoiseHistoryFormat
+	{
+		LINENOISE_HISTORY_BASH, /* One command per line, "#<time>" lines with HISTTIMEFORMAT. */
+		LINENOISE_HISTORY_ZSH,	/* ": <time>:<duration>;<command>" with EXTENDED_HISTORY. */
+		LINENOISE_HISTORY_FISH	/* "- cmd: <command>" and "  when: <time>" entries. */
+	};
+
+	typedef struct LinenoiseHistoryWriterStats
+	{
+		size_t	 queued;	   /* Entries waiting to be written. */
+		size_t	 queued_bytes; /* Bytes waiting to be written. */
+		uint64_t written;	   /* Entries written so far. */
+		uint64_t batches;	   /* Batches written so far, one write() each. */
+		uint64_t syncs;		   /* fdatasync() calls so far. */
+		uint64_t errors;	   /* Failed batches. */
+	} LinenoiseHistoryWriterStats;
+
+	/* Bytes accounted for every history entry besides its string, see
+	 * LinenoiseHistoryGetBytes(). */
+#define LINENOISE_HISTORY_ENTRY_OVERHEAD (sizeof(char *) + 2 * sizeof(uint32_t))
+
+	/* Exit status of the history entries that never got one. */
+#define LINENOISE_HISTORY_NO_STATUS INT32_MIN
+
+	/* Metadata of a history entry, see LinenoiseHistoryGetMeta(). */
+	typedef struct LinenoiseHistoryMeta
+	{
+		uint32_t	time;	  /* Last use, seconds since the epoch. */
+		uint32_t	uses;	  /* How many times it was used. */
+		uint32_t	duration; /* How long it ran, in milliseconds. */
+		int32_t		status;	  /* Exit status, LINENOISE_HISTORY_NO_STATUS if unknown. */
+		const char *cwd;	  /* Directory it ran in, NULL if unknown. */
+	} LinenoiseHistoryMeta;
+
+	/* Conditions of LinenoiseHistoryFilter(), the zero ones are ignored. */
+	typedef struct LinenoiseHistoryQuery
+	{
+		uint32_t	since;		  /* Used at or after this time. */
+		bool		failed;		  /* Exited with a known non zero status. */
+		uint32_t	min_duration; /* Ran at least this many milliseconds. */
+		const char *cwd;		  /* Ran in this directory. */
+	} LinenoiseHistoryQuery;
+
+	enum LinenoiseHistoryOrder
+	{
+		LINENOISE_HISTORY_NEWEST_FIRST,
+		LINENOISE_HISTORY_OLDEST_FIRST
+	};
+
+	typedef struct LinenoiseCompletionCacheStats
+	{
+		uint64_t hits;	  /* Completions served from the cache, narrowed or not. */
+		uint64_t misses;  /* Completions the callback was called for. */
+		size_t	 entries; /* Lines cached. */
+	} LinenoiseCompletionCacheStats;
+
 	/* The linenoiseState structure represents the state during line editing.
 	 * We pass this state to functions implementing specific editing
 	 * functionalities. */
@@ -74,18 +156,90 @@ extern "C"
 		bool		   rawmode;			/* For atexit() function to check if restore is needed, false by default. */
 		bool		   mlmode;			/* Multi line mode. Default is single line. */
 		bool		   nonblock;		/* Non-blocking mode. Default is blocking. */
+		bool		   history_prefix_search; /* Up/down only show entries starting with the typed text. */
+		bool		   history_autosuggest;	  /* Suggest the newest history entry starting with the typed text. */
+		bool		   history_frecency;	  /* Rank history suggestions by frecency instead of recency. */
+		bool		   history_interned;	  /* Entries point into the process-wide shared store. */
 		int			   history_max_len; /* Maximum length of the history */
 		int			   history_len;		/* Current length of the history */
+		int			   history_start;	/* Entries evicted since the history arrays were allocated. */
+		int			   history_cap;		/* Room in the history arrays, evicted entries included. */
+		size_t		   history_bytes;	/* Bytes taken by the history, see LinenoiseHistoryGetBytes(). */
+		size_t		   history_max_bytes; /* Maximum bytes the history may take, 0 for no limit. */
 		char **		   history;			/* The history */
+		char *		   history_scratch; /* The edited line while browsing the history. */
+		struct LinenoiseHistoryEdit *history_edits; /* Changes to the history entries while browsing them. */
+		int			   history_edits_len; /* Entries changed while editing this line. */
+		int			   history_edits_cap; /* Room in history_edits. */
+		uint32_t *	   history_uses;	/* How many times every history entry was used. */
+		uint32_t *	   history_time;	/* When every history entry was last used, seconds since the epoch. */
+		struct LinenoiseTrigramIndex *history_trigrams; /* Optional substring index of the history. */
+		struct LinenoisePrefixIndex * history_prefixes; /* Optional sorted index of the history. */
+		struct LinenoiseHistorySeen * history_seen;		/* Newest entry of every distinct line. */
+		struct LinenoiseHistoryFile * history_file;		/* File new entries are appended to, if any. */
+		struct LinenoiseHistoryMap *  history_maps;		/* Binary history files the entries may point into. */
+		struct LinenoiseHistoryRing * history_ring;		/* Shared memory ring, if attached. */
+		LinenoiseCompletionRequest *  completion_request; /* Pending asynchronous completion, if any. */
+		int							  completion_fd;	  /* Signaled when it is done, -1 until needed. */
+		int							  completion_wfd;	  /* Write end of completion_fd, the same for an eventfd. */
+		struct LinenoiseCompletionCache *completion_cache; /* Completions of the last lines, if enabled. */
+		struct LinenoiseHistoryColumns *history_columns; /* Optional per entry metadata. */
 	} LinenoiseState;
 
+	/* Iteration over the history, see LinenoiseHistoryIterBegin(). */
+	typedef struct LinenoiseHistoryIter
+	{
+		const LinenoiseState *ls;
+		const char *		  prefix;	  /* Only entries starting with it, if not NULL. */
+		size_t				  prefix_len; /* Length of prefix. */
+		int					  next;		  /* Index of the next entry to look at. */
+		int					  step;		  /* 1 oldest first, -1 newest first. */
+		int					  index;	  /* Index of the last entry returned. */
+	} LinenoiseHistoryIter;
+
+	/* A fixed set of words, generated at build time by mkcmdtable. */
+	typedef struct LinenoiseCommandTable
+	{
+		const char *const *words;	 /* Sorted. */
+		size_t			   nwords;
+		const uint32_t *   seeds;	 /* Hash seed of every bucket. */
+		size_t			   nbuckets;
+		const uint32_t *   slots;	 /* Index in words of every hash slot. */
+	} LinenoiseCommandTable;
+
 	typedef void(LinenoiseCompletionCallback)(const char *, LinenoiseCompletions *);
+	typedef void(LinenoiseAsyncCompletionCallback)(LinenoiseCompletionRequest *, const char *);
 	typedef char *(LinenoiseHintsCallback)(const char *, int *color, int *bold);
 	typedef void(LinenoiseFreeHintsCallback)(void *);
 	void LinenoiseSetCompletionCallback(LinenoiseCompletionCallback *);
+	void LinenoiseSetAsyncCompletionCallback(LinenoiseAsyncCompletionCallback *);
 	void LinenoiseSetHintsCallback(LinenoiseHintsCallback *);
 	void LinenoiseSetFreeHintsCallback(LinenoiseFreeHintsCallback *);
 	void LinenoiseAddCompletion(LinenoiseCompletions *, const char *);
+	void LinenoiseAddCompletionN(LinenoiseCompletions *, const char *, size_t);
+	void LinenoiseAddCompletions(LinenoiseCompletions *, const char **, size_t);
+	int	 LinenoiseSetCompletionCache(LinenoiseState *ls, int entries, int monotonic);
+	void LinenoiseInvalidateCompletionCache(LinenoiseState *ls);
+	int	 LinenoiseGetCompletionCacheStats(const LinenoiseState *ls, LinenoiseCompletionCacheStats *stats);
+
+	const char *		  LinenoiseCompletionRequestLine(const LinenoiseCompletionRequest *req);
+	LinenoiseCompletions *LinenoiseCompletionRequestResults(LinenoiseCompletionRequest *req);
+	int					  LinenoiseCompletionRequestCancelled(const LinenoiseCompletionRequest *req);
+	void				  LinenoiseCompletionRequestFlush(LinenoiseCompletionRequest *req);
+	void				  LinenoiseCompletionRequestDone(LinenoiseCompletionRequest *req);
+
+	LinenoiseTrie *LinenoiseTrieCreate(void);
+	void		   LinenoiseTrieFree(LinenoiseTrie *t);
+	int			   LinenoiseTrieInsert(LinenoiseTrie *t, const char *word);
+	int			   LinenoiseTrieRemove(LinenoiseTrie *t, const char *word);
+	int			   LinenoiseTrieBuild(LinenoiseTrie *t, const char **words, size_t n);
+	size_t		   LinenoiseTrieSize(const LinenoiseTrie *t);
+	size_t		   LinenoiseTrieComplete(const LinenoiseTrie *t, const char *prefix, LinenoiseCompletions *lc, size_t max);
+	void		   LinenoiseSetCompletionTrie(LinenoiseTrie *t);
+
+	uint32_t LinenoiseCommandHash(const char *s, size_t len, uint32_t seed);
+	int		 LinenoiseCommandTableContains(const LinenoiseCommandTable *t, const char *word, size_t len);
+	size_t	 LinenoiseCommandTableComplete(const LinenoiseCommandTable *t, const char *prefix, LinenoiseCompletions *lc, size_t max);
 
 	char *			Linenoise(LinenoiseState *ls);
 	void			LinenoiseClearBuffer(LinenoiseState *ls);
@@ -94,8 +248,40 @@ extern "C"
 	void			LinenoiseRestore(LinenoiseState *ls);
 	int				LinenoiseHistoryAdd(LinenoiseState *ls, const char *line);
 	int				LinenoiseHistorySetMaxLen(LinenoiseState *ls, int len);
+	int				LinenoiseHistorySetMaxBytes(LinenoiseState *ls, size_t bytes);
+	size_t			LinenoiseHistoryGetBytes(const LinenoiseState *ls);
+	void			LinenoiseHistoryIterBegin(const LinenoiseState *ls, LinenoiseHistoryIter *it, int order, const char *prefix);
+	int				LinenoiseHistoryIterNext(LinenoiseHistoryIter *it, const char **line, size_t *len);
 	int				LinenoiseHistorySave(const LinenoiseState *ls, const char *filename);
 	int				LinenoiseHistoryLoad(LinenoiseState *ls, const char *filename);
+	int				LinenoiseHistoryImport(LinenoiseState *ls, const char *filename, int threads);
+	int				LinenoiseHistoryImportShell(LinenoiseState *ls, const char *filename, int format);
+	int				LinenoiseHistorySaveBinary(const LinenoiseState *ls, const char *filename);
+	int				LinenoiseHistoryTextToBinary(const char *from, const char *to);
+	int				LinenoiseHistoryBinaryToText(const char *from, const char *to);
+	int				LinenoiseHistoryOpen(LinenoiseState *ls, const char *filename);
+	int				LinenoiseHistoryAppend(LinenoiseState *ls);
+	int				LinenoiseHistorySetCompactSize(LinenoiseState *ls, size_t size);
+	int				LinenoiseHistorySetShared(LinenoiseState *ls, int enable);
+	int				LinenoiseHistorySetLiveSync(LinenoiseState *ls, int enable);
+	int				LinenoiseHistoryWatchFd(const LinenoiseState *ls);
+	int				LinenoiseHistorySync(LinenoiseState *ls);
+	int				LinenoiseHistorySetWriter(LinenoiseState *ls, int interval, int durability);
+	void			LinenoiseHistoryFlush(LinenoiseState *ls);
+	int				LinenoiseHistoryGetWriterStats(const LinenoiseState *ls, LinenoiseHistoryWriterStats *stats);
+	int				LinenoiseHistorySetTrigramIndex(LinenoiseState *ls, int enable);
+	int				LinenoiseHistorySearch(LinenoiseState *ls, const char *needle, int from);
+	int				LinenoiseHistorySetPrefixSearch(LinenoiseState *ls, int enable);
+	int				LinenoiseHistorySetAutosuggest(LinenoiseState *ls, int enable);
+	int				LinenoiseHistorySetFrecency(LinenoiseState *ls, int enable);
+	int				LinenoiseHistoryTopFrecent(LinenoiseState *ls, const char *prefix, int *top, int k);
+	int				LinenoiseHistorySetMetadata(LinenoiseState *ls, int enable);
+	int				LinenoiseHistorySetResult(LinenoiseState *ls, int status, uint32_t duration, const char *cwd);
+	int				LinenoiseHistoryGetMeta(const LinenoiseState *ls, int index, LinenoiseHistoryMeta *meta);
+	int				LinenoiseHistoryFilter(const LinenoiseState *ls, const LinenoiseHistoryQuery *q, int *out, int max);
+	int				LinenoiseHistorySetInterned(LinenoiseState *ls, int enable);
+	void			LinenoiseHistoryGetInternStats(size_t *strings, size_t *bytes);
+	int				LinenoiseHistoryAttachRing(LinenoiseState *ls, const char *name, size_t size);
 	void			LinenoiseClearScreen(const LinenoiseState *ls);
 	void			LinenoiseSetMultiLine(LinenoiseState *ls, int ml);
 	void			LinenoisePrintKeyCodes(LinenoiseState *ls);
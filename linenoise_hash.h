@@ -0,0 +1,28 @@
+/* linenoise_hash.h -- the hash of the command tables.
+ *
+ * Shared by linenoise.c and the mkcmdtable build tool, that must agree on
+ * it bit for bit, so that the tool builds without the library.
+ *
+ * See linenoise.c for the license.
+ */
+
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* Seeded FNV-1a, with a final avalanche so that every seed spreads the
+ * words differently. */
+static inline uint32_t LinenoiseHashCommand(const char *s, size_t len, uint32_t seed)
+{
+	uint32_t h = 2166136261u ^ (seed * 0x9e3779b9u);
+	size_t	 j;
+
+	for (j = 0; j < len; j++)
+		h = (h ^ (unsigned char)s[j]) * 16777619u;
+	h ^= h >> 16;
+	h *= 0x85ebca6bu;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35u;
+	h ^= h >> 16;
+	return h;
+}
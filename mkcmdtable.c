@@ -0,0 +1,210 @@
+/* mkcmdtable -- generate a static LinenoiseCommandTable from a word list.
+ *
+ * Usage: mkcmdtable <name> [file] > name.h
+ *
+ * Reads one word per line from 'file', or the standard input, skipping
+ * empty lines and lines starting with '#', and writes a C header defining
+ * the table 'name': the words sorted, and the seeds and slots of a minimal
+ * perfect hash of them, found with the hash and displace scheme. Including
+ * the header costs nothing at run time. */
+
+#include "linenoise_hash.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static char **words	 = NULL;
+static size_t nwords = 0;
+
+static int CompareWords(const void *a, const void *b) { return strcmp(*(char *const *)a, *(char *const *)b); }
+
+/* Number of words of every bucket, to place the biggest first. */
+static size_t *bucket_size;
+
+static int CompareBuckets(const void *a, const void *b)
+{
+	size_t x = bucket_size[*(const uint32_t *)a], y = bucket_size[*(const uint32_t *)b];
+
+	if (x != y)
+		return x < y ? 1 : -1;
+	return *(const uint32_t *)a < *(const uint32_t *)b ? -1 : 1;
+}
+
+static void ReadWords(FILE *fp)
+{
+	char * line = NULL;
+	size_t cap	= 0, room = 0;
+	long   len;
+
+	while ((len = getline(&line, &cap, fp)) != -1)
+	{
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+			line[--len] = '\0';
+		if (len == 0 || line[0] == '#')
+			continue;
+		if (nwords == room)
+		{
+			room  = room ? room * 2 : 64;
+			words = realloc(words, sizeof(*words) * room);
+			if (words == NULL)
+			{
+				perror("mkcmdtable");
+				exit(1);
+			}
+		}
+		if ((words[nwords++] = strdup(line)) == NULL)
+		{
+			perror("mkcmdtable");
+			exit(1);
+		}
+	}
+	free(line);
+}
+
+/* Write 's' as a C string literal. */
+static void PrintString(const char *s)
+{
+	putchar('"');
+	for (; *s; s++)
+	{
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 32 || c >= 127)
+			printf("\\%03o", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+int main(int argc, char **argv)
+{
+	size_t	  nbuckets, j, k;
+	uint32_t *bucket, *order, *seeds, *slots, *tried, *members;
+	size_t *  first;
+	char *	  taken;
+	FILE *	  fp = stdin;
+
+	if (argc < 2 || argc > 3)
+	{
+		fprintf(stderr, "Usage: %s <name> [file]\n", argv[0]);
+		return 1;
+	}
+	if (argc == 3 && (fp = fopen(argv[2], "r")) == NULL)
+	{
+		perror(argv[2]);
+		return 1;
+	}
+	ReadWords(fp);
+
+	if (nwords)
+		qsort(words, nwords, sizeof(*words), CompareWords);
+	for (j = 1; j < nwords; j++)
+	{
+		if (!strcmp(words[j - 1], words[j]))
+		{
+			fprintf(stderr, "mkcmdtable: duplicate word '%s'\n", words[j]);
+			return 1;
+		}
+	}
+
+	/* About four words a bucket keeps the seeds few and quick to find. */
+	nbuckets	= nwords / 4 + 1;
+	bucket		= calloc(nwords + 1, sizeof(*bucket));
+	bucket_size = calloc(nbuckets, sizeof(*bucket_size));
+	order		= calloc(nbuckets, sizeof(*order));
+	seeds		= calloc(nbuckets, sizeof(*seeds));
+	slots		= calloc(nwords + 1, sizeof(*slots));
+	tried		= calloc(nwords + 1, sizeof(*tried));
+	taken		= calloc(nwords + 1, 1);
+	members		= calloc(nwords + 1, sizeof(*members));
+	first		= calloc(nbuckets + 1, sizeof(*first));
+	if (!bucket || !bucket_size || !order || !seeds || !slots || !tried || !taken || !members || !first)
+	{
+		perror("mkcmdtable");
+		return 1;
+	}
+	for (j = 0; j < nwords; j++)
+	{
+		bucket[j] = LinenoiseHashCommand(words[j], strlen(words[j]), 0) % nbuckets;
+		bucket_size[bucket[j]]++;
+	}
+	/* The words of every bucket, together. 'tried' counts them meanwhile. */
+	for (j = 0; j < nbuckets; j++)
+		first[j + 1] = first[j] + bucket_size[j];
+	for (j = 0; j < nwords; j++)
+		members[first[bucket[j]] + tried[bucket[j]]++] = j;
+	for (j = 0; j < nbuckets; j++)
+		order[j] = j;
+	qsort(order, nbuckets, sizeof(*order), CompareBuckets);
+
+	/* Place the biggest buckets first, while most slots are free: try the
+	 * seeds in turn until all the words of the bucket get a free slot. */
+	for (j = 0; j < nbuckets && bucket_size[order[j]]; j++)
+	{
+		uint32_t b = order[j], seed;
+		size_t	 placed = 0;
+
+		for (seed = 1; seed != 0; seed++)
+		{
+			for (placed = 0, k = first[b]; k < first[b + 1]; k++)
+			{
+				uint32_t w = members[k], slot = LinenoiseHashCommand(words[w], strlen(words[w]), seed) % nwords;
+
+				if (taken[slot])
+					break;
+				taken[slot]		= 1;
+				tried[placed++] = slot;
+				slots[slot]		= w;
+			}
+			if (placed == bucket_size[b])
+				break;
+			while (placed)
+				taken[tried[--placed]] = 0;
+		}
+		if (seed == 0)
+		{
+			fprintf(stderr, "mkcmdtable: no perfect hash found\n");
+			return 1;
+		}
+		seeds[b] = seed;
+	}
+
+	printf("/* Generated by mkcmdtable, do not edit. */\n\n");
+	printf("static const char *const %s_words[] = {\n", argv[1]);
+	for (j = 0; j < nwords; j++)
+	{
+		printf("\t");
+		PrintString(words[j]);
+		printf(",\n");
+	}
+	printf("%s};\n\n", nwords ? "" : "\tNULL,\n");
+	printf("static const uint32_t %s_seeds[] = {", argv[1]);
+	for (j = 0; j < nbuckets; j++)
+		printf("%s%u", j == 0 ? "\n\t" : j % 8 ? ", " : ",\n\t", seeds[j]);
+	printf(",\n};\n\n");
+	printf("static const uint32_t %s_slots[] = {", argv[1]);
+	for (j = 0; j < (nwords ? nwords : 1); j++)
+		printf("%s%u", j == 0 ? "\n\t" : j % 8 ? ", " : ",\n\t", slots[j]);
+	printf(",\n};\n\n");
+	printf("static const LinenoiseCommandTable %s = {\n\t%s_words, %zu, %s_seeds, %zu, %s_slots,\n};\n", argv[1], argv[1], nwords, argv[1],
+		   nbuckets, argv[1]);
+
+	for (j = 0; j < nwords; j++)
+		free(words[j]);
+	free(words);
+	free(bucket);
+	free(bucket_size);
+	free(order);
+	free(seeds);
+	free(slots);
+	free(tried);
+	free(taken);
+	free(members);
+	free(first);
+	if (fp != stdin)
+		fclose(fp);
+	return ferror(stdout) || fflush(stdout) ? 1 : 0;
+}